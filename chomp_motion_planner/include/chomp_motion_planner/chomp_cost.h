@@ -39,6 +39,9 @@
 
 #include <eigen3/Eigen/Core>
 #include <chomp_motion_planner/chomp_trajectory.h>
+#include <chomp_motion_planner/chomp_utils.h>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
 #include <vector>
 
 namespace chomp
@@ -46,6 +49,10 @@ namespace chomp
 
 /**
  * \brief Represents the smoothness cost for CHOMP, for a single joint
+ *
+ * The quadratic cost is banded with bandwidth DIFF_RULE_LENGTH-1, so it is kept in band
+ * storage along with a banded Cholesky factorization of its free block. Products and
+ * solves are linear in the number of points.
  */
 class ChompCost
 {
@@ -53,12 +60,37 @@ public:
   ChompCost(const ChompTrajectory& trajectory, int joint_number, const std::vector<double>& derivative_costs, double ridge_factor=0.0);
   virtual ~ChompCost();
 
+  /**
+   * \brief Gets the unscaled cost for the trajectory's number of points and discretization
+   *
+   * The costs are kept in a process-wide cache, so that planning requests with the same
+   * parameters share the factorizations. The returned cost must not be modified, copy it
+   * to scale it.
+   */
+  static boost::shared_ptr<const ChompCost> getCachedCost(const ChompTrajectory& trajectory,
+                                                          const std::vector<double>& derivative_costs,
+                                                          double ridge_factor=0.0);
+
   template<typename Derived>
   void getDerivative(Eigen::MatrixXd::ColXpr joint_trajectory, Eigen::MatrixBase<Derived>& derivative) const;
 
-  const Eigen::MatrixXd& getQuadraticCostInverse() const;
+  /**
+   * \brief Replaces the free variable vector x with the quadratic cost inverse times x
+   */
+  template<typename Derived>
+  void solve(Eigen::MatrixBase<Derived>& x) const;
+
+  /**
+   * \brief Gets column i of the quadratic cost inverse with a single solve
+   */
+  void getQuadraticCostInverseColumn(int i, Eigen::VectorXd& column) const;
 
-  const Eigen::MatrixXd& getQuadraticCost() const;
+  const Eigen::VectorXd& getQuadraticCostInverseDiagonal() const;
+
+  /**
+   * \brief The dense quadratic cost inverse, computed from the factorization on first use
+   */
+  const Eigen::MatrixXd& getQuadraticCostInverse() const;
 
   double getCost(Eigen::MatrixXd::ColXpr joint_trajectory) const;
 
@@ -67,33 +99,75 @@ public:
   void scale(double scale);
 
 private:
+  static const int BANDWIDTH = DIFF_RULE_LENGTH-1;
+
+  int num_vars_all_;
+  int num_vars_free_;
+
+  // lower band of the symmetric quad cost for all variables, entry (d,j) holds element (j+d,j)
   Eigen::MatrixXd quad_cost_full_;
-  Eigen::MatrixXd quad_cost_;
-  //Eigen::VectorXd linear_cost_;
-  Eigen::MatrixXd quad_cost_inv_;
+  // the lower Cholesky factor of the free variable block, in the same band storage
+  Eigen::MatrixXd quad_cost_chol_;
+  Eigen::VectorXd quad_cost_inv_diagonal_;
+  mutable Eigen::MatrixXd quad_cost_inv_;
 
-  Eigen::MatrixXd getDiffMatrix(int size, const double* diff_rule) const;
+  void factorize();
+
+  void computeInverseDiagonal();
 };
 
 template<typename Derived>
 void ChompCost::getDerivative(Eigen::MatrixXd::ColXpr joint_trajectory, Eigen::MatrixBase<Derived>& derivative) const
 {
-  derivative = (quad_cost_full_ * (2.0 * joint_trajectory));
+  for (int j=0; j<num_vars_all_; j++)
+    derivative(j) = quad_cost_full_(0,j) * joint_trajectory(j);
+  for (int j=0; j<num_vars_all_; j++)
+  {
+    for (int d=1; d<=BANDWIDTH && j+d<num_vars_all_; d++)
+    {
+      derivative(j+d) += quad_cost_full_(d,j) * joint_trajectory(j);
+      derivative(j) += quad_cost_full_(d,j) * joint_trajectory(j+d);
+    }
+  }
+  derivative *= 2.0;
 }
 
-inline const Eigen::MatrixXd& ChompCost::getQuadraticCostInverse() const
+template<typename Derived>
+void ChompCost::solve(Eigen::MatrixBase<Derived>& x) const
 {
-  return quad_cost_inv_;
+  // forward substitution with L, then back substitution with L^T
+  for (int i=0; i<num_vars_free_; i++)
+  {
+    double sum = x(i);
+    for (int k=std::max(0, i-BANDWIDTH); k<i; k++)
+      sum -= quad_cost_chol_(i-k,k) * x(k);
+    x(i) = sum / quad_cost_chol_(0,i);
+  }
+  for (int i=num_vars_free_-1; i>=0; i--)
+  {
+    double sum = x(i);
+    for (int k=i+1; k<=std::min(num_vars_free_-1, i+BANDWIDTH); k++)
+      sum -= quad_cost_chol_(k-i,i) * x(k);
+    x(i) = sum / quad_cost_chol_(0,i);
+  }
 }
 
-inline const Eigen::MatrixXd& ChompCost::getQuadraticCost() const
+inline const Eigen::VectorXd& ChompCost::getQuadraticCostInverseDiagonal() const
 {
-  return quad_cost_;
+  return quad_cost_inv_diagonal_;
 }
 
 inline double ChompCost::getCost(Eigen::MatrixXd::ColXpr joint_trajectory) const
 {
-  return joint_trajectory.dot(quad_cost_full_ * joint_trajectory);
+  double cost = 0.0;
+  for (int j=0; j<num_vars_all_; j++)
+  {
+    double off_diagonal = 0.0;
+    for (int d=1; d<=BANDWIDTH && j+d<num_vars_all_; d++)
+      off_diagonal += quad_cost_full_(d,j) * joint_trajectory(j+d);
+    cost += joint_trajectory(j) * (quad_cost_full_(0,j) * joint_trajectory(j) + 2.0 * off_diagonal);
+  }
+  return cost;
 }
 
 } // namespace chomp
@@ -46,23 +46,84 @@
 
 #include <eigen3/Eigen/Core>
 
+#include <boost/thread.hpp>
+
+#include <deque>
 #include <vector>
 
 namespace chomp
 {
 
+/**
+ * \brief What several optimizers running at once against the same collision space share
+ *
+ * The trajectory validity checks of the collision space use the planning scene state, so they
+ * are serialized on the validity lock. The first optimizer to find a mesh to mesh safe
+ * trajectory marks the group finished, which stops the others.
+ */
+class ChompOptimizerGroup
+{
+public:
+  ChompOptimizerGroup() : finished_(false) {}
+
+  boost::mutex& getValidityLock()
+  {
+    return validity_lock_;
+  }
+
+  void setFinished()
+  {
+    boost::mutex::scoped_lock lock(finished_lock_);
+    finished_ = true;
+  }
+
+  bool isFinished() const
+  {
+    boost::mutex::scoped_lock lock(finished_lock_);
+    return finished_;
+  }
+
+private:
+  boost::mutex validity_lock_;
+  mutable boost::mutex finished_lock_;
+  bool finished_;
+};
+
 class ChompOptimizer
 {
 public:
+  /**
+   * \brief Creates an optimizer for the trajectory
+   *
+   * Optimizers in an optimizer group pose their own copy of the planning scene state and their
+   * own group sessions, so that their optimize() can run in parallel threads. They have to be
+   * created and destroyed one at a time.
+   */
   ChompOptimizer(ChompTrajectory *trajectory, planning_models::KinematicModel *robot_model,
       const std::string& planning_group, const ChompParameters *parameters,
       const ros::Publisher& vis_marker_array_publisher,
       const ros::Publisher& vis_marker_publisher,
-      collision_proximity::CollisionProximitySpace *collision_space);
+      collision_proximity::CollisionProximitySpace *collision_space,
+      ChompOptimizerGroup *optimizer_group = NULL);
   virtual ~ChompOptimizer();
 
   void optimize();
 
+  bool isCollisionFree() const
+  {
+    return is_collision_free_;
+  }
+
+  double getBestTrajectoryCost() const
+  {
+    return best_group_trajectory_cost_;
+  }
+
+  int getNumIterations() const
+  {
+    return iteration_;
+  }
+
   inline void destroy()
   {
     //Nothing for now.
@@ -92,13 +153,34 @@ private:
 
     return potential;
   }
+  /**
+   * \brief Fills in the jacobian of a collision point, visiting only the group joints that move it
+   */
   template<typename Derived>
-  void getJacobian(int trajectoryPoint,Eigen::Vector3d& collision_point_pos, std::string& jointName, Eigen::MatrixBase<Derived>& jacobian) const;
+  void getJacobian(int trajectoryPoint, const Eigen::Vector3d& collision_point_pos, const std::vector<int>& joints,
+                   Eigen::MatrixBase<Derived>& jacobian) const;
 
   void getRandomState(const planning_models::KinematicState* currentState, const std::string& groupName,
                       Eigen::VectorXd& state_vec);
 
-  void setRobotStateFromPoint(ChompTrajectory& group_trajectory, int i);
+  /**
+   * \brief What one forward kinematics thread works on
+   *
+   * The first context uses robot_state_ and the current group session of the collision space, the
+   * others own a copy of the state and a clone of the session, so that waypoints can be posed and
+   * queried concurrently.
+   */
+  struct ForwardKinematicsContext
+  {
+    planning_models::KinematicState* state;
+    unsigned int group_session;
+    collision_proximity::GradientBuffer gradient_buffer;
+    int start;
+    int end;
+    bool is_collision_free;
+  };
+
+  void setRobotStateFromPoint(ChompTrajectory& group_trajectory, int i, ForwardKinematicsContext& context);
 
   collision_proximity::CollisionProximitySpace::TrajectorySafety checkCurrentIterValidity();
 
@@ -116,10 +198,11 @@ private:
   const std::string& planning_group_;
   const ChompParameters *parameters_;
   collision_proximity::CollisionProximitySpace *collision_space_;
+  ChompOptimizerGroup *optimizer_group_;
   ChompTrajectory group_trajectory_;
   std::vector<ChompCost> joint_costs_;
 
-  std::vector<std::vector<std::string> > collision_point_joint_names_;
+  std::vector<std::vector<int> > collision_point_joints_;        /**< Indices of the group joints moving each collision point */
   std::vector<std::vector<Eigen::Vector3d > > collision_point_pos_eigen_;
   std::vector<std::vector<Eigen::Vector3d > > collision_point_vel_eigen_;
   std::vector<std::vector<Eigen::Vector3d > > collision_point_acc_eigen_;
@@ -141,6 +224,19 @@ private:
   std::vector<MultivariateGaussian> multivariate_gaussian_;
   double stochasticity_factor_;
 
+  // accelerated update rules:
+  Eigen::MatrixXd nesterov_velocity_;
+  Eigen::MatrixXd nesterov_previous_velocity_;
+  std::deque<Eigen::MatrixXd> lbfgs_steps_;                 /**< Recent trajectory changes, oldest first */
+  std::deque<Eigen::MatrixXd> lbfgs_gradient_changes_;      /**< Gradient changes matching lbfgs_steps_ */
+  Eigen::MatrixXd lbfgs_gradient_;
+  Eigen::MatrixXd lbfgs_previous_gradient_;
+  Eigen::MatrixXd lbfgs_previous_trajectory_;
+  Eigen::MatrixXd lbfgs_direction_;
+  Eigen::MatrixXd lbfgs_scaled_gradient_change_;
+  bool lbfgs_has_previous_;
+  int first_collision_free_iteration_;
+
   std::vector<int> state_is_in_collision_;      /**< Array containing a boolean about collision info for each point in the trajectory */
   std::vector<std::vector<int> > point_is_in_collision_;
   bool is_collision_free_;
@@ -157,11 +253,31 @@ private:
   Eigen::MatrixXd jacobian_jacobian_tranpose_;
   Eigen::VectorXd random_state_;
   Eigen::VectorXd joint_state_velocities_;
+  Eigen::VectorXd quad_cost_inv_column_;
 
   ros::Publisher vis_marker_array_pub_;
   ros::Publisher vis_marker_pub_;
 
+  std::vector<ForwardKinematicsContext> fk_contexts_;
+  boost::thread_group fk_threads_;
+  boost::mutex fk_lock_;
+  boost::condition_variable fk_start_condition_;
+  boost::condition_variable fk_done_condition_;
+  unsigned int fk_generation_;
+  unsigned int fk_threads_done_;
+  bool fk_shutdown_;
+
   std::vector<std::string> joint_names_;
+
+  // per-joint model properties, looked up once so that the iterations don't touch the model maps
+  std::vector<double> joint_min_;
+  std::vector<double> joint_max_;
+  std::vector<int> joint_is_continuous_;
+  std::vector<double> joint_update_limits_;
+  std::vector<tf::Vector3> joint_local_axes_;
+  std::vector<tf::Transform> joint_origin_transforms_;
+  std::vector<unsigned int> joint_state_indices_;
+  std::vector<unsigned int> joint_parent_link_state_indices_;
   std::map<std::string, std::map<std::string, bool> > joint_parent_map_;
 
   inline bool isParent(const std::string& childLink, const std::string& parentLink) const
@@ -181,12 +297,34 @@ private:
   }
 
   void registerParents(const planning_models::KinematicModel::JointModel* model);
+  void initializeJointProperties(const planning_models::KinematicModel::JointModelGroup* modelGroup);
   void initialize();
   void calculateSmoothnessIncrements();
   void calculateCollisionIncrements();
   void calculateTotalIncrements();
   void performForwardKinematics();
+  void performForwardKinematics(ForwardKinematicsContext& context);
+  void startForwardKinematicsThreads();
+  void stopForwardKinematicsThreads();
+  void forwardKinematicsThread(unsigned int index);
   void addIncrementsToTrajectory();
+
+  /**
+   * \brief Nesterov momentum on the covariant increments
+   *
+   * The trajectory is kept at the look-ahead point, where the increments were computed.
+   */
+  void addNesterovIncrementsToTrajectory();
+
+  /**
+   * \brief Limited memory BFGS step with a backtracking line search on getTrajectoryCost()
+   *
+   * The smoothness metric is the initial inverse hessian, so with no history this is the plain
+   * covariant step. Falls back to addIncrementsToTrajectory() if the line search fails.
+   */
+  void addLbfgsIncrementsToTrajectory();
+
+  void resetUpdateHistory();
   void updateFullTrajectory();
   void debugCost();
   void handleJointLimits();
@@ -201,7 +339,7 @@ private:
   void updateMomentum();
   void updatePositionFromMomentum();
   void calculatePseudoInverse();
-  void computeJointProperties(int trajectoryPoint);
+  void computeJointProperties(int trajectoryPoint, planning_models::KinematicState* state);
 
 };
 
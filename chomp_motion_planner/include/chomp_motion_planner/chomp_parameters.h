@@ -53,6 +53,7 @@ public:
   double getPlanningTimeLimit() const;
   void setPlanningTimeLimit(double planning_time_limit);
   int getMaxIterations() const;
+  void setMaxIterations(int max_iterations);
   int getMaxIterationsAfterCollisionFree() const;
   double getSmoothnessCostWeight() const;
   double getObstacleCostWeight() const;
@@ -63,6 +64,7 @@ public:
   double getSmoothnessCostJerk() const;
   bool getAddRandomness() const;
   bool getUseHamiltonianMonteCarlo() const;
+  void setUseHamiltonianMonteCarlo(bool use_hmc);
   double getHmcDiscretization() const;
   double getHmcStochasticity() const;
   double getHmcAnnealingFactor() const;
@@ -79,6 +81,15 @@ public:
   double getRandomJumpAmount() const;
   void setRandomJumpAmount(double amount);
   bool getUseStochasticDescent() const;
+  int getNumThreads() const;
+  int getNumStarts() const;
+  int getCoarseDiscretizationFactor() const;
+  int getCoarseMaxIterations() const;
+  bool getUseNesterovMomentum() const;
+  double getNesterovMomentum() const;
+  bool getUseLbfgs() const;
+  int getLbfgsHistorySize() const;
+  int getLbfgsMaxLineSearchSteps() const;
 
 private:
   double planning_time_limit_;
@@ -107,6 +118,15 @@ private:
   double collision_threshold_;
   bool filter_mode_;
   double random_jump_amount_;
+  int num_threads_;
+  int num_starts_;
+  int coarse_discretization_factor_;
+  int coarse_max_iterations_;
+  bool use_nesterov_momentum_;
+  double nesterov_momentum_;
+  bool use_lbfgs_;
+  int lbfgs_history_size_;
+  int lbfgs_max_line_search_steps_;
 };
 
 /////////////////////// inline functions follow ////////////////////////
@@ -161,6 +181,11 @@ inline int ChompParameters::getMaxIterations() const
   return max_iterations_;
 }
 
+inline void ChompParameters::setMaxIterations(int max_iterations)
+{
+  max_iterations_ = max_iterations;
+}
+
 inline int ChompParameters::getMaxIterationsAfterCollisionFree() const
 {
   return max_iterations_after_collision_free_;
@@ -226,6 +251,11 @@ inline bool ChompParameters::getUseHamiltonianMonteCarlo() const
   return use_hamiltonian_monte_carlo_;
 }
 
+inline void ChompParameters::setUseHamiltonianMonteCarlo(bool use_hmc)
+{
+  use_hamiltonian_monte_carlo_ = use_hmc;
+}
+
 inline double ChompParameters::getRidgeFactor() const
 {
   return ridge_factor_;
@@ -256,6 +286,51 @@ inline std::string ChompParameters::getAnimateEndeffectorSegment() const
   return animate_endeffector_segment_;
 }
 
+inline int ChompParameters::getNumThreads() const
+{
+  return num_threads_;
+}
+
+inline int ChompParameters::getNumStarts() const
+{
+  return num_starts_;
+}
+
+inline int ChompParameters::getCoarseDiscretizationFactor() const
+{
+  return coarse_discretization_factor_;
+}
+
+inline int ChompParameters::getCoarseMaxIterations() const
+{
+  return coarse_max_iterations_;
+}
+
+inline bool ChompParameters::getUseNesterovMomentum() const
+{
+  return use_nesterov_momentum_;
+}
+
+inline double ChompParameters::getNesterovMomentum() const
+{
+  return nesterov_momentum_;
+}
+
+inline bool ChompParameters::getUseLbfgs() const
+{
+  return use_lbfgs_;
+}
+
+inline int ChompParameters::getLbfgsHistorySize() const
+{
+  return lbfgs_history_size_;
+}
+
+inline int ChompParameters::getLbfgsMaxLineSearchSteps() const
+{
+  return lbfgs_max_line_search_steps_;
+}
+
 } // namespace chomp
 
 #endif /* CHOMP_PARAMETERS_H_ */
@@ -46,6 +46,8 @@
 
 
 #include <chomp_motion_planner/chomp_parameters.h>
+#include <chomp_motion_planner/chomp_trajectory.h>
+#include <chomp_motion_planner/chomp_trajectory_library.h>
 #include <collision_proximity/collision_proximity_space.h>
 #include <map>
 #include <string>
@@ -112,6 +114,28 @@ private:
   bool use_trajectory_filter_;
   int maximum_spline_points_;
   int minimum_spline_points_;
+  bool use_trajectory_library_;
+  ChompTrajectoryLibrary* trajectory_library_;          /**< Successful trajectories used to seed new requests */
+
+  /**
+   * \brief Optimizes num_starts differently initialized copies of the trajectory in parallel
+   *
+   * The first start is the min jerk trajectory, odd starts go through a random via point and the
+   * other even starts use Hamiltonian Monte Carlo. The trajectory is replaced with the lowest cost
+   * collision free result, or the lowest cost one if none are collision free.
+   *
+   * \return true if the chosen result is collision free
+   */
+  bool optimizeMultiStart(ChompTrajectory& trajectory, const std::string& group_name,
+                          const ChompParameters& parameters, int& iterations);
+
+  /**
+   * \brief Optimizes a copy of the trajectory with coarse_discretization_factor times fewer points,
+   * and interpolates the result back into the trajectory
+   *
+   * \return the number of iterations taken
+   */
+  int optimizeCoarse(ChompTrajectory& trajectory, const std::string& group_name);
 
   std::map<std::string, arm_navigation_msgs::JointLimits> joint_limits_;
   void getLimits(const trajectory_msgs::JointTrajectory& trajectory, 
@@ -116,6 +116,20 @@ public:
    */
   void fillInMinJerk();
 
+  /**
+   * \brief Generates minimum jerk segments into and out of the (already set) point at via_index
+   *
+   * The start and end index are the same afterwards.
+   */
+  void fillInMinJerkThroughPoint(int via_index);
+
+  /**
+   * \brief Fills in every point by linearly interpolating the source trajectory at the same fraction of its duration
+   *
+   * The source may have a different number of points, so this resamples between resolutions.
+   */
+  void fillInFromTrajectory(const ChompTrajectory& source_traj);
+
   /**
    * \brief Sets the start and end index for the modifiable part of the trajectory
    *
@@ -0,0 +1,140 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/** \author Mrinal Kalakrishnan */
+
+#ifndef CHOMP_TRAJECTORY_LIBRARY_H_
+#define CHOMP_TRAJECTORY_LIBRARY_H_
+
+#include <eigen3/Eigen/Core>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace chomp
+{
+
+/**
+ * \brief Remembers successful group trajectories to warm start requests with similar endpoints
+ *
+ * Trajectories are keyed by their group start and goal joint vectors. The keys are quantized to
+ * the resolution, and a new trajectory replaces the one stored in the same cell. A lookup takes
+ * the nearest stored trajectory of the group within the maximum distance and warps it onto the
+ * new endpoints. The least recently used trajectory is dropped once the library is full.
+ *
+ * The library is small, so the nearest neighbour is found with a linear scan, which keeps
+ * insertion and eviction trivial.
+ */
+class ChompTrajectoryLibrary
+{
+public:
+  ChompTrajectoryLibrary(unsigned int max_size, double resolution, double max_distance);
+  virtual ~ChompTrajectoryLibrary();
+
+  /**
+   * \brief Fills in the interior points of the trajectory from the nearest stored one
+   *
+   * The first and last rows of the trajectory give the start and goal and are left alone.
+   *
+   * \return false, leaving the trajectory alone, if nothing close enough is stored
+   */
+  bool seedTrajectory(const std::string& group_name, Eigen::MatrixXd& trajectory);
+
+  /**
+   * \brief Stores a trajectory, keyed by its first and last rows
+   */
+  void addTrajectory(const std::string& group_name, const Eigen::MatrixXd& trajectory);
+
+  /**
+   * \brief Records how many iterations an optimization took, for the seeded and unseeded averages
+   */
+  void recordIterations(bool seeded, int iterations);
+
+  void clear();
+
+  unsigned int getSize() const;
+  unsigned int getNumHits() const;
+  unsigned int getNumMisses() const;
+  double getAverageIterations(bool seeded) const;
+
+private:
+  typedef std::pair<std::string, std::vector<int> > CellKey;
+
+  struct Entry
+  {
+    CellKey cell;
+    Eigen::VectorXd endpoints;                          /**< The start followed by the goal */
+    Eigen::MatrixXd trajectory;
+  };
+
+  void getEndpoints(const Eigen::MatrixXd& trajectory, Eigen::VectorXd& endpoints) const;
+  CellKey getCellKey(const std::string& group_name, const Eigen::VectorXd& endpoints) const;
+
+  unsigned int max_size_;
+  double resolution_;
+  double max_distance_;
+  std::list<Entry> entries_;                            /**< Most recently used first */
+  std::map<CellKey, std::list<Entry>::iterator> cells_;
+  unsigned int num_hits_;
+  unsigned int num_misses_;
+  double iterations_[2];                                /**< Total iterations of unseeded and seeded runs */
+  unsigned int runs_[2];
+};
+
+/////////////////////// inline functions follow ////////////////////////
+
+inline unsigned int ChompTrajectoryLibrary::getSize() const
+{
+  return entries_.size();
+}
+
+inline unsigned int ChompTrajectoryLibrary::getNumHits() const
+{
+  return num_hits_;
+}
+
+inline unsigned int ChompTrajectoryLibrary::getNumMisses() const
+{
+  return num_misses_;
+}
+
+inline double ChompTrajectoryLibrary::getAverageIterations(bool seeded) const
+{
+  return runs_[seeded] == 0 ? 0.0 : iterations_[seeded] / runs_[seeded];
+}
+
+} // namespace chomp
+
+#endif /* CHOMP_TRAJECTORY_LIBRARY_H_ */
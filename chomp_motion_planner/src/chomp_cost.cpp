@@ -36,7 +36,9 @@
 
 #include <chomp_motion_planner/chomp_cost.h>
 #include <chomp_motion_planner/chomp_utils.h>
-#include <eigen3/Eigen/LU>
+#include <ros/ros.h>
+#include <boost/thread/mutex.hpp>
+#include <map>
 
 using namespace Eigen;
 using namespace std;
@@ -44,63 +46,188 @@ using namespace std;
 namespace chomp
 {
 
+// the cost only depends on these, not on the joint
+struct CostCacheKey
+{
+  int num_points;
+  double discretization;
+  std::vector<double> derivative_costs;
+  double ridge_factor;
+
+  bool operator<(const CostCacheKey& other) const
+  {
+    if (num_points != other.num_points)
+      return num_points < other.num_points;
+    if (discretization != other.discretization)
+      return discretization < other.discretization;
+    if (ridge_factor != other.ridge_factor)
+      return ridge_factor < other.ridge_factor;
+    return derivative_costs < other.derivative_costs;
+  }
+};
+
+struct CostCacheEntry
+{
+  boost::shared_ptr<const ChompCost> cost;
+  unsigned int last_use;
+};
+
+static const unsigned int MAX_CACHED_COSTS = 32;
+static boost::mutex cost_cache_lock;
+static std::map<CostCacheKey, CostCacheEntry> cost_cache;
+static unsigned int cost_cache_uses = 0;
+static unsigned int cost_cache_hits = 0;
+
 ChompCost::ChompCost(const ChompTrajectory& trajectory, int joint_number, const std::vector<double>& derivative_costs, double ridge_factor)
 {
-  int num_vars_all = trajectory.getNumPoints();
-  int num_vars_free = num_vars_all - 2*(DIFF_RULE_LENGTH-1);
-  MatrixXd diff_matrix = MatrixXd::Zero(num_vars_all, num_vars_all);
-  quad_cost_full_ = MatrixXd::Zero(num_vars_all, num_vars_all);
+  num_vars_all_ = trajectory.getNumPoints();
+  num_vars_free_ = num_vars_all_ - 2*(DIFF_RULE_LENGTH-1);
+  quad_cost_full_ = MatrixXd::Zero(BANDWIDTH+1, num_vars_all_);
 
-  // construct the quad cost for all variables, as a sum of squared differentiation matrices
+  // construct the quad cost for all variables, as a sum of squared differentiation matrices.
+  // Row r of a differentiation matrix only touches columns r-DIFF_RULE_LENGTH/2 to r+DIFF_RULE_LENGTH/2
   double multiplier = 1.0;
   for (unsigned int i=0; i<derivative_costs.size(); i++)
   {
     multiplier *= trajectory.getDiscretization();
-    diff_matrix = getDiffMatrix(num_vars_all, &DIFF_RULES[i][0]);
-    quad_cost_full_ += (derivative_costs[i] * multiplier) *
-        (diff_matrix.transpose()*diff_matrix);
+    const double* diff_rule = &DIFF_RULES[i][0];
+    double weight = derivative_costs[i] * multiplier;
+    for (int r=0; r<num_vars_all_; r++)
+    {
+      int first = std::max(0, r-DIFF_RULE_LENGTH/2);
+      int last = std::min(num_vars_all_-1, r+DIFF_RULE_LENGTH/2);
+      for (int a=first; a<=last; a++)
+      {
+        for (int b=a; b<=last; b++)
+        {
+          quad_cost_full_(b-a, a) += weight * diff_rule[a-r+DIFF_RULE_LENGTH/2] * diff_rule[b-r+DIFF_RULE_LENGTH/2];
+        }
+      }
+    }
   }
-  quad_cost_full_ += MatrixXd::Identity(num_vars_all, num_vars_all)*ridge_factor;
+  quad_cost_full_.row(0).array() += ridge_factor;
 
-  // extract the quad cost just for the free variables:
-  quad_cost_ = quad_cost_full_.block(DIFF_RULE_LENGTH-1, DIFF_RULE_LENGTH-1,
-      num_vars_free, num_vars_free);
+  factorize();
+  computeInverseDiagonal();
+}
 
-  // invert the matrix:
-  quad_cost_inv_ = quad_cost_.inverse();
+void ChompCost::factorize()
+{
+  // banded Cholesky of the quad cost just for the free variables
+  int offset = DIFF_RULE_LENGTH-1;
+  quad_cost_chol_ = MatrixXd::Zero(BANDWIDTH+1, num_vars_free_);
+  for (int j=0; j<num_vars_free_; j++)
+  {
+    double diagonal = quad_cost_full_(0, j+offset);
+    for (int k=std::max(0, j-BANDWIDTH); k<j; k++)
+      diagonal -= quad_cost_chol_(j-k,k) * quad_cost_chol_(j-k,k);
+    if (diagonal <= 0.0)
+    {
+      ROS_ERROR("ChompCost quadratic cost is not positive definite");
+      diagonal = 1e-10;
+    }
+    quad_cost_chol_(0,j) = sqrt(diagonal);
+    for (int i=j+1; i<=std::min(num_vars_free_-1, j+BANDWIDTH); i++)
+    {
+      double sum = quad_cost_full_(i-j, j+offset);
+      for (int k=std::max(0, i-BANDWIDTH); k<j; k++)
+        sum -= quad_cost_chol_(i-k,k) * quad_cost_chol_(j-k,k);
+      quad_cost_chol_(i-j,j) = sum / quad_cost_chol_(0,j);
+    }
+  }
+}
 
-  //cout << quad_cost_inv_ << endl;
+void ChompCost::computeInverseDiagonal()
+{
+  // element i of the inverse diagonal is the squared norm of L^-1 e_i, which is zero above row i
+  quad_cost_inv_diagonal_ = VectorXd::Zero(num_vars_free_);
+  VectorXd y = VectorXd::Zero(num_vars_free_);
+  for (int i=0; i<num_vars_free_; i++)
+  {
+    double norm = 0.0;
+    for (int r=i; r<num_vars_free_; r++)
+    {
+      double sum = (r == i) ? 1.0 : 0.0;
+      for (int k=std::max(i, r-BANDWIDTH); k<r; k++)
+        sum -= quad_cost_chol_(r-k,k) * y(k);
+      y(r) = sum / quad_cost_chol_(0,r);
+      norm += y(r) * y(r);
+    }
+    quad_cost_inv_diagonal_(i) = norm;
+  }
+}
+
+void ChompCost::getQuadraticCostInverseColumn(int i, Eigen::VectorXd& column) const
+{
+  column = VectorXd::Zero(num_vars_free_);
+  column(i) = 1.0;
+  solve(column);
+}
 
+const Eigen::MatrixXd& ChompCost::getQuadraticCostInverse() const
+{
+  if (quad_cost_inv_.rows() != num_vars_free_)
+  {
+    quad_cost_inv_ = MatrixXd::Identity(num_vars_free_, num_vars_free_);
+    for (int i=0; i<num_vars_free_; i++)
+    {
+      MatrixXd::ColXpr column = quad_cost_inv_.col(i);
+      solve(column);
+    }
+  }
+  return quad_cost_inv_;
 }
 
-Eigen::MatrixXd ChompCost::getDiffMatrix(int size, const double* diff_rule) const
+boost::shared_ptr<const ChompCost> ChompCost::getCachedCost(const ChompTrajectory& trajectory,
+                                                            const std::vector<double>& derivative_costs,
+                                                            double ridge_factor)
 {
-  MatrixXd matrix = MatrixXd::Zero(size,size);
-  for (int i=0; i<size; i++)
+  CostCacheKey key;
+  key.num_points = trajectory.getNumPoints();
+  key.discretization = trajectory.getDiscretization();
+  key.derivative_costs = derivative_costs;
+  key.ridge_factor = ridge_factor;
+
+  boost::mutex::scoped_lock lock(cost_cache_lock);
+  cost_cache_uses++;
+  std::map<CostCacheKey, CostCacheEntry>::iterator it = cost_cache.find(key);
+  if (it != cost_cache.end())
+  {
+    cost_cache_hits++;
+    it->second.last_use = cost_cache_uses;
+    return it->second.cost;
+  }
+
+  // evict the least recently used cost
+  if (cost_cache.size() >= MAX_CACHED_COSTS)
   {
-    for (int j=-DIFF_RULE_LENGTH/2; j<=DIFF_RULE_LENGTH/2; j++)
+    std::map<CostCacheKey, CostCacheEntry>::iterator oldest = cost_cache.begin();
+    for (it = cost_cache.begin(); it != cost_cache.end(); it++)
     {
-      int index = i+j;
-      if (index < 0)
-        continue;
-      if (index >= size)
-        continue;
-      matrix(i,index) = diff_rule[j+DIFF_RULE_LENGTH/2];
+      if (it->second.last_use < oldest->second.last_use)
+        oldest = it;
     }
+    cost_cache.erase(oldest);
   }
-  return matrix;
+  CostCacheEntry& entry = cost_cache[key];
+  entry.cost.reset(new ChompCost(trajectory, 0, derivative_costs, ridge_factor));
+  entry.last_use = cost_cache_uses;
+  ROS_DEBUG("ChompCost cache miss for %d points, %u hits in %u uses", key.num_points, cost_cache_hits, cost_cache_uses);
+  return entry.cost;
 }
 
 double ChompCost::getMaxQuadCostInvValue() const
 {
-  return quad_cost_inv_.maxCoeff();
+  // the largest element of a positive definite matrix lies on its diagonal
+  return quad_cost_inv_diagonal_.maxCoeff();
 }
 
 void ChompCost::scale(double scale)
 {
   double inv_scale = 1.0/scale;
+  quad_cost_inv_diagonal_ *= inv_scale;
   quad_cost_inv_ *= inv_scale;
-  quad_cost_ *= scale;
+  quad_cost_chol_ *= sqrt(scale);
   quad_cost_full_ *= scale;
 }
 
@@ -39,6 +39,9 @@
 #include <visualization_msgs/MarkerArray.h>
 #include <chomp_motion_planner/chomp_utils.h>
 #include <planning_models/kinematic_model.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <limits>
 #include <eigen3/Eigen/LU>
 #include <eigen3/Eigen/Core>
 #include <ros/console.h>
@@ -58,10 +61,13 @@ namespace chomp
 
   ChompOptimizer::ChompOptimizer(ChompTrajectory *trajectory, KinematicModel *robot_model,
                                  const string& planning_group,const ChompParameters *parameters, const ros::Publisher& vis_marker_array_publisher,
-                                 const ros::Publisher& vis_marker_publisher, CollisionProximitySpace *collision_space) :
+                                 const ros::Publisher& vis_marker_publisher, CollisionProximitySpace *collision_space,
+                                 ChompOptimizerGroup *optimizer_group) :
     full_trajectory_(trajectory), robot_model_(robot_model), planning_group_(planning_group), parameters_(parameters),
-        collision_space_(collision_space), group_trajectory_(*full_trajectory_, planning_group_, DIFF_RULE_LENGTH),
-        vis_marker_array_pub_(vis_marker_array_publisher), vis_marker_pub_(vis_marker_publisher)
+        collision_space_(collision_space), optimizer_group_(optimizer_group),
+        group_trajectory_(*full_trajectory_, planning_group_, DIFF_RULE_LENGTH),
+        vis_marker_array_pub_(vis_marker_array_publisher), vis_marker_pub_(vis_marker_publisher),
+        fk_generation_(0), fk_threads_done_(0), fk_shutdown_(false)
   {
     initialize();
   }
@@ -69,6 +75,10 @@ namespace chomp
   void ChompOptimizer::initialize()
   {
     robot_state_ = collision_space_->getCollisionModelsInterface()->getPlanningSceneState();
+    if(optimizer_group_ != NULL)
+    {
+      robot_state_ = new KinematicState(*robot_state_);
+    }
     // init some variables:
     num_vars_free_ = group_trajectory_.getNumFreePoints();
     num_vars_all_ = group_trajectory_.getNumPoints();
@@ -104,11 +114,15 @@ namespace chomp
       string joint_name = model->getName();
       nh.param("joint_costs/" + joint_name, joint_cost, 1.0);
       vector<double> derivative_costs(3);
-      derivative_costs[0] = joint_cost * parameters_->getSmoothnessCostVelocity();
-      derivative_costs[1] = joint_cost * parameters_->getSmoothnessCostAcceleration();
-      derivative_costs[2] = joint_cost * parameters_->getSmoothnessCostJerk();
-
-      joint_costs_.push_back(ChompCost(group_trajectory_, i, derivative_costs, parameters_->getRidgeFactor()));
+      derivative_costs[0] = parameters_->getSmoothnessCostVelocity();
+      derivative_costs[1] = parameters_->getSmoothnessCostAcceleration();
+      derivative_costs[2] = parameters_->getSmoothnessCostJerk();
+
+      // the joint cost only scales the quad cost, so all joints share the unweighted cost with the
+      // ridge divided out. It is copied from the shared cost, as it gets scaled
+      joint_costs_.push_back(*ChompCost::getCachedCost(group_trajectory_, derivative_costs,
+                                                       parameters_->getRidgeFactor() / joint_cost));
+      joint_costs_[i].scale(joint_cost);
       double cost_scale = joint_costs_[i].getMaxQuadCostInvValue();
       if(max_cost_scale < cost_scale)
         max_cost_scale = cost_scale;
@@ -133,8 +147,8 @@ namespace chomp
 
     group_trajectory_backup_ = group_trajectory_.getTrajectory();
     best_group_trajectory_ = group_trajectory_.getTrajectory();
+    best_group_trajectory_cost_ = numeric_limits<double>::max();
 
-    collision_point_joint_names_.resize(num_vars_all_, vector<string>(num_collision_points_));
     collision_point_pos_eigen_.resize(num_vars_all_, vector<Vector3d>(num_collision_points_));
     collision_point_vel_eigen_.resize(num_vars_all_, vector<Vector3d>(num_collision_points_));
     collision_point_acc_eigen_.resize(num_vars_all_, vector<Vector3d>(num_collision_points_));
@@ -158,11 +172,18 @@ namespace chomp
     random_joint_momentum_ = VectorXd::Zero(num_vars_free_);
     multivariate_gaussian_.clear();
     stochasticity_factor_ = 1.0;
-    for(int i = 0; i < num_joints_; i++)
+
+    resetUpdateHistory();
+    first_collision_free_iteration_ = -1;
+    // the samplers need the dense cost inverses, which are only built for HMC
+    if(parameters_->getUseHamiltonianMonteCarlo())
     {
-      multivariate_gaussian_.push_back(
-                                       MultivariateGaussian(VectorXd::Zero(num_vars_free_),
-                                                            joint_costs_[i].getQuadraticCostInverse()));
+      for(int i = 0; i < num_joints_; i++)
+      {
+        multivariate_gaussian_.push_back(
+                                         MultivariateGaussian(VectorXd::Zero(num_vars_free_),
+                                                              joint_costs_[i].getQuadraticCostInverse()));
+      }
     }
 
     map<string, KinematicModel::JointModelGroup*> groupMap = robot_model_->getJointModelGroupMap();
@@ -175,6 +196,7 @@ namespace chomp
       registerParents(modelGroup->getJointModels()[i]);
       fixedLinkResolutionMap[joint_names_[i]] = joint_names_[i];
     }
+    initializeJointProperties(modelGroup);
 
     for(size_t i = 0; i < modelGroup->getFixedJointModels().size(); i ++)
     {
@@ -224,38 +246,183 @@ namespace chomp
       ROS_INFO("%s",ss.str().c_str());
     }
 
-    int start = free_vars_start_;
-    int end = free_vars_end_;
+    // the joints moving each collision point are the same at every waypoint, so the
+    // jacobians only need to visit those
     vector<GradientInfo> gradients;
     collision_space_->getStateGradients(gradients);
-    for(int i = start; i <= end; ++i)
+    collision_point_joints_.clear();
+    collision_point_joints_.resize(num_collision_points_);
+    size_t j = 0;
+    for(size_t g = 0; g < gradients.size(); g++)
     {
-      size_t j = 0;
-      for(size_t g = 0; g < gradients.size(); g++)
+      GradientInfo& info = gradients[g];
+      map<string, string>::iterator it = fixedLinkResolutionMap.find(info.joint_name);
+      if(it == fixedLinkResolutionMap.end())
       {
-        GradientInfo& info = gradients[g];
-
-        for(size_t k = 0; k < info.sphere_locations.size(); k++)
+        ROS_ERROR("Couldn't find joint %s!", info.joint_name.c_str());
+      }
+      for(size_t k = 0; k < info.sphere_locations.size(); k++)
+      {
+        if(it != fixedLinkResolutionMap.end())
         {
-          if(fixedLinkResolutionMap.find(info.joint_name) != fixedLinkResolutionMap.end())
-          {
-            collision_point_joint_names_[i][j] = fixedLinkResolutionMap[info.joint_name];
-          }
-          else
+          for(int joint = 0; joint < num_joints_; joint++)
           {
-            ROS_ERROR("Couldn't find joint %s!", info.joint_name.c_str());
+            if(isParent(it->second, joint_names_[joint]))
+            {
+              collision_point_joints_[j].push_back(joint);
+            }
           }
-          j++;
         }
+        j++;
       }
     }
+
+    startForwardKinematicsThreads();
   }
 
   ChompOptimizer::~ChompOptimizer()
   {
+    stopForwardKinematicsThreads();
+    if(optimizer_group_ != NULL)
+    {
+      delete robot_state_;
+    }
     destroy();
   }
 
+  void ChompOptimizer::startForwardKinematicsThreads()
+  {
+    // there's no point in more threads than free waypoints
+    int num_threads = max(1, min(parameters_->getNumThreads(), num_vars_free_));
+    fk_contexts_.resize(num_threads);
+    for(int i = 0; i < num_threads; i++)
+    {
+      if(i == 0)
+      {
+        fk_contexts_[i].state = robot_state_;
+        if(optimizer_group_ == NULL)
+        {
+          fk_contexts_[i].group_session = collision_space_->getCurrentGroupSession();
+        }
+        else
+        {
+          fk_contexts_[i].group_session = collision_space_->cloneGroupSession(collision_space_->getCurrentGroupSession());
+        }
+      }
+      else
+      {
+        fk_contexts_[i].state = new KinematicState(*robot_state_);
+        fk_contexts_[i].group_session = collision_space_->cloneGroupSession(collision_space_->getCurrentGroupSession());
+      }
+      fk_contexts_[i].start = 0;
+      fk_contexts_[i].end = -1;
+      fk_contexts_[i].is_collision_free = true;
+    }
+    for(int i = 1; i < num_threads; i++)
+    {
+      fk_threads_.create_thread(boost::bind(&ChompOptimizer::forwardKinematicsThread, this, i));
+    }
+  }
+
+  void ChompOptimizer::stopForwardKinematicsThreads()
+  {
+    {
+      boost::mutex::scoped_lock lock(fk_lock_);
+      fk_shutdown_ = true;
+    }
+    fk_start_condition_.notify_all();
+    fk_threads_.join_all();
+    for(size_t i = 0; i < fk_contexts_.size(); i++)
+    {
+      if(i > 0)
+      {
+        delete fk_contexts_[i].state;
+      }
+      if(i > 0 || optimizer_group_ != NULL)
+      {
+        collision_space_->destroyGroupSession(fk_contexts_[i].group_session);
+      }
+    }
+    fk_contexts_.clear();
+  }
+
+  void ChompOptimizer::forwardKinematicsThread(unsigned int index)
+  {
+    unsigned int generation = 0;
+    while(true)
+    {
+      {
+        boost::mutex::scoped_lock lock(fk_lock_);
+        while(fk_generation_ == generation && !fk_shutdown_)
+        {
+          fk_start_condition_.wait(lock);
+        }
+        if(fk_shutdown_)
+        {
+          return;
+        }
+        generation = fk_generation_;
+      }
+      performForwardKinematics(fk_contexts_[index]);
+      {
+        boost::mutex::scoped_lock lock(fk_lock_);
+        fk_threads_done_++;
+      }
+      fk_done_condition_.notify_one();
+    }
+  }
+
+  void ChompOptimizer::initializeJointProperties(const KinematicModel::JointModelGroup* modelGroup)
+  {
+    joint_min_.resize(num_joints_);
+    joint_max_.resize(num_joints_);
+    joint_is_continuous_.resize(num_joints_);
+    joint_update_limits_.assign(num_joints_, parameters_->getJointUpdateLimit());
+    joint_local_axes_.resize(num_joints_);
+    joint_origin_transforms_.resize(num_joints_);
+    joint_state_indices_.resize(num_joints_);
+    joint_parent_link_state_indices_.resize(num_joints_);
+
+    const vector<KinematicState::JointState*>& jointStates = robot_state_->getJointStateVector();
+    const vector<KinematicState::LinkState*>& linkStates = robot_state_->getLinkStateVector();
+    for(int j = 0; j < num_joints_; j++)
+    {
+      const KinematicModel::JointModel* jointModel = modelGroup->getJointModels()[j];
+      const KinematicModel::RevoluteJointModel* revoluteJoint = dynamic_cast<const KinematicModel::RevoluteJointModel*>(jointModel);
+      const KinematicModel::PrismaticJointModel* prismaticJoint = dynamic_cast<const KinematicModel::PrismaticJointModel*>(jointModel);
+
+      joint_is_continuous_[j] = (revoluteJoint != NULL && revoluteJoint->continuous_);
+      joint_min_[j] = 10000;
+      joint_max_[j] = -10000;
+      map<string, pair<double,double> > bounds = jointModel->getAllVariableBounds();
+      for(map<string,pair<double,double> >::iterator it = bounds.begin(); it != bounds.end(); it ++)
+      {
+        joint_min_[j] = min(joint_min_[j], it->second.first);
+        joint_max_[j] = max(joint_max_[j], it->second.second);
+      }
+
+      if(revoluteJoint != NULL)
+      {
+        joint_local_axes_[j] = revoluteJoint->axis_;
+      }
+      else if(prismaticJoint != NULL)
+      {
+        joint_local_axes_[j] = prismaticJoint->axis_;
+      }
+      else
+      {
+        joint_local_axes_[j] = tf::Vector3(0.0, 0.0, 0.0);
+      }
+      joint_origin_transforms_[j] = robot_model_->getLinkModel(jointModel->getChildLinkModel()->getName())->getJointOriginTransform();
+
+      // the states of every thread are copies of robot_state_, so their vectors line up
+      const KinematicState::JointState* jointState = robot_state_->getJointState(jointModel->getName());
+      const KinematicState::LinkState* parentLinkState = robot_state_->getLinkState(jointModel->getParentLinkModel()->getName());
+      joint_state_indices_[j] = find(jointStates.begin(), jointStates.end(), jointState) - jointStates.begin();
+      joint_parent_link_state_indices_[j] = find(linkStates.begin(), linkStates.end(), parentLinkState) - linkStates.begin();
+    }
+  }
+
   void ChompOptimizer::registerParents(const KinematicModel::JointModel* model)
   {
     const KinematicModel::JointModel* parentModel = NULL;
@@ -306,6 +473,11 @@ namespace chomp
     // iterate
     for(iteration_ = 0; iteration_ < parameters_->getMaxIterations(); iteration_++)
     {
+      if(iteration_ > 0 && optimizer_group_ != NULL && optimizer_group_->isFinished())
+      {
+        ROS_INFO("Another optimizer in the group found a safe path, stopping at iter %d.", iteration_);
+        break;
+      }
       ros::WallTime for_time = ros::WallTime::now();
       performForwardKinematics();
       ROS_DEBUG_STREAM("Forward kinematics took " << (ros::WallTime::now()-for_time));
@@ -349,12 +521,7 @@ namespace chomp
       ROS_DEBUG_STREAM("Collision increments took " << (ros::WallTime::now()-coll_time));
       calculateTotalIncrements();
 
-      if(!parameters_->getUseHamiltonianMonteCarlo())
-      {
-        // non-stochastic version:
-        addIncrementsToTrajectory();
-      }
-      else
+      if(parameters_->getUseHamiltonianMonteCarlo())
       {
         // hamiltonian monte carlo updates:
         getRandomMomentum();
@@ -362,6 +529,19 @@ namespace chomp
         updatePositionFromMomentum();
         stochasticity_factor_ *= parameters_->getHmcAnnealingFactor();
       }
+      else if(parameters_->getUseLbfgs())
+      {
+        addLbfgsIncrementsToTrajectory();
+      }
+      else if(parameters_->getUseNesterovMomentum())
+      {
+        addNesterovIncrementsToTrajectory();
+      }
+      else
+      {
+        // non-stochastic version:
+        addIncrementsToTrajectory();
+      }
       handleJointLimits();
       updateFullTrajectory();
 
@@ -374,6 +554,10 @@ namespace chomp
           num_collision_free_iterations_ = 0;
           ROS_INFO("Chomp Got mesh to mesh safety at iter %d. Breaking out early.", iteration_);
           is_collision_free_ = true;
+          if(optimizer_group_ != NULL)
+          {
+            optimizer_group_->setFinished();
+          }
           iteration_++;
           shouldBreakOut = true;
         } else if(safety == CollisionProximitySpace::InCollisionSafe) {
@@ -400,6 +584,11 @@ namespace chomp
       }
 
 
+      if(is_collision_free_ && first_collision_free_iteration_ < 0)
+      {
+        first_collision_free_iteration_ = iteration_;
+      }
+
       if((ros::WallTime::now() - start_time).toSec() > parameters_->getPlanningTimeLimit() && !parameters_->getAnimatePath() && !parameters_->getAnimateEndeffector())
       {
         ROS_WARN("Breaking out early due to time limit constraints.");
@@ -425,6 +614,7 @@ namespace chomp
           if(new_cost < original_cost)
           {
             ROS_INFO("Got out of minimum in %d iters!", iter);
+            resetUpdateHistory();
             averageCostVelocity = 0.0;
             currentCostIter = 0;
             success = true;
@@ -499,6 +689,17 @@ namespace chomp
       animatePath();
 
     ROS_INFO("Terminated after %d iterations, using path from iteration %d", iteration_, last_improvement_iteration_);
+    if(first_collision_free_iteration_ >= 0)
+    {
+      const char* update_rule = "gradient";
+      if(parameters_->getUseHamiltonianMonteCarlo())
+        update_rule = "hmc";
+      else if(parameters_->getUseLbfgs())
+        update_rule = "lbfgs";
+      else if(parameters_->getUseNesterovMomentum())
+        update_rule = "nesterov";
+      ROS_INFO("Collision free after %d iterations with the %s update", first_collision_free_iteration_, update_rule);
+    }
     ROS_INFO("Optimization core finished in %f sec", (ros::WallTime::now() - start_time).toSec() );
     ROS_INFO_STREAM("Time per iteration " << (ros::WallTime::now() - start_time).toSec()/(iteration_*1.0));
   }
@@ -523,6 +724,11 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
       jointTrajectory.points.push_back(point);
     }
 
+    if(optimizer_group_ != NULL)
+    {
+      boost::mutex::scoped_lock lock(optimizer_group_->getValidityLock());
+      return collision_space_->isTrajectorySafe(jointTrajectory, goalConstraints, pathConstraints, planning_group_);
+    }
     return collision_space_->isTrajectorySafe(jointTrajectory, goalConstraints, pathConstraints, planning_group_);
     /*
     bool valid = collision_space_->getCollisionModelsInterface()->isJointTrajectoryValid(*robot_state_,
@@ -563,7 +769,8 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
 
     // In stochastic descent, simply use a random point in the trajectory, rather than all the trajectory points.
     // This is faster and guaranteed to converge, but it may take more iterations in the worst case.
-    if(parameters_->getUseStochasticDescent())
+    // The quasi-newton update needs the full gradient to build its curvature pairs.
+    if(parameters_->getUseStochasticDescent() && !parameters_->getUseLbfgs())
     {
       startPoint =  (int)(((double)random() / (double)RAND_MAX)*(free_vars_end_ - free_vars_start_) + free_vars_start_);
       if(startPoint < free_vars_start_) startPoint = free_vars_start_;
@@ -597,7 +804,7 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
         cartesian_gradient = vel_mag * (orthogonal_projector * potential_gradient - potential * curvature_vector);
 
         // pass it through the jacobian transpose to get the increments
-        getJacobian(i, collision_point_pos_eigen_[i][j], collision_point_joint_names_[i][j] ,jacobian_);
+        getJacobian(i, collision_point_pos_eigen_[i][j], collision_point_joints_[j], jacobian_);
 
         if(parameters_->getUsePseudoInverse())
         {
@@ -631,37 +838,151 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
   {
     for(int i = 0; i < num_joints_; i++)
     {
-      final_increments_.col(i) = parameters_->getLearningRate() * (joint_costs_[i].getQuadraticCostInverse()
+      final_increments_.col(i) = parameters_->getLearningRate()
           * (parameters_->getSmoothnessCostWeight() * smoothness_increments_.col(i)
-              + parameters_->getObstacleCostWeight() * collision_increments_.col(i)));
+              + parameters_->getObstacleCostWeight() * collision_increments_.col(i));
+      MatrixXd::ColXpr increments = final_increments_.col(i);
+      joint_costs_[i].solve(increments);
     }
 
   }
 
   void ChompOptimizer::addIncrementsToTrajectory()
   {
-    map<string, KinematicModel::JointModelGroup*> modelGroups = robot_model_->getJointModelGroupMap();
-    string group = planning_group_;
-    const KinematicModel::JointModelGroup* modelGroup = modelGroups[group];
-    const vector<const KinematicModel::JointModel*>& jointModels = modelGroup->getJointModels();
-
-    for(size_t i = 0; i < jointModels.size(); i++)
+    for(int i = 0; i < num_joints_; i++)
     {
+      // the largest increment of the joint is clipped to its update limit
       double scale = 1.0;
-      double max = final_increments_.col(i).maxCoeff();
-      double min = final_increments_.col(i).minCoeff();
-      double max_scale =  parameters_->getJointUpdateLimit() / fabs(max);
-      double min_scale = parameters_->getJointUpdateLimit() / fabs(min);
-      if(max_scale < scale)
-        scale = max_scale;
-      if(min_scale < scale)
-        scale = min_scale;
+      double max_abs = final_increments_.col(i).cwiseAbs().maxCoeff();
+      if(max_abs * scale > joint_update_limits_[i])
+        scale = joint_update_limits_[i] / max_abs;
       group_trajectory_.getFreeTrajectoryBlock().col(i) += scale * final_increments_.col(i);
     }
     //ROS_DEBUG("Scale: %f",scale);
     //group_trajectory_.getFreeTrajectoryBlock() += scale * final_increments_;
   }
 
+  void ChompOptimizer::addNesterovIncrementsToTrajectory()
+  {
+    double momentum = parameters_->getNesterovMomentum();
+    nesterov_previous_velocity_ = nesterov_velocity_;
+    for(int i = 0; i < num_joints_; i++)
+    {
+      // the velocity of each joint is clipped to its update limit
+      MatrixXd::ColXpr velocity = nesterov_velocity_.col(i);
+      velocity = momentum * velocity + final_increments_.col(i);
+      double max_abs = velocity.cwiseAbs().maxCoeff();
+      if(max_abs > joint_update_limits_[i])
+        velocity *= joint_update_limits_[i] / max_abs;
+
+      // move from the old look-ahead point to the new one
+      group_trajectory_.getFreeTrajectoryBlock().col(i) += (1.0 + momentum) * velocity
+          - momentum * nesterov_previous_velocity_.col(i);
+    }
+  }
+
+  void ChompOptimizer::addLbfgsIncrementsToTrajectory()
+  {
+    lbfgs_gradient_ = -(parameters_->getSmoothnessCostWeight() * smoothness_increments_
+        + parameters_->getObstacleCostWeight() * collision_increments_);
+
+    // remember the last step if it satisfies the curvature condition
+    if(lbfgs_has_previous_)
+    {
+      MatrixXd step = group_trajectory_.getFreeTrajectoryBlock() - lbfgs_previous_trajectory_;
+      MatrixXd gradient_change = lbfgs_gradient_ - lbfgs_previous_gradient_;
+      if(step.cwiseProduct(gradient_change).sum() > 1e-10)
+      {
+        lbfgs_steps_.push_back(step);
+        lbfgs_gradient_changes_.push_back(gradient_change);
+        if((int)lbfgs_steps_.size() > parameters_->getLbfgsHistorySize())
+        {
+          lbfgs_steps_.pop_front();
+          lbfgs_gradient_changes_.pop_front();
+        }
+      }
+    }
+    lbfgs_previous_trajectory_ = group_trajectory_.getFreeTrajectoryBlock();
+    lbfgs_previous_gradient_ = lbfgs_gradient_;
+    lbfgs_has_previous_ = true;
+
+    // two loop recursion, with the scaled smoothness metric as the initial inverse hessian
+    int history = lbfgs_steps_.size();
+    vector<double> rho(history), alpha(history);
+    lbfgs_direction_ = lbfgs_gradient_;
+    for(int k = history - 1; k >= 0; k--)
+    {
+      rho[k] = 1.0 / lbfgs_steps_[k].cwiseProduct(lbfgs_gradient_changes_[k]).sum();
+      alpha[k] = rho[k] * lbfgs_steps_[k].cwiseProduct(lbfgs_direction_).sum();
+      lbfgs_direction_ -= alpha[k] * lbfgs_gradient_changes_[k];
+    }
+    double initial_scale = parameters_->getLearningRate();
+    if(history > 0)
+    {
+      lbfgs_scaled_gradient_change_ = lbfgs_gradient_changes_[history - 1];
+      for(int i = 0; i < num_joints_; i++)
+      {
+        MatrixXd::ColXpr column = lbfgs_scaled_gradient_change_.col(i);
+        joint_costs_[i].solve(column);
+      }
+      initial_scale = 1.0 / (rho[history - 1]
+          * lbfgs_gradient_changes_[history - 1].cwiseProduct(lbfgs_scaled_gradient_change_).sum());
+    }
+    for(int i = 0; i < num_joints_; i++)
+    {
+      MatrixXd::ColXpr column = lbfgs_direction_.col(i);
+      joint_costs_[i].solve(column);
+    }
+    lbfgs_direction_ *= initial_scale;
+    for(int k = 0; k < history; k++)
+    {
+      double beta = rho[k] * lbfgs_gradient_changes_[k].cwiseProduct(lbfgs_direction_).sum();
+      lbfgs_direction_ += (alpha[k] - beta) * lbfgs_steps_[k];
+    }
+    lbfgs_direction_ = -lbfgs_direction_;
+
+    // the collision gradient is a functional gradient, so the direction need not descend the cost
+    double slope = lbfgs_gradient_.cwiseProduct(lbfgs_direction_).sum();
+    if(slope < 0.0)
+    {
+      // the largest joint change starts within the update limits
+      double step_size = 1.0;
+      for(int i = 0; i < num_joints_; i++)
+      {
+        double max_abs = lbfgs_direction_.col(i).cwiseAbs().maxCoeff();
+        if(max_abs * step_size > joint_update_limits_[i])
+          step_size = joint_update_limits_[i] / max_abs;
+      }
+
+      // backtrack until the armijo condition holds
+      double cost = getTrajectoryCost();
+      for(int step = 0; step < parameters_->getLbfgsMaxLineSearchSteps(); step++)
+      {
+        group_trajectory_.getFreeTrajectoryBlock() = lbfgs_previous_trajectory_ + step_size * lbfgs_direction_;
+        performForwardKinematics();
+        if(getTrajectoryCost() <= cost + 1e-4 * step_size * slope)
+        {
+          return;
+        }
+        step_size *= 0.5;
+      }
+      group_trajectory_.getFreeTrajectoryBlock() = lbfgs_previous_trajectory_;
+    }
+
+    ROS_DEBUG("No decrease along the quasi-newton direction, taking a gradient step");
+    lbfgs_steps_.clear();
+    lbfgs_gradient_changes_.clear();
+    addIncrementsToTrajectory();
+  }
+
+  void ChompOptimizer::resetUpdateHistory()
+  {
+    nesterov_velocity_.setZero(num_vars_free_, num_joints_);
+    lbfgs_steps_.clear();
+    lbfgs_gradient_changes_.clear();
+    lbfgs_has_previous_ = false;
+  }
+
   void ChompOptimizer::updateFullTrajectory()
   {
     full_trajectory_->updateFromGroupTrajectory(group_trajectory_);
@@ -716,39 +1037,21 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
     return parameters_->getObstacleCostWeight() * collision_cost;
   }
 
-  void ChompOptimizer::computeJointProperties(int trajectoryPoint)
+  void ChompOptimizer::computeJointProperties(int trajectoryPoint, KinematicState* state)
   {
-    tf::Transform inverseWorldTransform = collision_space_->getInverseWorldTransform(*robot_state_);
+    tf::Transform inverseWorldTransform = collision_space_->getInverseWorldTransform(*state);
      for(int j = 0; j < num_joints_; j++)
      {
-       string jointName = joint_names_[j];
-       const KinematicState::JointState* jointState = robot_state_->getJointState(jointName);
-       const KinematicModel::JointModel* jointModel = jointState->getJointModel();
-       const KinematicModel::RevoluteJointModel* revoluteJoint = dynamic_cast<const KinematicModel::RevoluteJointModel*>(jointModel);
-       const KinematicModel::PrismaticJointModel* prismaticJoint = dynamic_cast<const KinematicModel::PrismaticJointModel*>(jointModel);
-
-       string parentLinkName = jointModel->getParentLinkModel()->getName();
-       string childLinkName = jointModel->getChildLinkModel()->getName();
+       const KinematicState::JointState* jointState = state->getJointStateVector()[joint_state_indices_[j]];
+       const KinematicState::LinkState* parentLinkState = state->getLinkStateVector()[joint_parent_link_state_indices_[j]];
        tf::Transform jointTransform =
-           robot_state_->getLinkState(parentLinkName)->getGlobalLinkTransform()
-           * (robot_model_->getLinkModel(childLinkName)->getJointOriginTransform()
-               * (robot_state_->getJointState(jointModel->getName())->getVariableTransform()));
+           parentLinkState->getGlobalLinkTransform()
+           * (joint_origin_transforms_[j]
+               * (jointState->getVariableTransform()));
 
 
        jointTransform = inverseWorldTransform * jointTransform;
-       tf::Vector3 axis;
-
-
-       if(revoluteJoint != NULL)
-       {
-         axis = revoluteJoint->axis_;
-       }
-       else if(prismaticJoint != NULL)
-       {
-         axis = prismaticJoint->axis_;
-       }
-
-       axis = jointTransform * axis;
+       tf::Vector3 axis = jointTransform * joint_local_axes_[j];
 
        joint_axes_[trajectoryPoint][j] = axis;
        joint_positions_[trajectoryPoint][j] = jointTransform.getOrigin();
@@ -756,105 +1059,52 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
   }
 
   template<typename Derived>
-  void ChompOptimizer::getJacobian(int trajectoryPoint, Vector3d& collision_point_pos, string& jointName,
+  void ChompOptimizer::getJacobian(int trajectoryPoint, const Vector3d& collision_point_pos, const vector<int>& joints,
                                    MatrixBase<Derived>& jacobian) const
   {
-    for(int j = 0; j < num_joints_; j++)
+    jacobian.setZero();
+    tf::Vector3 point(collision_point_pos(0), collision_point_pos(1), collision_point_pos(2));
+    for(size_t k = 0; k < joints.size(); k++)
     {
-      if(isParent(jointName, joint_names_[j]))
-      {
-        tf::Vector3 column = joint_axes_[trajectoryPoint][j].cross(tf::Vector3(collision_point_pos(0),
-                                                                           collision_point_pos(1),
-                                                                           collision_point_pos(2))
-                                                                     - joint_positions_[trajectoryPoint][j]);
-
-        jacobian.col(j)[0] = column.x();
-        jacobian.col(j)[1] = column.y();
-        jacobian.col(j)[2] = column.z();
-      }
-      else
-      {
-        jacobian.col(j)[0] = 0.0;
-        jacobian.col(j)[1] = 0.0;
-        jacobian.col(j)[2] = 0.0;
-      }
+      int j = joints[k];
+      tf::Vector3 column = joint_axes_[trajectoryPoint][j].cross(point - joint_positions_[trajectoryPoint][j]);
+
+      jacobian.col(j)[0] = column.x();
+      jacobian.col(j)[1] = column.y();
+      jacobian.col(j)[2] = column.z();
     }
   }
 
   void ChompOptimizer::handleJointLimits()
   {
-    map<string, KinematicModel::JointModelGroup*> modelGroups = robot_model_->getJointModelGroupMap();
-    string group = planning_group_;
-    KinematicModel::JointModelGroup* modelGroup = modelGroups[group];
-
     for(int joint = 0; joint < num_joints_; joint++)
     {
-      const string& jointName = joint_names_[joint];
-      const KinematicModel::JointModel* jointModel = modelGroup->getJointModel(jointName);
-      const KinematicModel::RevoluteJointModel* revoluteJoint = dynamic_cast<const KinematicModel::RevoluteJointModel*>(jointModel);
-
-      if(revoluteJoint->continuous_)
+      if(joint_is_continuous_[joint])
       {
         continue;
       }
-      map<string, pair<double,double> > bounds = jointModel->getAllVariableBounds();
-
-      double joint_max = -10000;
-      double joint_min = 10000;
-
-      for(map<string,pair<double,double> >::iterator it = bounds.begin(); it != bounds.end(); it ++)
-      {
-        if(it->second.first < joint_min)
-        {
-          joint_min = it->second.first;
-        }
-
-        if(it->second.second > joint_max)
-        {
-          joint_max = it->second.second;
-        }
-      }
-
+      double joint_max = joint_max_[joint];
+      double joint_min = joint_min_[joint];
 
       int count = 0;
 
       bool violation = false;
       do
       {
-        double max_abs_violation = 1e-6;
-        double max_violation = 0.0;
-        int max_violation_index = 0;
-        violation = false;
-        for(int i = free_vars_start_; i <= free_vars_end_; i++)
-        {
-          double amount = 0.0;
-          double absolute_amount = 0.0;
-          if(group_trajectory_(i, joint) > joint_max)
-          {
-            amount = joint_max - group_trajectory_(i, joint);
-            absolute_amount = fabs(amount);
-          }
-          else if(group_trajectory_(i, joint) < joint_min)
-          {
-            amount = joint_min - group_trajectory_(i, joint);
-            absolute_amount = fabs(amount);
-          }
-          if(absolute_amount > max_abs_violation)
-          {
-            max_abs_violation = absolute_amount;
-            max_violation = amount;
-            max_violation_index = i;
-            violation = true;
-          }
-        }
+        // how far each free point is outside the limits, negative inside them
+        Block<MatrixXd, Dynamic, Dynamic> block = group_trajectory_.getFreeJointTrajectoryBlock(joint);
+        int free_var_index = 0;
+        int col = 0;
+        double max_abs_violation = (block.array() - joint_max).max(joint_min - block.array()).maxCoeff(&free_var_index, &col);
+        violation = (max_abs_violation > 1e-6);
 
         if(violation)
         {
-          int free_var_index = max_violation_index - free_vars_start_;
-          double multiplier = max_violation / joint_costs_[joint].getQuadraticCostInverse()(free_var_index,
-                                                                                            free_var_index);
-          group_trajectory_.getFreeJointTrajectoryBlock(joint) += multiplier
-              * joint_costs_[joint].getQuadraticCostInverse().col(free_var_index);
+          double value = block(free_var_index, 0);
+          double max_violation = (value > joint_max) ? joint_max - value : joint_min - value;
+          double multiplier = max_violation / joint_costs_[joint].getQuadraticCostInverseDiagonal()(free_var_index);
+          joint_costs_[joint].getQuadraticCostInverseColumn(free_var_index, quad_cost_inv_column_);
+          block += multiplier * quad_cost_inv_column_;
         }
         if(++count > 10)
           break;
@@ -877,49 +1127,40 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
       end = num_vars_all_ - 1;
     }
 
-    is_collision_free_ = true;
-
-    // for each point in the trajectory
-    for(int i = start; i <= end; ++i)
+    // the waypoints are independent, each thread takes a contiguous block of them
+    int num_threads = fk_contexts_.size();
+    int num_points = end - start + 1;
+    for(int t = 0; t < num_threads; t++)
     {
-      // Set Robot state from trajectory point...
-      setRobotStateFromPoint(group_trajectory_, i);
-      computeJointProperties(i);
-      state_is_in_collision_[i] = false;
+      fk_contexts_[t].start = start + (num_points * t) / num_threads;
+      fk_contexts_[t].end = start + (num_points * (t + 1)) / num_threads - 1;
+    }
 
-      vector<GradientInfo> gradients;
-      collision_space_->getStateGradients(gradients);
-      //Keep vars in scope
+    if(num_threads > 1)
+    {
       {
-        size_t j = 0;
-        for(size_t g = 0; g < gradients.size(); g++)
-        {
-          GradientInfo& info = gradients[g];
-
-          for(size_t k = 0; k < info.sphere_locations.size(); k++)
-          {
-            collision_point_pos_eigen_[i][j][0] = info.sphere_locations[k].x();
-            collision_point_pos_eigen_[i][j][1] = info.sphere_locations[k].y();
-            collision_point_pos_eigen_[i][j][2] = info.sphere_locations[k].z();
-
-            collision_point_potential_[i][j] = getPotential(info.distances[k], info.sphere_radii[k], parameters_->getMinClearence());
-            collision_point_potential_gradient_[i][j][0] = info.gradients[k].x();
-            collision_point_potential_gradient_[i][j][1] = info.gradients[k].y();
-            collision_point_potential_gradient_[i][j][2] = info.gradients[k].z();
-
-            point_is_in_collision_[i][j] = (info.distances[k] - info.sphere_radii[k] < info.sphere_radii[k]);
-
-            if(point_is_in_collision_[i][j])
-            {
-              state_is_in_collision_[i] = true;
-              is_collision_free_ = false;
-            }
-            j ++;
-          }
-        }
+        boost::mutex::scoped_lock lock(fk_lock_);
+        fk_threads_done_ = 0;
+        fk_generation_++;
+      }
+      fk_start_condition_.notify_all();
+    }
+    performForwardKinematics(fk_contexts_[0]);
+    if(num_threads > 1)
+    {
+      boost::mutex::scoped_lock lock(fk_lock_);
+      while(fk_threads_done_ < (unsigned int)(num_threads - 1))
+      {
+        fk_done_condition_.wait(lock);
       }
     }
 
+    is_collision_free_ = true;
+    for(int t = 0; t < num_threads; t++)
+    {
+      is_collision_free_ = is_collision_free_ && fk_contexts_[t].is_collision_free;
+    }
+
     // now, get the vel and acc for each collision point (using finite differencing)
     for(int i = free_vars_start_; i <= free_vars_end_; i++)
     {
@@ -941,7 +1182,48 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
     }
   }
 
-  void ChompOptimizer::setRobotStateFromPoint(ChompTrajectory& group_trajectory, int i)
+  void ChompOptimizer::performForwardKinematics(ForwardKinematicsContext& context)
+  {
+    context.is_collision_free = true;
+
+    // for each point in the trajectory
+    for(int i = context.start; i <= context.end; ++i)
+    {
+      // Set Robot state from trajectory point...
+      setRobotStateFromPoint(group_trajectory_, i, context);
+      computeJointProperties(i, context.state);
+      state_is_in_collision_[i] = false;
+
+      GradientBuffer& gradient_buffer = context.gradient_buffer;
+      collision_space_->getGroupSessionStateGradients(context.group_session, gradient_buffer);
+      for(size_t j = 0; j < gradient_buffer.getNumSpheres(); j++)
+      {
+        const tf::Vector3& location = gradient_buffer.sphere_locations[j];
+        const tf::Vector3& gradient = gradient_buffer.gradients[j];
+        double distance = gradient_buffer.distances[j];
+        double radius = gradient_buffer.sphere_radii[j];
+
+        collision_point_pos_eigen_[i][j][0] = location.x();
+        collision_point_pos_eigen_[i][j][1] = location.y();
+        collision_point_pos_eigen_[i][j][2] = location.z();
+
+        collision_point_potential_[i][j] = getPotential(distance, radius, parameters_->getMinClearence());
+        collision_point_potential_gradient_[i][j][0] = gradient.x();
+        collision_point_potential_gradient_[i][j][1] = gradient.y();
+        collision_point_potential_gradient_[i][j][2] = gradient.z();
+
+        point_is_in_collision_[i][j] = (distance - radius < radius);
+
+        if(point_is_in_collision_[i][j])
+        {
+          state_is_in_collision_[i] = true;
+          context.is_collision_free = false;
+        }
+      }
+    }
+  }
+
+  void ChompOptimizer::setRobotStateFromPoint(ChompTrajectory& group_trajectory, int i, ForwardKinematicsContext& context)
   {
     const MatrixXd::RowXpr& point = group_trajectory.getTrajectoryPoint(i);
 
@@ -952,10 +1234,10 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
     }
 
     ros::WallTime timer = ros::WallTime::now();
-    KinematicState::JointStateGroup* group = (KinematicState::JointStateGroup*)(robot_state_->getJointStateGroup(planning_group_));
+    KinematicState::JointStateGroup* group = (KinematicState::JointStateGroup*)(context.state->getJointStateGroup(planning_group_));
     group->setKinematicState(jointStates);
     timer = ros::WallTime::now();
-    collision_space_->setCurrentGroupState(*robot_state_);
+    collision_space_->setGroupSessionState(context.group_session, *context.state);
   }
 
   void ChompOptimizer::perturbTrajectory()
@@ -978,8 +1260,8 @@ CollisionProximitySpace::TrajectorySafety ChompOptimizer::checkCurrentIterValidi
     int mp_free_vars_index = mid_point - free_vars_start_;
     for(int i = 0; i < num_joints_; i++)
     {
-      group_trajectory_.getFreeJointTrajectoryBlock(i)
-          += joint_costs_[i].getQuadraticCostInverse().col(mp_free_vars_index) * random_state_(i);
+      joint_costs_[i].getQuadraticCostInverseColumn(mp_free_vars_index, quad_cost_inv_column_);
+      group_trajectory_.getFreeJointTrajectoryBlock(i) += quad_cost_inv_column_ * random_state_(i);
     }
   }
 
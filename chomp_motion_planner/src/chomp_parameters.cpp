@@ -75,6 +75,15 @@ void ChompParameters::initFromNodeHandle()
   node_handle.param("collision_threshold", collision_threshold_, 0.07);
   node_handle.param("random_jump_amount", random_jump_amount_, 1.0);
   node_handle.param("use_stochastic_descent", use_stochastic_descent_, true);
+  node_handle.param("num_threads", num_threads_, 1);
+  node_handle.param("num_starts", num_starts_, 1);
+  node_handle.param("coarse_discretization_factor", coarse_discretization_factor_, 1);
+  node_handle.param("coarse_max_iterations", coarse_max_iterations_, 20);
+  node_handle.param("use_nesterov_momentum", use_nesterov_momentum_, false);
+  node_handle.param("nesterov_momentum", nesterov_momentum_, 0.9);
+  node_handle.param("use_lbfgs", use_lbfgs_, false);
+  node_handle.param("lbfgs_history_size", lbfgs_history_size_, 5);
+  node_handle.param("lbfgs_max_line_search_steps", lbfgs_max_line_search_steps_, 10);
   filter_mode_ = false;
 }
 
@@ -47,6 +47,9 @@
 #include <planning_environment/models/model_utils.h>
 #include <spline_smoother/fritsch_butland_spline_smoother.h>
 
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
 #include <map>
 #include <vector>
 #include <string>
@@ -58,7 +61,8 @@ using namespace collision_proximity;
 namespace chomp
 {
 
-ChompPlannerNode::ChompPlannerNode(ros::NodeHandle node_handle, CollisionProximitySpace* space) : node_handle_(node_handle), collision_proximity_space_(space)
+ChompPlannerNode::ChompPlannerNode(ros::NodeHandle node_handle, CollisionProximitySpace* space) : node_handle_(node_handle), collision_proximity_space_(space),
+                                                                  trajectory_library_(NULL)
                                                                   //filter_constraints_chain_("arm_navigation_msgs::FilterJointTrajectoryWithConstraints::Request")
 {
 
@@ -72,6 +76,15 @@ bool ChompPlannerNode::init()
   node_handle_.param("use_additional_trajectory_filter", use_trajectory_filter_, false);
   node_handle_.param("minimum_spline_points", minimum_spline_points_, 40);
   node_handle_.param("maximum_spline_points", maximum_spline_points_, 100);
+  node_handle_.param("use_trajectory_library", use_trajectory_library_, false);
+  if(use_trajectory_library_) {
+    int library_size;
+    double library_resolution, library_max_distance;
+    node_handle_.param("trajectory_library_size", library_size, 64);
+    node_handle_.param("trajectory_library_resolution", library_resolution, 0.05);
+    node_handle_.param("trajectory_library_max_distance", library_max_distance, 0.5);
+    trajectory_library_ = new ChompTrajectoryLibrary(max(library_size, 0), library_resolution, library_max_distance);
+  }
   if(node_handle_.hasParam("joint_velocity_limits")) {
     XmlRpc::XmlRpcValue velocity_limits;
     
@@ -134,6 +147,7 @@ bool ChompPlannerNode::init()
 ChompPlannerNode::~ChompPlannerNode()
 {
   delete collision_models_;
+  delete trajectory_library_;
 }
 
 int ChompPlannerNode::run()
@@ -221,16 +235,60 @@ bool ChompPlannerNode::planKinematicPath(arm_navigation_msgs::GetMotionPlan::Req
   // fill in an initial quintic spline trajectory
   trajectory.fillInMinJerk();
 
+  // start from the nearest previously solved request, if there is one
+  bool seeded = false;
+  if(trajectory_library_ != NULL)
+  {
+    seeded = trajectory_library_->seedTrajectory(group_name, trajectory.getTrajectory());
+  }
+
   // set the max planning time:
   chomp_parameters_.setPlanningTimeLimit(req.motion_plan_request.allowed_planning_time.toSec());
 
   // optimize!
   ros::WallTime create_time = ros::WallTime::now();
-  ChompOptimizer optimizer(&trajectory, robot_model_, group_name, &chomp_parameters_,
-      vis_marker_array_publisher_, vis_marker_publisher_, collision_proximity_space_);
-  ROS_INFO("Optimization took %f sec to create", (ros::WallTime::now() - create_time).toSec());
-  optimizer.optimize();
+  bool collision_free;
+  int iterations = 0;
+
+  // take the large early deformations on a coarse trajectory, and refine at full resolution
+  // with whatever iterations and time are left
+  ChompParameters parameters = chomp_parameters_;
+  if(chomp_parameters_.getCoarseDiscretizationFactor() > 1)
+  {
+    iterations = optimizeCoarse(trajectory, group_name);
+    parameters.setMaxIterations(max(1, chomp_parameters_.getMaxIterations() - iterations));
+    parameters.setPlanningTimeLimit(max(0.0, chomp_parameters_.getPlanningTimeLimit() - (ros::WallTime::now() - create_time).toSec()));
+  }
+
+  int fine_iterations;
+  if(parameters.getNumStarts() > 1)
+  {
+    collision_free = optimizeMultiStart(trajectory, group_name, parameters, fine_iterations);
+  }
+  else
+  {
+    ChompOptimizer optimizer(&trajectory, robot_model_, group_name, &parameters,
+        vis_marker_array_publisher_, vis_marker_publisher_, collision_proximity_space_);
+    ROS_INFO("Optimization took %f sec to create", (ros::WallTime::now() - create_time).toSec());
+    optimizer.optimize();
+    collision_free = optimizer.isCollisionFree();
+    fine_iterations = optimizer.getNumIterations();
+  }
+  iterations += fine_iterations;
   ROS_INFO("Optimization actually took %f sec to run", (ros::WallTime::now() - create_time).toSec());
+  if(trajectory_library_ != NULL)
+  {
+    trajectory_library_->recordIterations(seeded, iterations);
+    if(collision_free)
+    {
+      trajectory_library_->addTrajectory(group_name, trajectory.getTrajectory());
+    }
+    ROS_INFO_STREAM("Trajectory library " << (seeded ? "hit" : "miss") << ", " << iterations << " iterations; "
+                    << trajectory_library_->getNumHits() << " hits, " << trajectory_library_->getNumMisses() << " misses, "
+                    << trajectory_library_->getSize() << " stored, average iterations "
+                    << trajectory_library_->getAverageIterations(true) << " seeded and "
+                    << trajectory_library_->getAverageIterations(false) << " unseeded");
+  }
   create_time = ros::WallTime::now();
   // assume that the trajectory is now optimized, fill in the output structure:
 
@@ -273,6 +331,111 @@ bool ChompPlannerNode::planKinematicPath(arm_navigation_msgs::GetMotionPlan::Req
   return true;
 }
 
+bool ChompPlannerNode::optimizeMultiStart(ChompTrajectory& trajectory, const string& group_name,
+                                          const ChompParameters& parameters, int& iterations)
+{
+  int num_starts = parameters.getNumStarts();
+  map<string, KinematicModel::JointModelGroup*> groupMap = robot_model_->getJointModelGroupMap();
+  const KinematicModel::JointModelGroup* modelGroup = groupMap[group_name];
+  int via_index = (trajectory.getStartIndex() + trajectory.getEndIndex()) / 2;
+
+  // the optimizers change the group sessions of the collision space when they are created and
+  // destroyed, so only optimize() runs in the threads
+  ChompOptimizerGroup optimizer_group;
+  vector<ChompParameters> start_parameters(num_starts, parameters);
+  vector<ChompTrajectory> trajectories(num_starts, trajectory);
+  vector<ChompOptimizer*> optimizers(num_starts);
+  for(int k = 0; k < num_starts; k++)
+  {
+    if(k % 2 == 1)
+    {
+      // a via point randomly moved away from the middle of the straight line
+      Eigen::MatrixXd::RowXpr via_point = trajectories[k].getTrajectoryPoint(via_index);
+      for(size_t j = 0; j < modelGroup->getJointModels().size(); j++)
+      {
+        const KinematicModel::JointModel* model = modelGroup->getJointModels()[j];
+        const KinematicModel::RevoluteJointModel* revoluteJoint = dynamic_cast<const KinematicModel::RevoluteJointModel*>(model);
+        double jump = parameters.getRandomJumpAmount();
+        double value = 0.5 * (trajectory(0, j) + trajectory(trajectory.getNumPoints() - 1, j))
+          + jump * (2.0 * ((double)random() / (double)RAND_MAX) - 1.0);
+        if(revoluteJoint == NULL || !revoluteJoint->continuous_)
+        {
+          map<string, pair<double, double> > bounds = model->getAllVariableBounds();
+          for(map<string, pair<double, double> >::iterator it = bounds.begin(); it != bounds.end(); it++)
+          {
+            value = max(it->second.first, min(it->second.second, value));
+          }
+        }
+        via_point(j) = value;
+      }
+      trajectories[k].fillInMinJerkThroughPoint(via_index);
+    }
+    else if(k > 0)
+    {
+      start_parameters[k].setUseHamiltonianMonteCarlo(true);
+    }
+  }
+  for(int k = 0; k < num_starts; k++)
+  {
+    optimizers[k] = new ChompOptimizer(&trajectories[k], robot_model_, group_name, &start_parameters[k],
+                                       vis_marker_array_publisher_, vis_marker_publisher_,
+                                       collision_proximity_space_, &optimizer_group);
+  }
+
+  boost::thread_group threads;
+  for(int k = 0; k < num_starts; k++)
+  {
+    threads.create_thread(boost::bind(&ChompOptimizer::optimize, optimizers[k]));
+  }
+  threads.join_all();
+
+  int best = 0;
+  for(int k = 1; k < num_starts; k++)
+  {
+    bool better_safety = optimizers[k]->isCollisionFree() && !optimizers[best]->isCollisionFree();
+    bool same_safety = optimizers[k]->isCollisionFree() == optimizers[best]->isCollisionFree();
+    if(better_safety || (same_safety && optimizers[k]->getBestTrajectoryCost() < optimizers[best]->getBestTrajectoryCost()))
+    {
+      best = k;
+    }
+  }
+  ROS_INFO_STREAM("Using start " << best << " of " << num_starts << " with cost " << optimizers[best]->getBestTrajectoryCost()
+                  << (optimizers[best]->isCollisionFree() ? ", collision free" : ", not collision free"));
+  trajectory.getTrajectory() = trajectories[best].getTrajectory();
+  bool collision_free = optimizers[best]->isCollisionFree();
+  iterations = optimizers[best]->getNumIterations();
+
+  for(int k = 0; k < num_starts; k++)
+  {
+    delete optimizers[k];
+  }
+  return collision_free;
+}
+
+int ChompPlannerNode::optimizeCoarse(ChompTrajectory& trajectory, const string& group_name)
+{
+  int num_coarse_points = (trajectory.getNumPoints() - 1) / chomp_parameters_.getCoarseDiscretizationFactor() + 1;
+  if(num_coarse_points < DIFF_RULE_LENGTH)
+  {
+    return 0;
+  }
+  double duration = (trajectory.getNumPoints() - 1) * trajectory.getDiscretization();
+  ChompTrajectory coarse_trajectory(robot_model_, num_coarse_points, duration / (num_coarse_points - 1), group_name);
+  coarse_trajectory.fillInFromTrajectory(trajectory);
+
+  ChompParameters parameters = chomp_parameters_;
+  parameters.setMaxIterations(min(chomp_parameters_.getCoarseMaxIterations(), chomp_parameters_.getMaxIterations()));
+  ros::WallTime start_time = ros::WallTime::now();
+  ChompOptimizer optimizer(&coarse_trajectory, robot_model_, group_name, &parameters,
+                           vis_marker_array_publisher_, vis_marker_publisher_, collision_proximity_space_);
+  optimizer.optimize();
+  ROS_INFO("Coarse optimization of %d points took %d iterations and %f sec", num_coarse_points,
+           optimizer.getNumIterations(), (ros::WallTime::now() - start_time).toSec());
+
+  trajectory.fillInFromTrajectory(coarse_trajectory);
+  return optimizer.getNumIterations();
+}
+
 bool ChompPlannerNode::filterJointTrajectory(arm_navigation_msgs::FilterJointTrajectoryWithConstraints::Request &request, arm_navigation_msgs::FilterJointTrajectoryWithConstraints::Response &res)
 {
   arm_navigation_msgs::FilterJointTrajectoryWithConstraints::Request req = request;
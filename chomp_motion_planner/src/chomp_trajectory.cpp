@@ -36,6 +36,7 @@
 
 #include <chomp_motion_planner/chomp_trajectory.h>
 #include <iostream>
+#include <algorithm>
 #include <ros/console.h>
 using namespace std;
 
@@ -167,6 +168,29 @@ void ChompTrajectory::updateFromGroupTrajectory(const ChompTrajectory& group_tra
   }
 }
 
+void ChompTrajectory::fillInMinJerkThroughPoint(int via_index)
+{
+  int start_index = start_index_;
+  int end_index = end_index_;
+  setStartEndIndex(start_index, via_index-1);
+  fillInMinJerk();
+  setStartEndIndex(via_index+1, end_index);
+  fillInMinJerk();
+  setStartEndIndex(start_index, end_index);
+}
+
+void ChompTrajectory::fillInFromTrajectory(const ChompTrajectory& source_traj)
+{
+  int last_source_point = source_traj.num_points_ - 1;
+  for (int i=0; i<num_points_; i++)
+  {
+    double source_point = (double)i * last_source_point / (num_points_ - 1);
+    int lower = std::min((int)source_point, last_source_point - 1);
+    double fraction = source_point - lower;
+    trajectory_.row(i) = (1.0 - fraction) * source_traj.trajectory_.row(lower) + fraction * source_traj.trajectory_.row(lower + 1);
+  }
+}
+
 void ChompTrajectory::fillInMinJerk()
 {
   double start_index = start_index_-1;
@@ -0,0 +1,170 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/** \author Mrinal Kalakrishnan */
+
+#include <chomp_motion_planner/chomp_trajectory_library.h>
+#include <cmath>
+
+using namespace std;
+using namespace Eigen;
+
+namespace chomp
+{
+
+ChompTrajectoryLibrary::ChompTrajectoryLibrary(unsigned int max_size, double resolution, double max_distance) :
+  max_size_(max_size), resolution_(resolution), max_distance_(max_distance)
+{
+  clear();
+}
+
+ChompTrajectoryLibrary::~ChompTrajectoryLibrary()
+{
+}
+
+void ChompTrajectoryLibrary::clear()
+{
+  entries_.clear();
+  cells_.clear();
+  num_hits_ = 0;
+  num_misses_ = 0;
+  iterations_[0] = iterations_[1] = 0.0;
+  runs_[0] = runs_[1] = 0;
+}
+
+void ChompTrajectoryLibrary::getEndpoints(const MatrixXd& trajectory, VectorXd& endpoints) const
+{
+  int num_joints = trajectory.cols();
+  endpoints.resize(2 * num_joints);
+  endpoints.head(num_joints) = trajectory.row(0).transpose();
+  endpoints.tail(num_joints) = trajectory.row(trajectory.rows() - 1).transpose();
+}
+
+ChompTrajectoryLibrary::CellKey ChompTrajectoryLibrary::getCellKey(const string& group_name, const VectorXd& endpoints) const
+{
+  CellKey key;
+  key.first = group_name;
+  key.second.resize(endpoints.size());
+  for(int i = 0; i < endpoints.size(); i++)
+  {
+    key.second[i] = (int)floor(endpoints(i) / resolution_ + 0.5);
+  }
+  return key;
+}
+
+bool ChompTrajectoryLibrary::seedTrajectory(const string& group_name, MatrixXd& trajectory)
+{
+  int num_points = trajectory.rows();
+  if(num_points < 3)
+  {
+    return false;
+  }
+  VectorXd endpoints;
+  getEndpoints(trajectory, endpoints);
+
+  list<Entry>::iterator nearest = entries_.end();
+  double nearest_distance = max_distance_;
+  for(list<Entry>::iterator it = entries_.begin(); it != entries_.end(); it++)
+  {
+    if(it->cell.first != group_name || it->endpoints.size() != endpoints.size())
+    {
+      continue;
+    }
+    double distance = (it->endpoints - endpoints).norm();
+    if(distance <= nearest_distance)
+    {
+      nearest_distance = distance;
+      nearest = it;
+    }
+  }
+  if(nearest == entries_.end())
+  {
+    num_misses_++;
+    return false;
+  }
+  num_hits_++;
+  entries_.splice(entries_.begin(), entries_, nearest);
+
+  // resample the stored trajectory to the number of points, and blend in the
+  // endpoint differences linearly over time
+  int num_joints = trajectory.cols();
+  const MatrixXd& stored = nearest->trajectory;
+  int num_stored = stored.rows();
+  VectorXd start_offset = endpoints.head(num_joints) - nearest->endpoints.head(num_joints);
+  VectorXd goal_offset = endpoints.tail(num_joints) - nearest->endpoints.tail(num_joints);
+  for(int i = 1; i < num_points - 1; i++)
+  {
+    double s = (double)i / (num_points - 1);
+    double x = s * (num_stored - 1);
+    int a = min((int)x, num_stored - 2);
+    double f = x - a;
+    trajectory.row(i) = (1.0 - f) * stored.row(a) + f * stored.row(a + 1)
+      + ((1.0 - s) * start_offset + s * goal_offset).transpose();
+  }
+  return true;
+}
+
+void ChompTrajectoryLibrary::addTrajectory(const string& group_name, const MatrixXd& trajectory)
+{
+  if(max_size_ == 0 || trajectory.rows() < 2)
+  {
+    return;
+  }
+  Entry entry;
+  getEndpoints(trajectory, entry.endpoints);
+  entry.cell = getCellKey(group_name, entry.endpoints);
+  entry.trajectory = trajectory;
+
+  map<CellKey, list<Entry>::iterator>::iterator cell_it = cells_.find(entry.cell);
+  if(cell_it != cells_.end())
+  {
+    entries_.erase(cell_it->second);
+    cells_.erase(cell_it);
+  }
+  entries_.push_front(entry);
+  cells_[entry.cell] = entries_.begin();
+  while(entries_.size() > max_size_)
+  {
+    cells_.erase(entries_.back().cell);
+    entries_.pop_back();
+  }
+}
+
+void ChompTrajectoryLibrary::recordIterations(bool seeded, int iterations)
+{
+  iterations_[seeded] += iterations;
+  runs_[seeded]++;
+}
+
+} // namespace chomp
@@ -0,0 +1,219 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+#include <gtest/gtest.h>
+
+#include <chomp_motion_planner/chomp_cost.h>
+#include <chomp_motion_planner/chomp_utils.h>
+#include <planning_models/kinematic_model.h>
+#include <urdf/model.h>
+#include <eigen3/Eigen/LU>
+
+using namespace chomp;
+using namespace Eigen;
+
+// a planar arm, just so that trajectories can be made for its group
+static const std::string URDF_STRING =
+  "<robot name=\"arm\">"
+  "  <link name=\"base_link\"/>"
+  "  <link name=\"link1\"/>"
+  "  <link name=\"link2\"/>"
+  "  <joint name=\"joint1\" type=\"continuous\">"
+  "    <parent link=\"base_link\"/><child link=\"link1\"/>"
+  "    <origin xyz=\"0 0 0\"/><axis xyz=\"0 0 1\"/>"
+  "  </joint>"
+  "  <joint name=\"joint2\" type=\"continuous\">"
+  "    <parent link=\"link1\"/><child link=\"link2\"/>"
+  "    <origin xyz=\"0.4 0 0\"/><axis xyz=\"0 0 1\"/>"
+  "  </joint>"
+  "</robot>";
+
+static const int NUM_POINTS = 40;
+static const double DISCRETIZATION = 0.05;
+static const double TOLERANCE = 1e-8;
+
+static void expectNear(const MatrixXd& expected, const MatrixXd& actual)
+{
+  ASSERT_EQ(expected.rows(), actual.rows());
+  ASSERT_EQ(expected.cols(), actual.cols());
+  EXPECT_LT((expected-actual).norm(), TOLERANCE*expected.norm());
+}
+
+class TestChompCost : public testing::Test
+{
+protected:
+
+  virtual void SetUp()
+  {
+    urdf::Model urdf_model;
+    ASSERT_TRUE(urdf_model.initString(URDF_STRING));
+    std::vector<planning_models::KinematicModel::GroupConfig> group_configs;
+    group_configs.push_back(planning_models::KinematicModel::GroupConfig("arm", "base_link", "link2"));
+    std::vector<planning_models::KinematicModel::MultiDofConfig> multi_dof_configs;
+    planning_models::KinematicModel::MultiDofConfig config("world_joint");
+    config.type = "Floating";
+    config.parent_frame_id = "odom_combined";
+    config.child_frame_id = "base_link";
+    multi_dof_configs.push_back(config);
+    robot_model_ = new planning_models::KinematicModel(urdf_model, group_configs, multi_dof_configs);
+    trajectory_ = new ChompTrajectory(robot_model_, NUM_POINTS, DISCRETIZATION, "arm");
+
+    derivative_costs_.resize(3);
+    derivative_costs_[0] = 0.2;
+    derivative_costs_[1] = 1.0;
+    derivative_costs_[2] = 0.05;
+    ridge_factor_ = 1e-4;
+    cost_ = new ChompCost(*trajectory_, 0, derivative_costs_, ridge_factor_);
+
+    // the dense quad cost, a sum of squared differentiation matrices
+    quad_cost_ = MatrixXd::Identity(NUM_POINTS, NUM_POINTS) * ridge_factor_;
+    double multiplier = 1.0;
+    for (int i=0; i<3; i++)
+    {
+      multiplier *= DISCRETIZATION;
+      MatrixXd diff_matrix = MatrixXd::Zero(NUM_POINTS, NUM_POINTS);
+      for (int r=0; r<NUM_POINTS; r++)
+      {
+        for (int k=-DIFF_RULE_LENGTH/2; k<=DIFF_RULE_LENGTH/2; k++)
+        {
+          if (r+k >= 0 && r+k < NUM_POINTS)
+            diff_matrix(r, r+k) = DIFF_RULES[i][k+DIFF_RULE_LENGTH/2];
+        }
+      }
+      quad_cost_ += derivative_costs_[i] * multiplier * diff_matrix.transpose() * diff_matrix;
+    }
+    int num_free = NUM_POINTS - 2*(DIFF_RULE_LENGTH-1);
+    quad_cost_inv_ = quad_cost_.block(DIFF_RULE_LENGTH-1, DIFF_RULE_LENGTH-1, num_free, num_free).inverse();
+  }
+
+  virtual void TearDown()
+  {
+    delete cost_;
+    delete trajectory_;
+    delete robot_model_;
+  }
+
+  // scales both the cost and the dense matrices it is checked against
+  void scale(double scale)
+  {
+    cost_->scale(scale);
+    quad_cost_ *= scale;
+    quad_cost_inv_ /= scale;
+  }
+
+  planning_models::KinematicModel* robot_model_;
+  ChompTrajectory* trajectory_;
+  std::vector<double> derivative_costs_;
+  double ridge_factor_;
+  ChompCost* cost_;
+  MatrixXd quad_cost_;
+  MatrixXd quad_cost_inv_;
+};
+
+TEST_F(TestChompCost, TestSolve)
+{
+  VectorXd x = VectorXd::Random(quad_cost_inv_.rows());
+  for (int s=0; s<2; s++)
+  {
+    VectorXd solution = x;
+    cost_->solve(solution);
+    expectNear(quad_cost_inv_*x, solution);
+    scale(0.37);
+  }
+}
+
+TEST_F(TestChompCost, TestInverseColumn)
+{
+  for (int s=0; s<2; s++)
+  {
+    for (int i=0; i<quad_cost_inv_.cols(); i+=5)
+    {
+      VectorXd column;
+      cost_->getQuadraticCostInverseColumn(i, column);
+      expectNear(quad_cost_inv_.col(i), column);
+    }
+    scale(0.37);
+  }
+}
+
+TEST_F(TestChompCost, TestInverseDiagonal)
+{
+  for (int s=0; s<2; s++)
+  {
+    expectNear(quad_cost_inv_.diagonal(), cost_->getQuadraticCostInverseDiagonal());
+    expectNear(quad_cost_inv_, cost_->getQuadraticCostInverse());
+    EXPECT_NEAR(quad_cost_inv_.maxCoeff(), cost_->getMaxQuadCostInvValue(), TOLERANCE*quad_cost_inv_.maxCoeff());
+    scale(1.0/cost_->getMaxQuadCostInvValue());
+  }
+}
+
+TEST_F(TestChompCost, TestCostAndDerivative)
+{
+  MatrixXd joint_trajectory = MatrixXd::Random(NUM_POINTS, 1);
+  for (int s=0; s<2; s++)
+  {
+    VectorXd x = joint_trajectory.col(0);
+    double expected_cost = x.dot(quad_cost_*x);
+    EXPECT_NEAR(expected_cost, cost_->getCost(joint_trajectory.col(0)), TOLERANCE*expected_cost);
+    VectorXd derivative(NUM_POINTS);
+    cost_->getDerivative(joint_trajectory.col(0), derivative);
+    expectNear(2.0*quad_cost_*x, derivative);
+    scale(0.37);
+  }
+}
+
+TEST_F(TestChompCost, TestCachedCostScalesWithJointCost)
+{
+  // a joint cost weight on the derivative costs is the unweighted cost with the ridge divided out, scaled
+  double joint_cost = 3.5;
+  std::vector<double> weighted_costs = derivative_costs_;
+  for (unsigned int i=0; i<weighted_costs.size(); i++)
+    weighted_costs[i] *= joint_cost;
+  ChompCost weighted(*trajectory_, 0, weighted_costs, ridge_factor_);
+  ChompCost cached = *ChompCost::getCachedCost(*trajectory_, derivative_costs_, ridge_factor_/joint_cost);
+  cached.scale(joint_cost);
+  EXPECT_EQ(ChompCost::getCachedCost(*trajectory_, derivative_costs_, ridge_factor_/joint_cost).get(),
+            ChompCost::getCachedCost(*trajectory_, derivative_costs_, ridge_factor_/joint_cost).get());
+
+  MatrixXd joint_trajectory = MatrixXd::Random(NUM_POINTS, 1);
+  double expected_cost = weighted.getCost(joint_trajectory.col(0));
+  EXPECT_NEAR(expected_cost, cached.getCost(joint_trajectory.col(0)), TOLERANCE*expected_cost);
+  expectNear(weighted.getQuadraticCostInverseDiagonal(), cached.getQuadraticCostInverseDiagonal());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
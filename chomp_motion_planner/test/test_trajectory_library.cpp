@@ -0,0 +1,167 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+#include <gtest/gtest.h>
+
+#include <chomp_motion_planner/chomp_trajectory_library.h>
+
+using namespace chomp;
+using namespace Eigen;
+
+static const double RESOLUTION = 0.05;
+static const double MAX_DISTANCE = 0.2;
+
+// a straight line from start to goal, with a bump of the given height on the interior points
+static MatrixXd makeTrajectory(int num_points, const Vector2d& start, const Vector2d& goal, double bump = 0.0)
+{
+  MatrixXd trajectory(num_points, 2);
+  for (int i=0; i<num_points; i++)
+  {
+    double s = (double)i / (num_points-1);
+    trajectory.row(i) = ((1.0-s)*start + s*goal).transpose();
+    if (i != 0 && i != num_points-1)
+      trajectory.row(i).array() += bump;
+  }
+  return trajectory;
+}
+
+// a request only has its start and goal set
+static MatrixXd makeRequest(int num_points, const Vector2d& start, const Vector2d& goal)
+{
+  MatrixXd request = MatrixXd::Zero(num_points, 2);
+  request.row(0) = start.transpose();
+  request.row(num_points-1) = goal.transpose();
+  return request;
+}
+
+TEST(TestTrajectoryLibrary, TestReplaceWithinCell)
+{
+  ChompTrajectoryLibrary library(4, RESOLUTION, MAX_DISTANCE);
+  Vector2d start(0.1, 0.2), goal(1.0, -0.5);
+  library.addTrajectory("arm", makeTrajectory(11, start, goal, 0.3));
+  // within half a cell of the first
+  library.addTrajectory("arm", makeTrajectory(11, start + Vector2d(0.01, 0.01), goal, 0.6));
+  EXPECT_EQ(1u, library.getSize());
+
+  MatrixXd request = makeRequest(11, start + Vector2d(0.01, 0.01), goal);
+  ASSERT_TRUE(library.seedTrajectory("arm", request));
+  EXPECT_LT((request - makeTrajectory(11, start + Vector2d(0.01, 0.01), goal, 0.6)).norm(), 1e-12);
+
+  // other cells and other groups are kept separately
+  library.addTrajectory("arm", makeTrajectory(11, start + Vector2d(0.1, 0.0), goal, 0.3));
+  library.addTrajectory("other_arm", makeTrajectory(11, start, goal, 0.3));
+  EXPECT_EQ(3u, library.getSize());
+}
+
+TEST(TestTrajectoryLibrary, TestLeastRecentlyUsedEviction)
+{
+  ChompTrajectoryLibrary library(2, RESOLUTION, MAX_DISTANCE);
+  Vector2d goal(1.0, 1.0);
+  Vector2d first(0.0, 0.0), second(-1.0, 0.0), third(0.0, -1.0);
+  library.addTrajectory("arm", makeTrajectory(11, first, goal));
+  library.addTrajectory("arm", makeTrajectory(11, second, goal));
+
+  // using the first makes the second the least recently used
+  MatrixXd request = makeRequest(11, first, goal);
+  EXPECT_TRUE(library.seedTrajectory("arm", request));
+  library.addTrajectory("arm", makeTrajectory(11, third, goal));
+  EXPECT_EQ(2u, library.getSize());
+
+  request = makeRequest(11, second, goal);
+  EXPECT_FALSE(library.seedTrajectory("arm", request));
+  request = makeRequest(11, first, goal);
+  EXPECT_TRUE(library.seedTrajectory("arm", request));
+  request = makeRequest(11, third, goal);
+  EXPECT_TRUE(library.seedTrajectory("arm", request));
+
+  // now the first is the least recently used
+  library.addTrajectory("arm", makeTrajectory(11, second, goal));
+  request = makeRequest(11, first, goal);
+  EXPECT_FALSE(library.seedTrajectory("arm", request));
+  EXPECT_EQ(3u, library.getNumHits());
+  EXPECT_EQ(2u, library.getNumMisses());
+}
+
+TEST(TestTrajectoryLibrary, TestMissBeyondMaxDistance)
+{
+  ChompTrajectoryLibrary library(4, RESOLUTION, MAX_DISTANCE);
+  Vector2d start(0.0, 0.0), goal(1.0, 1.0);
+  library.addTrajectory("arm", makeTrajectory(11, start, goal));
+
+  // the distance is taken over the start and goal together
+  MatrixXd request = makeRequest(11, start + Vector2d(0.15, 0.0), goal + Vector2d(0.15, 0.0));
+  MatrixXd unchanged = request;
+  EXPECT_FALSE(library.seedTrajectory("arm", request));
+  EXPECT_EQ(0.0, (request - unchanged).norm());
+
+  request = makeRequest(11, start + Vector2d(0.1, 0.0), goal + Vector2d(0.1, 0.0));
+  EXPECT_TRUE(library.seedTrajectory("arm", request));
+  request = makeRequest(11, start, goal);
+  EXPECT_FALSE(library.seedTrajectory("other_arm", request));
+  EXPECT_EQ(1u, library.getNumHits());
+  EXPECT_EQ(2u, library.getNumMisses());
+}
+
+TEST(TestTrajectoryLibrary, TestWarpToRequest)
+{
+  ChompTrajectoryLibrary library(4, RESOLUTION, MAX_DISTANCE);
+  Vector2d start(0.0, 0.5), goal(1.0, -0.5);
+  library.addTrajectory("arm", makeTrajectory(11, start, goal));
+
+  // a straight line resampled to more points, with the endpoint offsets blended in, is the
+  // straight line between the requested endpoints
+  Vector2d new_start = start + Vector2d(0.05, -0.03);
+  Vector2d new_goal = goal + Vector2d(-0.04, 0.08);
+  MatrixXd request = makeRequest(31, new_start, new_goal);
+  ASSERT_TRUE(library.seedTrajectory("arm", request));
+  EXPECT_EQ(31, request.rows());
+  EXPECT_EQ(new_start.transpose(), request.row(0));
+  EXPECT_EQ(new_goal.transpose(), request.row(30));
+  EXPECT_LT((request - makeTrajectory(31, new_start, new_goal)).norm(), 1e-12);
+
+  // and to fewer points, keeping the bump of a curved trajectory
+  library.clear();
+  library.addTrajectory("arm", makeTrajectory(41, start, goal, 0.2));
+  request = makeRequest(9, new_start, new_goal);
+  ASSERT_TRUE(library.seedTrajectory("arm", request));
+  EXPECT_EQ(new_start.transpose(), request.row(0));
+  EXPECT_EQ(new_goal.transpose(), request.row(8));
+  EXPECT_LT((request - makeTrajectory(9, new_start, new_goal, 0.2)).norm(), 1e-12);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
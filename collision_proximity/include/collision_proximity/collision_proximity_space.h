@@ -41,8 +41,11 @@
 #include <string>
 #include <algorithm>
 #include <sstream>
+#include <list>
 
 #include <ros/ros.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <planning_models/kinematic_model.h>
 #include <planning_models/kinematic_state.h>
@@ -52,6 +55,72 @@
 
 namespace collision_proximity
 {
+
+//counters and timings of a proximity space, times are in seconds of the monotonic clock
+struct ProximityStats
+{
+  enum Call {
+    SET_PLANNING_SCENE,
+    SETUP_FOR_GROUP_QUERIES,
+    SET_CURRENT_GROUP_STATE,
+    IS_STATE_IN_COLLISION,
+    GET_STATE_COLLISIONS,
+    GET_STATE_GRADIENTS,
+    IS_TRAJECTORY_SAFE,
+    IS_SEGMENT_COLLISION_FREE,
+    IS_TRAJECTORY_COLLISION_FREE,
+    NUM_CALLS
+  };
+
+  static const char* getCallName(Call call);
+
+  struct CallStats {
+    CallStats() : calls(0), total_time(0.0), max_time(0.0) {}
+
+    double getMeanTime() const {
+      return calls == 0 ? 0.0 : total_time/calls;
+    }
+
+    unsigned int calls;
+    double total_time;
+    double max_time;
+  };
+
+  ProximityStats() {
+    reset();
+  }
+
+  void reset() {
+    for(unsigned int i = 0; i < NUM_CALLS; i++) {
+      calls[i] = CallStats();
+    }
+    environment_field_updates = 0;
+    environment_field_time = 0.0;
+    self_field_updates = 0;
+    self_field_time = 0.0;
+    voxels_propagated = 0;
+    spheres_queried = 0;
+    intra_group_pairs_tested = 0;
+    lock_wait_time = 0.0;
+  }
+
+  CallStats calls[NUM_CALLS];
+
+  //environment and self field rebuilds, the self field only counts cache misses
+  unsigned int environment_field_updates;
+  double environment_field_time;
+  unsigned int self_field_updates;
+  double self_field_time;
+  unsigned long long voxels_propagated;
+
+  //spheres looked up in a field and sphere pairs of intra-group bodies that were checked
+  unsigned long long spheres_queried;
+  unsigned long long intra_group_pairs_tested;
+
+  //time spent waiting for the collision models bodies lock
+  double lock_wait_time;
+};
+
 //A class for implementation of proximity queries and proximity-based
 //collision queries
 
@@ -87,6 +156,37 @@ public:
   //returns the updating objects lock and destroys the current kinematic state
   void revertAfterGroupQueries();
 
+  //group sessions let several groups be set up against the same planning scene at
+  //once, each with its own query plan and self field while sharing the environment
+  //field. Session 0 always exists. setupForGroupQueries and all queries act on the
+  //current session, and switching doesn't redo the setup, but restores the planning
+  //scene state and allowed collisions the session was set up with. A new scene clears
+  //the setup of every session
+  unsigned int createGroupSession();
+
+  //the current session reverts to session 0 if it is destroyed
+  void destroyGroupSession(unsigned int handle);
+
+  //returns false if there is no such session
+  bool setCurrentGroupSession(unsigned int handle);
+
+  //creates a session with the group setup of the given one, sharing its self field.
+  //Returns 0 if there is no such session
+  unsigned int cloneGroupSession(unsigned int handle);
+
+  //as setCurrentGroupState and getStateGradients, for the given session rather than the
+  //current one. Different sessions can be used from different threads at once, as long
+  //as no sessions are created, destroyed or set up and no scene is set meanwhile
+  void setGroupSessionState(unsigned int handle, const planning_models::KinematicState& state);
+
+  bool getGroupSessionStateGradients(unsigned int handle,
+                                     GradientBuffer& gradients,
+                                     bool subtract_radii = false) const;
+
+  unsigned int getCurrentGroupSession() const {
+    return current_session_handle_;
+  }
+
   // sets the current group given the kinematic state
   void setCurrentGroupState(const planning_models::KinematicState& state);
 
@@ -102,29 +202,71 @@ public:
   bool getStateGradients(std::vector<GradientInfo>& gradients, 
                          bool subtract_radii = false) const;
 
+  // same as above in a caller-owned buffer, which doesn't allocate once it has been
+  // used for the current group
+  bool getStateGradients(GradientBuffer& gradients,
+                         bool subtract_radii = false) const;
+
   bool getIntraGroupCollisions(std::vector<bool>& collisions,
                                bool stop_at_first = false) const;
   
   bool getIntraGroupProximityGradients(std::vector<GradientInfo>& gradients,
                                        bool subtract_radii = false) const;
 
+  bool getIntraGroupProximityGradients(GradientArrays& gradients,
+                                       bool subtract_radii = false) const;
+
   bool getSelfCollisions(std::vector<bool>& collisions,
                                bool stop_at_first = false) const;
   
   bool getSelfProximityGradients(std::vector<GradientInfo>& gradients,
                                        bool subtract_radii = false) const;
 
+  bool getSelfProximityGradients(GradientArrays& gradients,
+                                       bool subtract_radii = false) const;
+
   bool getEnvironmentCollisions(std::vector<bool>& collisions,
                                 bool stop_at_first = false) const;
   
   bool getEnvironmentProximityGradients(std::vector<GradientInfo>& gradients,
                                         bool subtract_radii = false) const;
 
+  bool getEnvironmentProximityGradients(GradientArrays& gradients,
+                                        bool subtract_radii = false) const;
+
   TrajectorySafety isTrajectorySafe(const trajectory_msgs::JointTrajectory& trajectory,
                                     const arm_navigation_msgs::Constraints& goal_constraints,
                                     const arm_navigation_msgs::Constraints& path_constraints,
                                     const std::string& groupName);
 
+  // returns true if the current group can move along the straight joint-space line 
+  // between two group states without collision. The values are given for the named
+  // joints, which must include every joint of the group. How far each sphere can move
+  // is bounded from the group joints above its body, and the segment is only subdivided
+  // where the clearance at the ends can't cover that motion. Segments still unproven at
+  // max_segment_subdivision_depth are rejected, so segments that move planar or floating
+  // joints never pass
+  bool isSegmentCollisionFree(const std::vector<std::string>& joint_names,
+                              const std::vector<double>& start,
+                              const std::vector<double>& end);
+
+  // checks each segment between consecutive points of a trajectory for the current group,
+  // mapping the points by the trajectory's joint names
+  bool isTrajectoryCollisionFree(const trajectory_msgs::JointTrajectory& trajectory);
+
+  // with conservative advancement, isTrajectorySafe skips the points of the current group
+  // whose spheres can't have moved far enough since the last evaluated clear point to use
+  // up its clearance
+  void setConservativeAdvancement(bool conservative_advancement) {
+    conservative_advancement_ = conservative_advancement;
+  }
+
+  // with this set, isTrajectorySafe proves the segments between consecutive clear points
+  // of the current group free instead of only checking the points
+  void setCheckTrajectorySegments(bool check_trajectory_segments) {
+    check_trajectory_segments_ = check_trajectory_segments;
+  }
+
   // returns true if current setup is in environment collision
   bool isEnvironmentCollision() const;
 
@@ -173,39 +315,157 @@ public:
   bool setPlanningScene(const arm_navigation_msgs::PlanningScene& planning_scene);
 
   const std::string& getCurrentGroupName() const {
-    return current_group_name_;
+    return current_session_->group_name;
   }
 
   std::vector<std::string> getCurrentLinkNames() const
   {
-    return current_link_names_;
+    return current_session_->link_names;
   }
 
   std::vector<std::string> getCurrentAttachedBodyNames() const
   {
-    return current_attached_body_names_;
+    return current_session_->attached_body_names;
   }
 
   void setCollisionTolerance(double tol) {
     tolerance_ = tol;
   }
 
+  unsigned int getSelfFieldCacheHits() const {
+    return self_field_cache_hits_;
+  }
+
+  unsigned int getSelfFieldCacheMisses() const {
+    return self_field_cache_misses_;
+  }
+
+  size_t getSelfFieldCacheMemory() const {
+    return self_field_cache_memory_;
+  }
+
+  // number of group states evaluated by the last segment or trajectory check
+  unsigned int getNumSegmentStateEvaluations() const {
+    return segment_state_evaluations_;
+  }
+
+  // number of trajectory points the last isTrajectorySafe call proved clear without evaluating them
+  unsigned int getNumSkippedStateEvaluations() const {
+    return skipped_state_evaluations_;
+  }
+
+  // profiling is off unless the enable_profiling parameter is set, and costs a flag
+  // check per call when off
+  void setProfilingEnabled(bool enabled) {
+    profiling_enabled_ = enabled;
+  }
+
+  bool isProfilingEnabled() const {
+    return profiling_enabled_;
+  }
+
+  // returns a copy of the stats accumulated since construction or the last reset
+  ProximityStats getProfilingStats() const;
+
+  void resetProfilingStats();
+
   // Set to public to allow user to manually call these if callback overriden
   void setPlanningSceneCallback(const arm_navigation_msgs::PlanningScene& scene);
   void revertPlanningSceneCallback();
 
 private:
 
-  // updates the current state of the spheres in the gradient
-  bool updateSphereLocations(const std::vector<std::string>& link_names,
-                             const std::vector<std::string>& attached_body_names, 
-                             std::vector<GradientInfo>& gradients);
+  //times a public call from construction to destruction if profiling is enabled
+  class ScopedCallTimer {
+  public:
+    ScopedCallTimer(const CollisionProximitySpace* space, ProximityStats::Call call);
+    ~ScopedCallTimer();
+  private:
+    const CollisionProximitySpace* space_;
+    ProximityStats::Call call_;
+    double start_;
+  };
+
+  //counts the queries of a call and adds them to the stats on destruction if profiling is enabled
+  struct QueryCounter {
+    QueryCounter(const CollisionProximitySpace* space) : space_(space), spheres(0), intra_group_pairs(0) {}
+    ~QueryCounter() {
+      if(space_->profiling_enabled_) {
+        space_->addQueryCounts(spheres, intra_group_pairs);
+      }
+    }
+    const CollisionProximitySpace* space_;
+    unsigned int spheres;
+    unsigned int intra_group_pairs;
+  };
+
+  static double getMonotonicTime();
+
+  void addCallTime(ProximityStats::Call call, double time) const;
+
+  void addQueryCounts(unsigned int spheres, unsigned int intra_group_pairs) const;
+
+  void addFieldUpdate(bool self_field, double time, size_t voxels_propagated) const;
+
+  //the signed fields are held through the same pointer type, see the constructor
+  static size_t getNumPropagatedVoxels(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* field,
+                                       bool is_signed);
+
+  void publishDiagnostics(const ros::WallTimerEvent& event);
+
+  struct GroupQuerySession;
+
+  // updates the current state of the spheres in the session's gradients
+  bool updateSphereLocations(GroupQuerySession& session) const;
+
+  //poses the session's copies of its body spheres, leaving the shared decompositions alone
+  void poseSessionBodies(GroupQuerySession& session, const planning_models::KinematicState& state) const;
+
+  //the session versions of the public queries
+  bool getStateGradients(const GroupQuerySession& session,
+                         GradientBuffer& gradients,
+                         bool subtract_radii) const;
+  bool getIntraGroupProximityGradients(const GroupQuerySession& session,
+                                       GradientArrays& gradients,
+                                       bool subtract_radii) const;
+  bool getSelfProximityGradients(const GroupQuerySession& session,
+                                 GradientArrays& gradients,
+                                 bool subtract_radii) const;
+  bool getEnvironmentProximityGradients(const GroupQuerySession& session,
+                                        GradientArrays& gradients,
+                                        bool subtract_radii) const;
+
+  distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* createSelfDistanceField() const;
+
+  //puts the session in the first free handle
+  unsigned int addGroupSession(GroupQuerySession* session);
+
+  //drops the group setup of every session, for when the decompositions they point to change
+  void clearGroupSessionSetups();
 
+  //posed spheres of the current link or attached body, attached bodies follow the links
+  const std::vector<CollisionSphere>& getCurrentBodySpheres(unsigned int i) const {
+    return current_session_->body_spheres[i];
+  }
+
+  //fills in the query plan for the current link and attached body names
+  void compileGroupQueryPlan(const std::vector<unsigned int>& link_indices,
+                             const std::vector<unsigned int>& attached_body_indices);
 
+  //rebuilds the bounding hierarchies after the session's spheres have been posed
+  void updateSphereHierarchies(GroupQuerySession& session) const;
 
   void deleteAllStaticObjectDecompositions();
   void deleteAllAttachedObjectDecompositions();
 
+  //frees the handle of an attached object along with its decomposition
+  void deleteAttachedObjectDecomposition(unsigned int handle);
+
+  void setAttachedObjectTouchLinks(const std::string& id, const std::vector<std::string>& touch_links);
+
+  //returns NULL if nothing is attached under the id
+  BodyDecompositionVector* getAttachedObjectDecomposition(const std::string& id) const;
+
   // sets the poses of the body to those held in the kinematic state
   void setBodyPosesToCurrent();
 
@@ -226,15 +486,80 @@ private:
                                const std::vector<std::string>& attached_body_names, 
                                std::vector<GradientInfo>& gradients) const;
 
+  //sizes the arrays for the session's group and resets the distances
+  void prepareGradientArrays(const GroupQuerySession& session, GradientArrays& gradients) const;
+
+  //field distances at the sphere centers, as the gradient functions give them without
+  //subtracting radii, leaving the gradients unset
+  void getEnvironmentDistances(GradientArrays& distances) const;
+  void getSelfDistances(GradientArrays& distances) const;
+
+  //finds the group joints above each body of the current group
+  void setupBodyJointChains(const planning_models::KinematicState& state);
+
+  //finds for each value of the group's joint state vector the index of its joint in
+  //joint_names, returning false if a joint is missing or has more than one value
+  bool getGroupValueIndices(const std::string& group_name,
+                            const std::vector<std::string>& joint_names,
+                            std::vector<unsigned int>& indices) const;
+
+  //the points of the trajectory in the order of the group's joint state vector
+  bool getGroupTrajectoryValues(const std::string& group_name,
+                                const trajectory_msgs::JointTrajectory& trajectory,
+                                std::vector<std::vector<double> >& values) const;
+
+  //sets the group to the indicated values and fills in the sample, returning false
+  //if the group is in collision
+  bool computeSweptSphereSample(const std::vector<double>& group_values,
+                                SweptSphereSample& sample);
+
+  //fills in the sample for the current group state from the environment, self and intra
+  //distances of the buffer, returning false if the group is in collision. The intra distances
+  //have the radii subtracted, the field distances as given by field_radii_subtracted
+  bool fillSweptSphereSample(const GradientBuffer& gradients,
+                             bool field_radii_subtracted,
+                             SweptSphereSample& sample) const;
+
+  //bounds how far each sphere can move between the two group states, using the
+  //joint chain geometry of the sample taken at the first
+  void computeSphereMotionBounds(const SweptSphereSample& sample,
+                                 const std::vector<double>& start,
+                                 const std::vector<double>& end,
+                                 std::vector<double>& bounds) const;
+
+  //a sphere that has moved by d has a field value of at least its previous value minus d
+  //less this, which covers the quantization of both lookups
+  double getFieldLipschitzSlack() const {
+    return resolution_*sqrt(3.0);
+  }
+
+  bool isSegmentCollisionFree(const std::vector<double>& start,
+                              const std::vector<double>& end,
+                              const SweptSphereSample& start_sample,
+                              const SweptSphereSample& end_sample,
+                              unsigned int depth);
+
+  //updates the environment field to the current static objects and collision map,
+  //propagating only the changed voxels unless most of the scene changed
   void prepareEnvironmentDistanceField(const planning_models::KinematicState& state);
 
   void prepareSelfDistanceField(const std::vector<std::string>& link_names, 
                                 const planning_models::KinematicState& state);
 
+  //the self field only depends on the group, the joints outside the group and
+  //what is attached to the links in the field
+  std::string makeSelfFieldCacheKey(const std::string& group_name,
+                                    const std::vector<std::string>& df_links,
+                                    const planning_models::KinematicState& state) const;
+
+  void clearSelfFieldCache();
+
 
   //double getCollisionSphereProximity(const std::vector<CollisionSphere>& sphere_list, 
   //                                  unsigned int& closest, tf::Vector3& grad) const;
 
+  //rebuilds decompositions for static objects that were added or changed since the
+  //last scene, keeping the ones whose shapes and poses are the same
   void syncObjectsWithCollisionSpace(const planning_models::KinematicState& state);
 
   //configuration convenience functions
@@ -244,7 +569,6 @@ private:
   mutable std::vector<std::vector<double> > colors_;
 
   distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* environment_distance_field_;
-  distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* self_distance_field_;
 
   planning_environment::CollisionModelsInterface* collision_models_interface_;
 
@@ -253,32 +577,152 @@ private:
   ros::Publisher vis_distance_field_marker_publisher_;
   ros::Publisher vis_marker_publisher_;
   ros::Publisher vis_marker_array_publisher_;
+  ros::Publisher diagnostics_publisher_;
+  ros::WallTimer diagnostics_timer_;
 
   mutable boost::recursive_mutex group_queries_lock_;
 
+  //shared between scenes so that re-sent objects don't need to be re-decomposed
+  BodyDecompositionCache decomposition_cache_;
+
   std::map<std::string, BodyDecomposition*> body_decomposition_map_;
   std::map<std::string, BodyDecompositionVector*> static_object_map_;
-  std::map<std::string, BodyDecompositionVector*> attached_object_map_;
+
+  //attached object decompositions by handle, kept across scenes while the object stays
+  //attached to the same link with the same shapes. Freed handles have no decomposition
+  struct AttachedObjectRecord {
+    AttachedObjectRecord() : link_state_index(0), decomposition(NULL) {}
+    std::string id;
+    unsigned int link_state_index;
+    std::vector<ShapeDecompositionKey> keys;
+    std::vector<tf::Transform> fixed_transforms;
+    BodyDecompositionVector* decomposition;
+  };
+  std::vector<AttachedObjectRecord> attached_objects_;
+  std::map<std::string, unsigned int> attached_object_handles_;
+  std::vector<unsigned int> free_attached_object_handles_;
+
+  //what the static object decompositions were built from, for diffing scenes
+  struct StaticObjectRecord {
+    std::vector<ShapeDecompositionKey> keys;
+    std::vector<tf::Transform> poses;
+  };
+  std::map<std::string, StaticObjectRecord> static_object_records_;
+  std::vector<tf::Vector3> environment_collision_map_points_;
+  unsigned int environment_changed_points_;
+  bool environment_field_initialized_;
+  bool use_signed_environment_field_;
+  double max_incremental_update_fraction_;
 
   std::map<std::string, std::map<std::string, bool> > enabled_self_collision_links_;
   std::map<std::string, std::map<std::string, bool> > intra_group_collision_links_;
   std::map<std::string, std::map<std::string, bool> > attached_object_collision_links_;
   std::map<std::string, bool> self_excludes_;
 
-  //current entries to avoid map lookups during collision checks
-  std::string current_group_name_;
-  std::vector<std::string> current_link_names_;
-  std::vector<std::string> current_attached_body_names_;
-  std::vector<unsigned int> current_link_indices_;
-  std::vector<unsigned int> current_attached_body_indices_;
-  std::vector<BodyDecomposition*> current_link_body_decompositions_;
-  std::vector<BodyDecompositionVector*> current_attached_body_decompositions_;
-  std::vector<std::vector<bool> > current_intra_group_collision_links_;
-  std::vector<bool> current_self_excludes_;
-
-  //just for initializing input
-  std::vector<GradientInfo> current_gradients_;
-  
+  //the current group compiled down to indices, so that queries don't hash names or
+  //walk maps. Bodies are the links followed by the attached bodies
+  struct GroupQueryPlan {
+    GroupQueryPlan() : num_links(0), pair_words(0) {}
+
+    void clear() {
+      num_links = 0;
+      pair_words = 0;
+      link_state_indices.clear();
+      link_decompositions.clear();
+      attached_decompositions.clear();
+      self_checked.clear();
+      sphere_offsets.assign(1, 0);
+      enabled_pairs.clear();
+    }
+
+    unsigned int getNumBodies() const {
+      return link_state_indices.size();
+    }
+
+    bool isPairEnabled(unsigned int i, unsigned int j) const {
+      return (enabled_pairs[i*pair_words+(j >> 5)] >> (j & 31)) & 1u;
+    }
+
+    void setPairEnabled(unsigned int i, unsigned int j) {
+      enabled_pairs[i*pair_words+(j >> 5)] |= (1u << (j & 31));
+    }
+
+    unsigned int num_links;
+    //link state of each body, for attached bodies the link they are attached to
+    std::vector<unsigned int> link_state_indices;
+    std::vector<BodyDecomposition*> link_decompositions;
+    std::vector<BodyDecompositionVector*> attached_decompositions;
+    //whether the body is checked against the self field
+    std::vector<char> self_checked;
+    //spheres of body i are [sphere_offsets[i], sphere_offsets[i+1])
+    std::vector<unsigned int> sphere_offsets;
+    //row i holds pair_words 32 bit words with bit j set if bodies i and j are checked
+    std::vector<unsigned int> enabled_pairs;
+    unsigned int pair_words;
+  };
+
+  GradientBuffer swept_sphere_buffer_;
+  unsigned int max_segment_subdivision_depth_;
+  unsigned int segment_state_evaluations_;
+  unsigned int skipped_state_evaluations_;
+  bool conservative_advancement_;
+  bool check_trajectory_segments_;
+
+  //snapshots of previously computed self fields, least recently used at the back
+  struct SelfFieldCacheEntry {
+    distance_field::PropDistanceFieldSnapshot snapshot;
+    std::list<std::string>::iterator lru_it;
+  };
+  std::map<std::string, SelfFieldCacheEntry*> self_field_cache_;
+  std::list<std::string> self_field_cache_lru_;
+  size_t self_field_cache_memory_;
+  size_t self_field_cache_max_memory_;
+  double self_field_cache_joint_resolution_;
+  unsigned int self_field_cache_hits_;
+  unsigned int self_field_cache_misses_;
+  bool use_signed_self_field_;
+
+  //everything set up for one group, so that queries avoid map lookups
+  struct GroupQuerySession {
+    GroupQuerySession() : group_dimension(0), self_field_entry(NULL) {}
+
+    //forgets the group, keeping the self field
+    void clearSetup() {
+      group_name.clear();
+      link_names.clear();
+      attached_body_names.clear();
+      sphere_hierarchies.clear();
+      plan.clear();
+      body_joint_chains.clear();
+      group_dimension = 0;
+      gradients.clear();
+      body_spheres.clear();
+      start_state = arm_navigation_msgs::RobotState();
+    }
+
+    std::string group_name;
+    std::vector<std::string> link_names;
+    std::vector<std::string> attached_body_names;
+    std::vector<SphereHierarchy> sphere_hierarchies;
+    GroupQueryPlan plan;
+    std::vector<BodyJointChain> body_joint_chains;
+    unsigned int group_dimension;
+    //just for initializing input
+    std::vector<GradientInfo> gradients;
+    //posed copies of the spheres of each body, so that sessions don't pose each other's
+    std::vector<std::vector<CollisionSphere> > body_spheres;
+    //the robot state given at setup, restored with the group's allowed collisions on switching
+    arm_navigation_msgs::RobotState start_state;
+    //cloned sessions share the self field until they are set up again
+    boost::shared_ptr<distance_field::DistanceField<distance_field::PropDistanceFieldVoxel> > self_distance_field;
+    //the cached snapshot the self field holds, if any
+    SelfFieldCacheEntry* self_field_entry;
+  };
+  //indexed by handle, destroyed sessions are NULL
+  std::vector<GroupQuerySession*> group_sessions_;
+  GroupQuerySession* current_session_;
+  unsigned int current_session_handle_;
+
   //distance field configuration
   double size_x_, size_y_, size_z_;
   double origin_x_, origin_y_, origin_z_;
@@ -288,6 +732,18 @@ private:
   double max_self_distance_;
   double undefined_distance_;
 
+  bool profiling_enabled_;
+  mutable boost::mutex profiling_stats_lock_;
+  mutable ProximityStats profiling_stats_;
+
+  //only voxelize object surfaces; spheres that penetrate deeper than their radius
+  //then see the distance to the surface rather than zero
+  bool surface_points_only_;
+
+  //how the spheres of links and attached objects are chosen
+  SphereDecompositionMode sphere_decomposition_mode_;
+  double max_sphere_error_;
+
 };
 
 }
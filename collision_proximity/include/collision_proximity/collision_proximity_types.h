@@ -41,6 +41,8 @@
 #include <string>
 #include <algorithm>
 #include <sstream>
+#include <map>
+#include <stdint.h>
 
 #include <geometric_shapes/shapes.h>
 #include <geometric_shapes/bodies.h>
@@ -50,6 +52,8 @@
 #include <distance_field/propagation_distance_field.h>
 #include <distance_field/pf_distance_field.h>
 
+#include <collision_proximity/sphere_kernels.h>
+
 namespace collision_proximity
 {
 
@@ -106,12 +110,72 @@ struct GradientInfo
   }
 };
 
+//distances and gradients for the spheres of a set of bodies, stored flat. The spheres
+//of body i occupy [body_offsets[i], body_offsets[i+1]) of the per-sphere arrays
+struct GradientArrays
+{
+  //sizes the arrays for the given offsets, only allocating if they need to grow
+  void setup(const std::vector<unsigned int>& offsets);
+
+  //sets all distances back to DBL_MAX
+  void reset();
+
+  unsigned int getNumBodies() const {
+    return closest_distances.size();
+  }
+
+  unsigned int getNumSpheres() const {
+    return distances.size();
+  }
+
+  std::vector<unsigned int> body_offsets;
+  std::vector<double> closest_distances;
+  std::vector<double> distances;
+  std::vector<tf::Vector3> gradients;
+};
+
+//gradient storage meant to be kept by the caller and reused between queries in
+//place of a vector of GradientInfo. Once it has been used for a group, further
+//queries for that group don't touch the heap
+struct GradientBuffer : public GradientArrays
+{
+  void setup(const std::vector<unsigned int>& offsets);
+
+  std::vector<tf::Vector3> sphere_locations;
+  std::vector<double> sphere_radii;
+
+  //scratch for the individual environment, self and intra-group queries
+  GradientArrays environment;
+  GradientArrays self;
+  GradientArrays intra;
+};
+
 //determines set of collision spheres given a posed body
 std::vector<CollisionSphere> determineCollisionSpheres(const bodies::Body* body, tf::Transform& relativeTransform);
 
+//how the collision spheres of a body are chosen: spheres of the bounding cylinder's radius
+//along its axis, or spheres fitted to the body's collision points
+enum SphereDecompositionMode {
+  CYLINDER_SPHERE_DECOMPOSITION,
+  ADAPTIVE_SPHERE_DECOMPOSITION
+};
+
+//fits spheres around the voxels of the given resolution centered on the points, splitting
+//them across their longest extent until no sphere reaches more than max_error beyond its
+//voxels along the axes and diagonals. The relative vectors are in the frame of the points
+std::vector<CollisionSphere> determineAdaptiveCollisionSpheres(const std::vector<tf::Vector3>& points,
+                                                               double resolution,
+                                                               double max_error);
+
 //determines a set of points at the indicated resolution that are inside the supplied body 
 std::vector<tf::Vector3> determineCollisionPoints(const bodies::Body* body, double resolution);
 
+//determines the points of a resolution-aligned lattice that lie inside the padded shape.
+//Boxes, cylinders and spheres are rasterized analytically column by column, meshes column
+//by column through their convex hull, like bodies::ConvexMesh. If surface_only is set only
+//the points on the boundary of the shape are returned
+std::vector<tf::Vector3> determineCollisionPoints(const shapes::Shape* shape, double padding, double resolution, bool surface_only);
+
 //determines a set of gradients of the given collision spheres in the distance field
 bool getCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
                                  const std::vector<CollisionSphere>& sphere_list, 
@@ -121,10 +185,139 @@ bool getCollisionSphereGradients(const distance_field::DistanceField<distance_fi
                                  double maximum_value, 
                                  bool stop_at_first_collision);
 
+//as above, writing into the range of the indicated body
+bool getCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                 const std::vector<CollisionSphere>& sphere_list,
+                                 GradientArrays& gradients,
+                                 unsigned int body,
+                                 double tolerance,
+                                 bool subtract_radii,
+                                 double maximum_value,
+                                 bool stop_at_first_collision);
+
+//distances of the field at the sphere centers, written into the range of the indicated body
+//without computing gradients. The gradients of the range are left as they are
+void getCollisionSphereDistances(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                 const std::vector<CollisionSphere>& sphere_list,
+                                 GradientArrays& gradients,
+                                 unsigned int body);
+
+//returns true if any sphere is within tolerance of the field, reading one cell per sphere
 bool getCollisionSphereCollision(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
                                  const std::vector<CollisionSphere>& sphere_list,
                                  double tolerance);
 
+//bounding spheres over a list of posed collision spheres, one around the whole list and
+//one around each run of CHUNK_SIZE consecutive spheres, along with a structure-of-arrays
+//copy of the spheres for the distance kernels. The center radii bound the sphere centers
+//only, the full radii include the sphere radii
+struct SphereHierarchy
+{
+  static const unsigned int CHUNK_SIZE = 4;
+
+  SphereHierarchy() :
+    center_radius(0.0),
+    radius(0.0)
+  {}
+
+  void build(const std::vector<CollisionSphere>& spheres);
+
+  unsigned int getNumChunks() const {
+    return chunk_centers.size();
+  }
+
+  tf::Vector3 center;
+  double center_radius;
+  double radius;
+  std::vector<tf::Vector3> chunk_centers;
+  std::vector<double> chunk_center_radii;
+  std::vector<double> chunk_radii;
+  SphereArrays arrays;
+};
+
+//returns true if any sphere of the first list is within tolerance of one of the second,
+//skipping chunks whose bounds are further apart
+bool getSphereListCollision(const std::vector<CollisionSphere>& spheres1,
+                            const SphereHierarchy& hierarchy1,
+                            const std::vector<CollisionSphere>& spheres2,
+                            const SphereHierarchy& hierarchy2,
+                            double tolerance);
+
+//lowers the distances and gradients of both lists to the closest spheres of the other list,
+//visiting pairs in the same order as the all-pairs loop and skipping chunks that can't lower any of them.
+//Returns true if radii are subtracted and any pair is within tolerance
+bool getSphereListProximityGradients(const std::vector<CollisionSphere>& spheres1,
+                                     const SphereHierarchy& hierarchy1,
+                                     const std::vector<CollisionSphere>& spheres2,
+                                     const SphereHierarchy& hierarchy2,
+                                     GradientInfo& gradient1,
+                                     GradientInfo& gradient2,
+                                     double tolerance,
+                                     bool subtract_radii);
+
+//as above, for the ranges of two bodies in the same arrays
+bool getSphereListProximityGradients(const std::vector<CollisionSphere>& spheres1,
+                                     const SphereHierarchy& hierarchy1,
+                                     const std::vector<CollisionSphere>& spheres2,
+                                     const SphereHierarchy& hierarchy2,
+                                     GradientArrays& gradients,
+                                     unsigned int body1,
+                                     unsigned int body2,
+                                     double tolerance,
+                                     bool subtract_radii);
+
+//group joints above a body, root first, with the link state of each joint's
+//child link. Their origins lie on the joint axes
+enum ChainJointType {
+  CHAIN_REVOLUTE,
+  CHAIN_PRISMATIC,
+  CHAIN_UNBOUNDED
+};
+struct BodyJointChain {
+  std::vector<ChainJointType> joint_types;
+  std::vector<unsigned int> variable_indices;
+  std::vector<unsigned int> variable_counts;
+  std::vector<unsigned int> link_state_indices;
+};
+
+//clearances of the spheres of a group in one group state, with the joint chain geometry
+//of each body. chain_lengths[i][j] is the distance between the origins of joints j and j+1
+//of body i, lever_arms the distance of each sphere from the origin of its body's last joint
+struct SweptSphereSample {
+  std::vector<double> field_clearances;
+  std::vector<double> intra_clearances;
+  std::vector<double> lever_arms;
+  std::vector<std::vector<double> > chain_lengths;
+};
+
+//bounds how far a sphere of the body can move between two group states as
+//fixed_motion+lever_motion*lever_arm. A revolute joint moves the sphere by at most its
+//angle times the chain below it plus the lever arm, a prismatic joint by its displacement.
+//fixed_motion is DBL_MAX if an unbounded (multi-DOF) joint moves
+void computeChainMotionBounds(const BodyJointChain& chain,
+                              const std::vector<double>& chain_lengths,
+                              const std::vector<double>& start,
+                              const std::vector<double>& end,
+                              double& fixed_motion,
+                              double& lever_motion);
+
+//returns true if no sphere can come within tolerance anywhere on a segment whose ends have
+//the given clearances, when each sphere moves at most its bound along it. The fields are
+//1-Lipschitz up to field_slack, and two spheres of the group can approach each other by
+//both of their motions
+bool isSweptSegmentClear(const SweptSphereSample& start_sample,
+                         const SweptSphereSample& end_sample,
+                         const std::vector<double>& bounds,
+                         double field_slack,
+                         double tolerance);
+
+//returns true if no sphere can come within tolerance in any state in which each sphere
+//has moved at most its bound from the state of the sample
+bool isSweptRegionClear(const SweptSphereSample& sample,
+                        const std::vector<double>& bounds,
+                        double field_slack,
+                        double tolerance);
+
 //forward declaration required for friending apparently
 class BodyDecompositionVector;
 
@@ -134,7 +327,12 @@ class BodyDecomposition {
 
 public:
     
-  BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, double resolution, double padding = 0.01);
+  BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, double resolution, double padding = 0.01, bool surface_points_only = false,
+                    SphereDecompositionMode sphere_mode = CYLINDER_SPHERE_DECOMPOSITION, double max_sphere_error = 0.01);
+
+  //creates a decomposition for a shape identical to the one the prototype was made from,
+  //copying the relative spheres and points rather than recomputing them
+  BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, const BodyDecomposition& prototype);
 
   ~BodyDecomposition();
 
@@ -147,6 +345,9 @@ public:
   void updateSpheresPose(const tf::Transform& linkTransform);
   void updatePointsPose(const tf::Transform& linkTransform);
 
+  //poses a copy of the collision spheres without changing the decomposition
+  void getPosedSpheres(const tf::Transform& linkTransform, std::vector<CollisionSphere>& spheres) const;
+
   const std::vector<CollisionSphere>& getCollisionSpheres() const 
   {
     return collision_spheres_;
@@ -163,6 +364,10 @@ public:
   }
 
 private:
+
+  //not implemented, use the prototype constructor
+  BodyDecomposition(const BodyDecomposition&);
+  BodyDecomposition& operator=(const BodyDecomposition&);
     
   std::string object_name_;
 
@@ -237,6 +442,35 @@ public:
     }
   }
 
+  //fixes the bodies to a link with the given transforms relative to it, one per body,
+  //so that all of their spheres can be posed from the link pose
+  void setLinkRelativeTransforms(const std::vector<tf::Transform>& fixed_transforms) {
+    link_relative_sphere_centers_.resize(collision_spheres_.size());
+    for(unsigned int i = 0; i < decomp_vector_.size() && i < fixed_transforms.size(); i++) {
+      tf::Transform rel = fixed_transforms[i]*decomp_vector_[i]->relative_cylinder_pose_;
+      const std::vector<CollisionSphere>& spheres = decomp_vector_[i]->getCollisionSpheres();
+      for(unsigned int j = 0; j < spheres.size(); j++) {
+        link_relative_sphere_centers_[sphere_index_map_[i]+j] = rel*spheres[j].relative_vec_;
+      }
+    }
+  }
+
+  //poses the spheres of the vector, but not those of the individual bodies, from the
+  //pose of the link set with setLinkRelativeTransforms
+  void updateSpheresPoseFromLink(const tf::Transform& link_pose) {
+    getSpheresPosedFromLink(link_pose, collision_spheres_);
+  }
+
+  //as above for a copy of the collision spheres
+  void getSpheresPosedFromLink(const tf::Transform& link_pose, std::vector<CollisionSphere>& spheres) const {
+    if(spheres.size() != collision_spheres_.size()) {
+      spheres = collision_spheres_;
+    }
+    for(unsigned int i = 0; i < link_relative_sphere_centers_.size(); i++) {
+      spheres[i].center_ = link_pose*link_relative_sphere_centers_[i];
+    }
+  }
+
   void updateSpheresPose(unsigned int ind, const tf::Transform& pose) {
     if(ind < decomp_vector_.size()) {
       decomp_vector_[ind]->updateSpheresPose(pose);
@@ -256,6 +490,71 @@ private:
   std::vector<BodyDecomposition*> decomp_vector_;
   std::vector<CollisionSphere> collision_spheres_;
   std::vector<tf::Vector3> collision_points_;
+  std::vector<tf::Vector3> link_relative_sphere_centers_;
+};
+
+//identifies the geometry of a shape and the decomposition parameters, so that
+//decompositions can be shared between identical shapes
+struct ShapeDecompositionKey
+{
+  ShapeDecompositionKey(const shapes::Shape* shape, double resolution, double padding, bool surface_points_only,
+                        SphereDecompositionMode sphere_mode = CYLINDER_SPHERE_DECOMPOSITION, double max_sphere_error = 0.01);
+
+  bool operator<(const ShapeDecompositionKey& rhs) const;
+
+  int type;
+  std::vector<double> dimensions;
+  uint64_t mesh_hash;
+  double resolution;
+  double padding;
+  bool surface_points_only;
+  SphereDecompositionMode sphere_mode;
+  double max_sphere_error;
+};
+
+//keeps a prototype decomposition for each distinct shape that has been seen,
+//so that objects re-sent in subsequent planning scenes only need to be re-posed
+class BodyDecompositionCache
+{
+public:
+
+  BodyDecompositionCache(unsigned int max_entries = 256);
+  ~BodyDecompositionCache();
+
+  //returns a new decomposition owned by the caller, built from the cached
+  //prototype if the same shape has been decomposed before
+  BodyDecomposition* createBodyDecomposition(const std::string& object_name, 
+                                             const shapes::Shape* shape, 
+                                             double resolution, 
+                                             double padding = 0.01,
+                                             bool surface_points_only = false,
+                                             SphereDecompositionMode sphere_mode = CYLINDER_SPHERE_DECOMPOSITION,
+                                             double max_sphere_error = 0.01);
+
+  void clear();
+
+  void setMaxEntries(unsigned int max_entries) {
+    max_entries_ = max_entries;
+  }
+
+  unsigned int getSize() const {
+    return entries_.size();
+  }
+
+  unsigned int getNumHits() const {
+    return num_hits_;
+  }
+
+  unsigned int getNumMisses() const {
+    return num_misses_;
+  }
+
+private:
+
+  unsigned int max_entries_;
+  unsigned int num_hits_;
+  unsigned int num_misses_;
+  std::map<ShapeDecompositionKey, BodyDecomposition*> entries_;
 };
 
 struct ProximityInfo 
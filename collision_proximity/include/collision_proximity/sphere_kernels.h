@@ -0,0 +1,92 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+
+#ifndef COLLISION_PROXIMITY_SPHERE_KERNELS_
+#define COLLISION_PROXIMITY_SPHERE_KERNELS_
+
+#include <vector>
+
+namespace collision_proximity
+{
+
+//structure-of-arrays copy of a list of posed spheres, so that distances from one sphere
+//to many can be computed several at a time. Uses AVX when compiled with it enabled, SSE2
+//otherwise, and plain loops if COLLISION_PROXIMITY_NO_SIMD is defined
+struct SphereArrays
+{
+  void resize(unsigned int size) {
+    x.resize(size);
+    y.resize(size);
+    z.resize(size);
+    radius.resize(size);
+  }
+
+  unsigned int size() const {
+    return x.size();
+  }
+
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> z;
+  std::vector<double> radius;
+};
+
+//writes the distances from the sphere at (x,y,z) to spheres [begin, end) of the arrays,
+//between centers or, with subtract_radii, between surfaces
+void computeSphereDistances(double x, double y, double z, double radius,
+                            const SphereArrays& spheres, unsigned int begin, unsigned int end,
+                            bool subtract_radii, double* distances);
+
+//writes the row-major (end1-begin1) by (end2-begin2) matrix of distances between two sphere ranges
+void computeSphereDistanceMatrix(const SphereArrays& spheres1, unsigned int begin1, unsigned int end1,
+                                 const SphereArrays& spheres2, unsigned int begin2, unsigned int end2,
+                                 bool subtract_radii, double* distances);
+
+//returns the smallest distance from the sphere at (x,y,z) to spheres [begin, end), and
+//the first index attaining it in argmin. Returns DBL_MAX for an empty range
+double computeMinimumSphereDistance(double x, double y, double z, double radius,
+                                    const SphereArrays& spheres, unsigned int begin, unsigned int end,
+                                    bool subtract_radii, unsigned int& argmin);
+
+//returns the smallest distance between two sphere ranges and the indices attaining it
+double computeMinimumSphereDistance(const SphereArrays& spheres1, unsigned int begin1, unsigned int end1,
+                                    const SphereArrays& spheres2, unsigned int begin2, unsigned int end2,
+                                    bool subtract_radii, unsigned int& argmin1, unsigned int& argmin2);
+
+}
+
+#endif
@@ -0,0 +1,268 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+
+//times the main CollisionProximitySpace queries on a synthetic scene generated from a
+//seed, so that runs on different machines see the same scenes and states. The robot
+//is read from the parameter server, see collision_proximity_benchmark.launch for
+//loading it from files
+
+#include <algorithm>
+#include <cstdio>
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <boost/random/variate_generator.hpp>
+
+#include <ros/ros.h>
+#include <planning_environment/models/model_utils.h>
+#include <collision_proximity/collision_proximity_space.h>
+
+typedef boost::variate_generator<boost::mt19937&, boost::uniform_real<> > UniformGenerator;
+
+//keeps the latencies of one query and prints their distribution
+class LatencyStats
+{
+public:
+  LatencyStats(const std::string& name) :
+    name_(name)
+  {}
+
+  void addSample(const ros::WallDuration& d) {
+    samples_.push_back(d.toSec());
+  }
+
+  void print() {
+    if(samples_.empty()) {
+      printf("%-28s no samples\n", name_.c_str());
+      return;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    double sum = 0.0;
+    for(unsigned int i = 0; i < samples_.size(); i++) {
+      sum += samples_[i];
+    }
+    printf("%-28s n %6u  mean %10.3f  p50 %10.3f  p90 %10.3f  p99 %10.3f  max %10.3f ms\n",
+           name_.c_str(), (unsigned int)samples_.size(), sum*1000.0/samples_.size(),
+           getPercentile(0.5)*1000.0, getPercentile(0.9)*1000.0, getPercentile(0.99)*1000.0,
+           samples_.back()*1000.0);
+  }
+
+private:
+
+  //nearest rank on the sorted samples
+  double getPercentile(double p) const {
+    unsigned int ind = std::min((unsigned int)(p*samples_.size()), (unsigned int)samples_.size()-1);
+    return samples_[ind];
+  }
+
+  std::string name_;
+  std::vector<double> samples_;
+};
+
+//boxes, cylinders and spheres in the region in front of the robot. Every scene after the
+//first moves a share of the objects, so incremental field updates are exercised as well
+static void makeSyntheticScene(UniformGenerator& gen,
+                               const std::string& frame_id,
+                               unsigned int num_objects,
+                               double moved_fraction,
+                               std::vector<arm_navigation_msgs::CollisionObject>& objects)
+{
+  bool first = objects.empty();
+  objects.resize(num_objects);
+  for(unsigned int i = 0; i < num_objects; i++) {
+    if(!first && gen() > moved_fraction) {
+      continue;
+    }
+    arm_navigation_msgs::CollisionObject& obj = objects[i];
+    obj.header.frame_id = frame_id;
+    std::stringstream id;
+    id << "benchmark_object_" << i;
+    obj.id = id.str();
+    obj.operation.operation = arm_navigation_msgs::CollisionObjectOperation::ADD;
+    obj.shapes.resize(1);
+    obj.poses.resize(1);
+    switch(i%3) {
+    case 0:
+      obj.shapes[0].type = arm_navigation_msgs::Shape::BOX;
+      obj.shapes[0].dimensions.resize(3);
+      obj.shapes[0].dimensions[0] = 0.05+gen()*0.25;
+      obj.shapes[0].dimensions[1] = 0.05+gen()*0.25;
+      obj.shapes[0].dimensions[2] = 0.05+gen()*0.25;
+      break;
+    case 1:
+      obj.shapes[0].type = arm_navigation_msgs::Shape::CYLINDER;
+      obj.shapes[0].dimensions.resize(2);
+      obj.shapes[0].dimensions[0] = 0.02+gen()*0.08;
+      obj.shapes[0].dimensions[1] = 0.1+gen()*0.4;
+      break;
+    default:
+      obj.shapes[0].type = arm_navigation_msgs::Shape::SPHERE;
+      obj.shapes[0].dimensions.resize(1);
+      obj.shapes[0].dimensions[0] = 0.03+gen()*0.1;
+      break;
+    }
+    obj.poses[0].position.x = 0.3+gen()*0.7;
+    obj.poses[0].position.y = -0.7+gen()*1.4;
+    obj.poses[0].position.z = gen()*1.3;
+    obj.poses[0].orientation.w = 1.0;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "collision_proximity_benchmark");
+  ros::NodeHandle nh;
+  ros::NodeHandle priv("~");
+
+  std::string robot_description_name = nh.resolveName("robot_description", true);
+
+  std::string group_name;
+  int seed, num_states, num_scenes, num_objects, trajectory_length;
+  double moved_fraction;
+  priv.param("group_name", group_name, std::string("right_arm"));
+  priv.param("seed", seed, 0);
+  priv.param("num_states", num_states, 1000);
+  priv.param("num_scenes", num_scenes, 10);
+  priv.param("num_objects", num_objects, 20);
+  priv.param("moved_fraction", moved_fraction, 0.2);
+  priv.param("trajectory_length", trajectory_length, 20);
+
+  boost::mt19937 rng(seed);
+  boost::uniform_real<> dist(0.0, 1.0);
+  UniformGenerator gen(rng, dist);
+
+  collision_proximity::CollisionProximitySpace cps(robot_description_name, false);
+  planning_environment::CollisionModelsInterface* cmi = cps.getCollisionModelsInterface();
+  if(!cmi->loadedModels()) {
+    ROS_ERROR_STREAM("Couldn't load robot models from " << robot_description_name);
+    return 1;
+  }
+  const planning_models::KinematicModel::JointModelGroup* jmg = cmi->getKinematicModel()->getModelGroup(group_name);
+  if(jmg == NULL) {
+    ROS_ERROR_STREAM("No group " << group_name);
+    return 1;
+  }
+
+  planning_models::KinematicState default_state(cmi->getKinematicModel());
+  default_state.setKinematicStateToDefault();
+  arm_navigation_msgs::PlanningScene scene;
+  planning_environment::convertKinematicStateToRobotState(default_state, ros::Time(0), 
+                                                          cmi->getWorldFrameId(), scene.robot_state);
+
+  //group values in the order of the group's joint state vector, within the bounds
+  std::vector<std::pair<double, double> > bounds;
+  const planning_models::KinematicState::JointStateGroup* default_group = default_state.getJointStateGroup(group_name);
+  for(unsigned int i = 0; i < default_group->getJointStateVector().size(); i++) {
+    const planning_models::KinematicState::JointState* js = default_group->getJointStateVector()[i];
+    std::map<std::string, std::pair<double, double> > joint_bounds = js->getJointModel()->getAllVariableBounds();
+    for(unsigned int j = 0; j < js->getJointStateNameOrder().size(); j++) {
+      std::pair<double, double> b = joint_bounds[js->getJointStateNameOrder()[j]];
+      bounds.push_back(std::pair<double, double>(std::max(b.first, -M_PI), std::min(b.second, M_PI)));
+    }
+  }
+  std::vector<std::vector<double> > states(num_states, std::vector<double>(bounds.size()));
+  for(int i = 0; i < num_states; i++) {
+    for(unsigned int j = 0; j < bounds.size(); j++) {
+      states[i][j] = bounds[j].first+gen()*(bounds[j].second-bounds[j].first);
+    }
+  }
+
+  LatencyStats set_scene_stats("setPlanningScene");
+  LatencyStats setup_stats("setupForGroupQueries");
+  LatencyStats collision_stats("isStateInCollision");
+  LatencyStats gradient_stats("getStateGradients");
+  LatencyStats safety_stats("isTrajectorySafe");
+
+  std::vector<std::string> link_names, attached_body_names;
+  unsigned int num_in_collision = 0;
+  collision_proximity::GradientBuffer gradients;
+  for(int s = 0; s < num_scenes; s++) {
+    makeSyntheticScene(gen, cmi->getWorldFrameId(), num_objects, moved_fraction, scene.collision_objects);
+    ros::WallTime n1 = ros::WallTime::now();
+    cps.setPlanningScene(scene);
+    set_scene_stats.addSample(ros::WallTime::now()-n1);
+
+    n1 = ros::WallTime::now();
+    cps.setupForGroupQueries(group_name, scene.robot_state, link_names, attached_body_names);
+    setup_stats.addSample(ros::WallTime::now()-n1);
+
+    planning_models::KinematicState* state = cmi->getPlanningSceneState();
+    planning_models::KinematicState::JointStateGroup* jsg = state->getJointStateGroup(group_name);
+    for(int i = 0; i < num_states; i++) {
+      jsg->setKinematicState(states[i]);
+      cps.setCurrentGroupState(*state);
+
+      n1 = ros::WallTime::now();
+      if(cps.isStateInCollision()) {
+        num_in_collision++;
+      }
+      collision_stats.addSample(ros::WallTime::now()-n1);
+
+      n1 = ros::WallTime::now();
+      cps.getStateGradients(gradients, true);
+      gradient_stats.addSample(ros::WallTime::now()-n1);
+    }
+
+    //trajectories through consecutive states, interpolated so neighbouring points are close
+    trajectory_msgs::JointTrajectory trajectory;
+    trajectory.joint_names = jmg->getJointModelNames();
+    arm_navigation_msgs::Constraints empty_constraints;
+    for(int i = 0; i+1 < num_states; i += 2) {
+      trajectory.points.resize(trajectory_length);
+      for(int j = 0; j < trajectory_length; j++) {
+        double t = (trajectory_length > 1) ? j/(double)(trajectory_length-1) : 0.0;
+        trajectory.points[j].positions.resize(bounds.size());
+        for(unsigned int k = 0; k < bounds.size(); k++) {
+          trajectory.points[j].positions[k] = states[i][k]+t*(states[i+1][k]-states[i][k]);
+        }
+      }
+      n1 = ros::WallTime::now();
+      cps.isTrajectorySafe(trajectory, empty_constraints, empty_constraints, group_name);
+      safety_stats.addSample(ros::WallTime::now()-n1);
+    }
+  }
+
+  printf("group %s, seed %d, %d scenes of %d objects, %d states, %u spheres, %u of %d state checks in collision\n",
+         group_name.c_str(), seed, num_scenes, num_objects, num_states, gradients.getNumSpheres(),
+         num_in_collision, num_scenes*num_states);
+  set_scene_stats.print();
+  setup_stats.print();
+  collision_stats.print();
+  gradient_stats.print();
+  safety_stats.print();
+  return 0;
+}
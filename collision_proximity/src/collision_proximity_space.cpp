@@ -36,9 +36,11 @@
 
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <planning_environment/models/model_utils.h>
 #include <collision_proximity/collision_proximity_space.h>
 #include <tf/tf.h>
+#include <time.h>
 
 using collision_proximity::CollisionProximitySpace;
 
@@ -61,9 +63,35 @@ static std::string makeAttachedObjectId(std::string link, std::string object)
   return link+"_"+object;
 }
 
+static bool areTransformsEqual(const tf::Transform& t1, const tf::Transform& t2)
+{
+  static const double EPSILON = 1e-9;
+  if((t1.getOrigin()-t2.getOrigin()).length2() > EPSILON*EPSILON) {
+    return false;
+  }
+  for(unsigned int i = 0; i < 3; i++) {
+    if((t1.getBasis()[i]-t2.getBasis()[i]).length2() > EPSILON*EPSILON) {
+      return false;
+    }
+  }
+  return true;
+}
+
 CollisionProximitySpace::CollisionProximitySpace(const std::string& robot_description_name,
                                                  bool register_with_environment_server, bool use_signed_environment_field , bool use_signed_self_field) :
-  priv_handle_("~")
+  priv_handle_("~"),
+  environment_changed_points_(0),
+  environment_field_initialized_(false),
+  use_signed_environment_field_(use_signed_environment_field),
+  segment_state_evaluations_(0),
+  skipped_state_evaluations_(0),
+  self_field_cache_memory_(0),
+  self_field_cache_hits_(0),
+  self_field_cache_misses_(0),
+  use_signed_self_field_(use_signed_self_field),
+  current_session_(NULL),
+  current_session_handle_(0),
+  profiling_enabled_(false)
 {
   collision_models_interface_ = new planning_environment::CollisionModelsInterface(robot_description_name,
                                                                                    register_with_environment_server);
@@ -80,18 +108,52 @@ CollisionProximitySpace::CollisionProximitySpace(const std::string& robot_descri
   priv_handle_.param("max_self_distance", max_self_distance_, 0.1);
   priv_handle_.param("undefined_distance", undefined_distance_, 1.0);
 
+  int decomposition_cache_size;
+  priv_handle_.param("decomposition_cache_size", decomposition_cache_size, 256);
+  decomposition_cache_.setMaxEntries(decomposition_cache_size);
+  priv_handle_.param("surface_collision_points_only", surface_points_only_, false);
+  std::string sphere_decomposition_mode;
+  priv_handle_.param("sphere_decomposition_mode", sphere_decomposition_mode, std::string("cylinder"));
+  if(sphere_decomposition_mode == "adaptive") {
+    sphere_decomposition_mode_ = ADAPTIVE_SPHERE_DECOMPOSITION;
+  } else {
+    if(sphere_decomposition_mode != "cylinder") {
+      ROS_WARN_STREAM("Unknown sphere decomposition mode " << sphere_decomposition_mode << ", using cylinder");
+    }
+    sphere_decomposition_mode_ = CYLINDER_SPHERE_DECOMPOSITION;
+  }
+  priv_handle_.param("max_sphere_overapproximation_error", max_sphere_error_, 0.01);
+  priv_handle_.param("max_incremental_update_fraction", max_incremental_update_fraction_, 0.5);
+  double self_field_cache_max_megabytes;
+  priv_handle_.param("self_field_cache_max_memory", self_field_cache_max_megabytes, 128.0);
+  self_field_cache_max_memory_ = self_field_cache_max_megabytes*1024.0*1024.0;
+  priv_handle_.param("self_field_cache_joint_resolution", self_field_cache_joint_resolution_, 0.001);
+  int max_segment_subdivision_depth;
+  priv_handle_.param("max_segment_subdivision_depth", max_segment_subdivision_depth, 10);
+  max_segment_subdivision_depth_ = std::max(max_segment_subdivision_depth, 0);
+  priv_handle_.param("conservative_advancement", conservative_advancement_, false);
+  priv_handle_.param("check_trajectory_segments", check_trajectory_segments_, false);
+  priv_handle_.param("enable_profiling", profiling_enabled_, false);
+  double profiling_diagnostics_period;
+  priv_handle_.param("profiling_diagnostics_period", profiling_diagnostics_period, 0.0);
+  if(surface_points_only_ && (use_signed_environment_field || use_signed_self_field)) {
+    ROS_WARN("Signed distance fields need interior points, ignoring surface_collision_points_only");
+    surface_points_only_ = false;
+  }
+
   vis_distance_field_marker_publisher_ = root_handle_.advertise<visualization_msgs::Marker>("visualization_marker", 128);
   vis_marker_publisher_ = root_handle_.advertise<visualization_msgs::Marker>("collision_proximity_body_spheres", 128);
   vis_marker_array_publisher_ = root_handle_.advertise<visualization_msgs::MarkerArray>("collision_proximity_body_spheres_array", 128);
-
-  if(use_signed_self_field)
-  {
-    self_distance_field_ = (distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>*)(new distance_field::SignedPropagationDistanceField(size_x_, size_y_, size_z_, resolution_, origin_x_, origin_y_, origin_z_, max_self_distance_));
-  }
-  else
-  {
-    self_distance_field_ = new distance_field::PropagationDistanceField(size_x_, size_y_, size_z_, resolution_, origin_x_, origin_y_, origin_z_, max_self_distance_);
+  if(profiling_diagnostics_period > 0.0) {
+    profiling_enabled_ = true;
+    diagnostics_publisher_ = root_handle_.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+    diagnostics_timer_ = root_handle_.createWallTimer(ros::WallDuration(profiling_diagnostics_period),
+                                                      &CollisionProximitySpace::publishDiagnostics, this);
   }
+
+  current_session_ = new GroupQuerySession();
+  current_session_->self_distance_field.reset(createSelfDistanceField());
+  group_sessions_.push_back(current_session_);
   if(use_signed_environment_field)
   {
     environment_distance_field_ = (distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>*)(new distance_field::SignedPropagationDistanceField(size_x_, size_y_, size_z_, resolution_, origin_x_, origin_y_, origin_z_, max_environment_distance_));
@@ -123,9 +185,10 @@ CollisionProximitySpace::CollisionProximitySpace(const std::string& robot_descri
 
 CollisionProximitySpace::~CollisionProximitySpace()
 {
+  diagnostics_timer_.stop();
   delete collision_models_interface_;
-  delete self_distance_field_;
   delete environment_distance_field_;
+  clearSelfFieldCache();
   for(std::map<std::string, BodyDecomposition*>::iterator it = body_decomposition_map_.begin();
       it != body_decomposition_map_.end();
       it++) {
@@ -133,6 +196,89 @@ CollisionProximitySpace::~CollisionProximitySpace()
   }
   deleteAllStaticObjectDecompositions();
   deleteAllAttachedObjectDecompositions();
+  for(unsigned int i = 0; i < group_sessions_.size(); i++) {
+    delete group_sessions_[i];
+  }
+}
+
+distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* CollisionProximitySpace::createSelfDistanceField() const
+{
+  if(use_signed_self_field_)
+  {
+    return (distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>*)(new distance_field::SignedPropagationDistanceField(size_x_, size_y_, size_z_, resolution_, origin_x_, origin_y_, origin_z_, max_self_distance_));
+  }
+  return new distance_field::PropagationDistanceField(size_x_, size_y_, size_z_, resolution_, origin_x_, origin_y_, origin_z_, max_self_distance_);
+}
+
+unsigned int CollisionProximitySpace::createGroupSession()
+{
+  GroupQuerySession* session = new GroupQuerySession();
+  session->self_distance_field.reset(createSelfDistanceField());
+  return addGroupSession(session);
+}
+
+unsigned int CollisionProximitySpace::cloneGroupSession(unsigned int handle)
+{
+  if(handle >= group_sessions_.size() || group_sessions_[handle] == NULL) {
+    ROS_WARN_STREAM("No group session " << handle << " to clone");
+    return 0;
+  }
+  return addGroupSession(new GroupQuerySession(*group_sessions_[handle]));
+}
+
+unsigned int CollisionProximitySpace::addGroupSession(GroupQuerySession* session)
+{
+  for(unsigned int i = 1; i < group_sessions_.size(); i++) {
+    if(group_sessions_[i] == NULL) {
+      group_sessions_[i] = session;
+      return i;
+    }
+  }
+  group_sessions_.push_back(session);
+  return group_sessions_.size()-1;
+}
+
+void CollisionProximitySpace::destroyGroupSession(unsigned int handle)
+{
+  if(handle == 0 || handle >= group_sessions_.size() || group_sessions_[handle] == NULL) {
+    ROS_WARN_STREAM("Can't destroy group session " << handle);
+    return;
+  }
+  if(handle == current_session_handle_) {
+    setCurrentGroupSession(0);
+  }
+  delete group_sessions_[handle];
+  group_sessions_[handle] = NULL;
+}
+
+bool CollisionProximitySpace::setCurrentGroupSession(unsigned int handle)
+{
+  if(handle >= group_sessions_.size() || group_sessions_[handle] == NULL) {
+    ROS_WARN_STREAM("No group session " << handle);
+    return false;
+  }
+  if(handle == current_session_handle_) {
+    return true;
+  }
+  current_session_ = group_sessions_[handle];
+  current_session_handle_ = handle;
+  //restores the start state and allowed collision mask the session was set up with, as
+  //the planning scene state and allowed collisions are shared between sessions
+  if(!current_session_->group_name.empty()) {
+    collision_models_interface_->disableCollisionsForNonUpdatedLinks(current_session_->group_name);
+    planning_environment::setRobotStateAndComputeTransforms(current_session_->start_state,
+                                                            *collision_models_interface_->getPlanningSceneState());
+  }
+  return true;
+}
+
+void CollisionProximitySpace::clearGroupSessionSetups()
+{
+  for(unsigned int i = 0; i < group_sessions_.size(); i++) {
+    if(group_sessions_[i] != NULL) {
+      group_sessions_[i]->clearSetup();
+    }
+  }
 }
 
 void CollisionProximitySpace::deleteAllStaticObjectDecompositions()
@@ -143,19 +289,46 @@ void CollisionProximitySpace::deleteAllStaticObjectDecompositions()
     delete it->second;
   }
   static_object_map_.clear();
+  static_object_records_.clear();
 }
 
 void CollisionProximitySpace::deleteAllAttachedObjectDecompositions()
 {
-  for(std::map<std::string, BodyDecompositionVector*>::iterator it = attached_object_map_.begin();
-      it != attached_object_map_.end();
-      it++) {
-    delete it->second;
+  for(unsigned int i = 0; i < attached_objects_.size(); i++) {
+    delete attached_objects_[i].decomposition;
+  }
+  attached_objects_.clear();
+  attached_object_handles_.clear();
+  free_attached_object_handles_.clear();
+  clearGroupSessionSetups();
+}
+
+void CollisionProximitySpace::deleteAttachedObjectDecomposition(unsigned int handle)
+{
+  AttachedObjectRecord& record = attached_objects_[handle];
+  attached_object_handles_.erase(record.id);
+  attached_object_collision_links_.erase(record.id);
+  delete record.decomposition;
+  record = AttachedObjectRecord();
+  free_attached_object_handles_.push_back(handle);
+}
+
+void CollisionProximitySpace::setAttachedObjectTouchLinks(const std::string& id, const std::vector<std::string>& touch_links)
+{
+  std::map<std::string, bool>& links = attached_object_collision_links_[id];
+  links.clear();
+  for(unsigned int i = 0; i < touch_links.size(); i++) {
+    links[touch_links[i]] = false;
   }
-  attached_object_map_.clear();
-  current_attached_body_decompositions_.clear();
-  current_attached_body_names_.clear();
-  current_attached_body_indices_.clear();
+}
+
+collision_proximity::BodyDecompositionVector* CollisionProximitySpace::getAttachedObjectDecomposition(const std::string& id) const
+{
+  std::map<std::string, unsigned int>::const_iterator it = attached_object_handles_.find(id);
+  if(it == attached_object_handles_.end()) {
+    return NULL;
+  }
+  return attached_objects_[it->second].decomposition;
 }
 
 void CollisionProximitySpace::loadDefaultCollisionOperations()
@@ -260,9 +433,12 @@ void CollisionProximitySpace::loadRobotBodyDecompositions()
         padding = collision_models_interface_->getDefaultLinkPaddingMap().at(kmodel->getLinkModels()[i]->getName());
       }
 
-      body_decomposition_map_[kmodel->getLinkModels()[i]->getName()] = new BodyDecomposition(kmodel->getLinkModels()[i]->getName(),
-                                                                                             kmodel->getLinkModels()[i]->getLinkShape(),
-                                                                                             resolution_/2.0, padding);
+      body_decomposition_map_[kmodel->getLinkModels()[i]->getName()] = decomposition_cache_.createBodyDecomposition(kmodel->getLinkModels()[i]->getName(),
+                                                                                                                   kmodel->getLinkModels()[i]->getLinkShape(),
+                                                                                                                   resolution_/2.0, padding,
+                                                                                                                   surface_points_only_,
+                                                                                                                   sphere_decomposition_mode_,
+                                                                                                                   max_sphere_error_);
     }
   }
 }
@@ -273,15 +449,16 @@ bool CollisionProximitySpace::setPlanningScene(const arm_navigation_msgs::Planni
 
 void CollisionProximitySpace::setPlanningSceneCallback(const arm_navigation_msgs::PlanningScene& scene) 
 {
+  ScopedCallTimer call_timer(this, ProximityStats::SET_PLANNING_SCENE);
   ros::WallTime n1 = ros::WallTime::now();
-  deleteAllStaticObjectDecompositions();
-  deleteAllAttachedObjectDecompositions();
-
+  //static and attached objects are kept so that the new scene can be diffed against them
   syncObjectsWithCollisionSpace(*collision_models_interface_->getPlanningSceneState());
   
   prepareEnvironmentDistanceField(*collision_models_interface_->getPlanningSceneState());
   ros::WallTime n2 = ros::WallTime::now();
-  ROS_DEBUG_STREAM("Setting environment took " << (n2-n1).toSec());
+  ROS_DEBUG_STREAM("Setting environment took " << (n2-n1).toSec() << " decomposition cache has " 
+                   << decomposition_cache_.getSize() << " entries, " << decomposition_cache_.getNumHits() << " hits and "
+                   << decomposition_cache_.getNumMisses() << " misses");
 }
 
 void CollisionProximitySpace::setupForGroupQueries(const std::string& group_name,
@@ -289,121 +466,167 @@ void CollisionProximitySpace::setupForGroupQueries(const std::string& group_name
                                                    std::vector<std::string>& link_names,
                                                    std::vector<std::string>& attached_body_names)
 {
+  ScopedCallTimer call_timer(this, ProximityStats::SETUP_FOR_GROUP_QUERIES);
   ros::WallTime n1 = ros::WallTime::now();
   //setting up current info
-  current_group_name_ = group_name;
+  current_session_->group_name = group_name;
+  current_session_->start_state = rob_state;
+  //a cloned session may still be reading the self field
+  if(!current_session_->self_distance_field.unique()) {
+    current_session_->self_distance_field.reset(createSelfDistanceField());
+    current_session_->self_field_entry = NULL;
+  }
   //for trajectory safety check
   collision_models_interface_->disableCollisionsForNonUpdatedLinks(group_name);
   planning_environment::setRobotStateAndComputeTransforms(rob_state,
                                                           *collision_models_interface_->getPlanningSceneState());
-  getGroupLinkAndAttachedBodyNames(current_group_name_, 
+  std::vector<unsigned int> link_indices;
+  std::vector<unsigned int> attached_body_indices;
+  getGroupLinkAndAttachedBodyNames(current_session_->group_name, 
                                    *collision_models_interface_->getPlanningSceneState(),
-                                   current_link_names_, 
-                                   current_link_indices_,
-                                   current_attached_body_names_,
-                                   current_attached_body_indices_);
-  link_names = current_link_names_;
-  attached_body_names = current_attached_body_names_;
-  setupGradientStructures(current_link_names_,
-                          current_attached_body_names_,
-                          current_gradients_);
-
-  current_link_body_decompositions_.clear();
-  current_attached_body_decompositions_.clear();
-  current_self_excludes_.clear();
-  for(unsigned int i = 0; i < current_link_names_.size(); i++) {
-    current_link_body_decompositions_.push_back(body_decomposition_map_[current_link_names_[i]]);
-    if(self_excludes_.find(current_link_names_[i]) != self_excludes_.end()) {
-      current_self_excludes_.push_back(false);
-    } else {
-      current_self_excludes_.push_back(true);
-    }
-  }
-  for(unsigned int i = 0; i < current_attached_body_names_.size(); i++) {
-    current_attached_body_decompositions_.push_back(attached_object_map_[current_attached_body_names_[i]]);
-  }
-  current_intra_group_collision_links_.clear();
-  unsigned int num_links = current_link_names_.size();
-  unsigned int num_attached = current_attached_body_names_.size();
-  unsigned int tot = num_links+num_attached;
-  current_intra_group_collision_links_.resize(tot);
-  for(unsigned int i = 0; i < tot; i++) {
-    current_intra_group_collision_links_[i].resize(tot);
-    for(unsigned int j = 0; j < tot; j++) {
-      if(i < num_links && j < num_links) {
-        current_intra_group_collision_links_[i][j] = intra_group_collision_links_.find(current_link_names_[i])->second.find(current_link_names_[j])->second;
-        //ROS_INFO_STREAM("Setting intra_group_collision_links for " << current_link_names_[i] << " and " << current_link_names_[j] << " to " << current_intra_group_collision_links_[i][j]);
-      } else {
-        std::string name1;
-        std::string name2;
-        bool attached1 = false;
-        bool attached2 = false;
-        if(i < num_links) {
-          name1 = current_link_names_[i];
-        } else {
-          attached1 = true;          
-          name1 = current_attached_body_names_[i-num_links];
-        }
-        if(j < num_links) {
-          name2 = current_link_names_[j];
-        } else {
-          attached2 = true;
-          name2 = current_attached_body_names_[j-num_links];
-        }
-        current_intra_group_collision_links_[i][j] = true;
-        if(attached1) {
-          if(attached_object_collision_links_.find(name1)->second.find(name2) != attached_object_collision_links_.find(name1)->second.end() && !attached_object_collision_links_.find(name1)->second.find(name2)->second) {
-            current_intra_group_collision_links_[i][j] = false;
-          }
-        }
-        if(attached2) {
-          if(attached_object_collision_links_.find(name2)->second.find(name1) != attached_object_collision_links_.find(name2)->second.end() && !attached_object_collision_links_.find(name2)->second.find(name1)->second) {
-            current_intra_group_collision_links_[i][j] = false;
-          }
-        }
-      }
-    }
-  }
+                                   current_session_->link_names, 
+                                   link_indices,
+                                   current_session_->attached_body_names,
+                                   attached_body_indices);
+  link_names = current_session_->link_names;
+  attached_body_names = current_session_->attached_body_names;
+  setupGradientStructures(current_session_->link_names,
+                          current_session_->attached_body_names,
+                          current_session_->gradients);
+  compileGroupQueryPlan(link_indices, attached_body_indices);
   setBodyPosesGivenKinematicState(*collision_models_interface_->getPlanningSceneState());
-  setDistanceFieldForGroupQueries(current_group_name_, *collision_models_interface_->getPlanningSceneState());
+  current_session_->sphere_hierarchies.resize(current_session_->plan.getNumBodies());
+  //the decompositions only change size when they are rebuilt
+  for(unsigned int i = 0; i < current_session_->plan.getNumBodies(); i++) {
+    current_session_->plan.sphere_offsets[i+1] = current_session_->plan.sphere_offsets[i]+getCurrentBodySpheres(i).size();
+  }
+  poseSessionBodies(*current_session_, *collision_models_interface_->getPlanningSceneState());
+  setupBodyJointChains(*collision_models_interface_->getPlanningSceneState());
+  setDistanceFieldForGroupQueries(current_session_->group_name, *collision_models_interface_->getPlanningSceneState());
   ros::WallTime n2 = ros::WallTime::now();
-  ROS_DEBUG_STREAM("Setting self for group " << current_group_name_ << " took " << (n2-n1).toSec());
-  //visualizeDistanceField(self_distance_field_);
+  ROS_DEBUG_STREAM("Setting self for group " << current_session_->group_name << " took " << (n2-n1).toSec());
+  //visualizeDistanceField(current_session_->self_distance_field);
 }
 
 void CollisionProximitySpace::revertPlanningSceneCallback() {
 
+  double lock_start = profiling_enabled_ ? getMonotonicTime() : 0.0;
   collision_models_interface_->bodiesLock();
-  current_group_name_ = "";
-
-  deleteAllStaticObjectDecompositions();
-  deleteAllAttachedObjectDecompositions();
+  if(profiling_enabled_) {
+    boost::mutex::scoped_lock lock(profiling_stats_lock_);
+    profiling_stats_.lock_wait_time += getMonotonicTime()-lock_start;
+  }
+  //static and attached objects stay around, the next scene is diffed against them,
+  //but the sessions may point at attached objects that go away
+  clearGroupSessionSetups();
   collision_models_interface_->bodiesUnlock();
 }
 
 void CollisionProximitySpace::setCurrentGroupState(const planning_models::KinematicState& state)
 {
+  ScopedCallTimer call_timer(this, ProximityStats::SET_CURRENT_GROUP_STATE);
   ros::WallTime n1 = ros::WallTime::now();
-  if(current_group_name_.empty()) {
+  if(current_session_->group_name.empty()) {
+    return;
+  }
+  poseSessionBodies(*current_session_, state);
+  ROS_DEBUG_STREAM("Group state update took " << (ros::WallTime::now()-n1).toSec());
+}
+
+void CollisionProximitySpace::setGroupSessionState(unsigned int handle,
+                                                   const planning_models::KinematicState& state)
+{
+  ScopedCallTimer call_timer(this, ProximityStats::SET_CURRENT_GROUP_STATE);
+  if(handle >= group_sessions_.size() || group_sessions_[handle] == NULL) {
+    ROS_WARN_STREAM("No group session " << handle);
+    return;
+  }
+  if(group_sessions_[handle]->group_name.empty()) {
     return;
   }
+  poseSessionBodies(*group_sessions_[handle], state);
+}
+
+void CollisionProximitySpace::poseSessionBodies(GroupQuerySession& session,
+                                                const planning_models::KinematicState& state) const
+{
+  //the shared decompositions are only read here, each session poses its own copies
   tf::Transform inv = getInverseWorldTransform(state);
-  for(unsigned int i = 0; i < current_link_indices_.size(); i++) {
-    const planning_models::KinematicState::LinkState* ls = state.getLinkStateVector()[current_link_indices_[i]];
-    current_link_body_decompositions_[i]->updateSpheresPose(inv*ls->getGlobalCollisionBodyTransform());
+  const GroupQueryPlan& plan = session.plan;
+  for(unsigned int i = 0; i < plan.num_links; i++) {
+    plan.link_decompositions[i]->getPosedSpheres(inv*state.getLinkStateVector()[plan.link_state_indices[i]]->getGlobalCollisionBodyTransform(),
+                                                 session.body_spheres[i]);
+  }
+  //attached bodies are fixed to their link
+  for(unsigned int i = 0; i < plan.attached_decompositions.size(); i++) {
+    plan.attached_decompositions[i]->getSpheresPosedFromLink(inv*state.getLinkStateVector()[plan.link_state_indices[plan.num_links+i]]->getGlobalLinkTransform(),
+                                                             session.body_spheres[plan.num_links+i]);
+  }
+  updateSphereLocations(session);
+  updateSphereHierarchies(session);
+}
+
+void CollisionProximitySpace::compileGroupQueryPlan(const std::vector<unsigned int>& link_indices,
+                                                    const std::vector<unsigned int>& attached_body_indices)
+{
+  GroupQueryPlan& plan = current_session_->plan;
+  plan.clear();
+  current_session_->body_spheres.clear();
+  unsigned int num_links = current_session_->link_names.size();
+  unsigned int num_attached = current_session_->attached_body_names.size();
+  unsigned int tot = num_links+num_attached;
+  plan.num_links = num_links;
+  plan.link_state_indices = link_indices;
+  plan.link_state_indices.insert(plan.link_state_indices.end(), attached_body_indices.begin(), attached_body_indices.end());
+  for(unsigned int i = 0; i < num_links; i++) {
+    BodyDecomposition* bd = body_decomposition_map_.find(current_session_->link_names[i])->second;
+    plan.link_decompositions.push_back(bd);
+    current_session_->body_spheres.push_back(bd->getCollisionSpheres());
+    plan.self_checked.push_back(self_excludes_.find(current_session_->link_names[i]) == self_excludes_.end());
+  }
+  for(unsigned int i = 0; i < num_attached; i++) {
+    BodyDecompositionVector* bdv = getAttachedObjectDecomposition(current_session_->attached_body_names[i]);
+    plan.attached_decompositions.push_back(bdv);
+    current_session_->body_spheres.push_back(bdv->getCollisionSpheres());
+    plan.self_checked.push_back(true);
+  }
+  plan.sphere_offsets.assign(tot+1, 0);
+
+  plan.pair_words = (tot+31)/32;
+  plan.enabled_pairs.assign(tot*plan.pair_words, 0);
+  std::vector<const std::map<std::string, bool>*> touch_links(tot, (const std::map<std::string, bool>*)NULL);
+  for(unsigned int i = num_links; i < tot; i++) {
+    touch_links[i] = &attached_object_collision_links_.find(current_session_->attached_body_names[i-num_links])->second;
   }
-  for(unsigned int i = 0; i < current_attached_body_indices_.size(); i++) {
-    const planning_models::KinematicState::LinkState* ls = state.getLinkStateVector()[current_attached_body_indices_[i]];
-    for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
-      const planning_models::KinematicState::AttachedBodyState* att_state = ls->getAttachedBodyStateVector()[j];
-      for(unsigned int k = 0; k < att_state->getGlobalCollisionBodyTransforms().size(); k++) {
-        tf::Transform test = inv*att_state->getGlobalCollisionBodyTransforms()[k];
-        current_attached_body_decompositions_[i]->updateSpheresPose(k, inv*att_state->getGlobalCollisionBodyTransforms()[k]);
+  for(unsigned int i = 0; i < tot; i++) {
+    const std::string& name1 = (i < num_links) ? current_session_->link_names[i] : current_session_->attached_body_names[i-num_links];
+    for(unsigned int j = 0; j < tot; j++) {
+      const std::string& name2 = (j < num_links) ? current_session_->link_names[j] : current_session_->attached_body_names[j-num_links];
+      bool enabled = true;
+      if(i < num_links && j < num_links) {
+        enabled = intra_group_collision_links_.find(name1)->second.find(name2)->second;
+      } else {
+        //attached bodies are checked against everything but their touch links
+        std::map<std::string, bool>::const_iterator it;
+        if(touch_links[i] != NULL && (it = touch_links[i]->find(name2)) != touch_links[i]->end() && !it->second) {
+          enabled = false;
+        }
+        if(touch_links[j] != NULL && (it = touch_links[j]->find(name1)) != touch_links[j]->end() && !it->second) {
+          enabled = false;
+        }
+      }
+      if(enabled) {
+        plan.setPairEnabled(i, j);
       }
     }
   }
-  updateSphereLocations(current_link_names_, current_attached_body_names_, current_gradients_);
-  ROS_DEBUG_STREAM("Group state update took " << (ros::WallTime::now()-n1).toSec());
+}
+
+void CollisionProximitySpace::updateSphereHierarchies(GroupQuerySession& session) const
+{
+  for(unsigned int i = 0; i < session.sphere_hierarchies.size(); i++) {
+    session.sphere_hierarchies[i].build(session.body_spheres[i]);
+  }
 }
 
 void CollisionProximitySpace::setBodyPosesGivenKinematicState(const planning_models::KinematicState& state)
@@ -419,18 +642,18 @@ void CollisionProximitySpace::setBodyPosesGivenKinematicState(const planning_mod
     for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
       const planning_models::KinematicState::AttachedBodyState* att_state = ls->getAttachedBodyStateVector()[j];
       std::string id = makeAttachedObjectId(ls->getName(), att_state->getName());
-      if(attached_object_map_.find(id) == attached_object_map_.end()) {
+      BodyDecompositionVector* att = getAttachedObjectDecomposition(id);
+      if(att == NULL) {
         ROS_WARN_STREAM("Updating pose but no attached object for id " << id);
         continue;
       }
-      if(attached_object_map_[id]->getSize() != att_state->getGlobalCollisionBodyTransforms().size()) {
-        ROS_WARN_STREAM("For attached object bodies number " << attached_object_map_[id]->getSize() 
+      if(att->getSize() != att_state->getGlobalCollisionBodyTransforms().size()) {
+        ROS_WARN_STREAM("For attached object bodies number " << att->getSize() 
                         << " not equal to state number " << att_state->getGlobalCollisionBodyTransforms().size() << ". Not updating");
         continue;
       }
       for(unsigned int k = 0; k < att_state->getGlobalCollisionBodyTransforms().size(); k++) {
-        tf::Transform test = inv*att_state->getGlobalCollisionBodyTransforms()[k];
-        attached_object_map_[id]->updateBodyPose(k, inv*att_state->getGlobalCollisionBodyTransforms()[k]);
+        att->updateBodyPose(k, inv*att_state->getGlobalCollisionBodyTransforms()[k]);
       }
     }
   }
@@ -451,35 +674,118 @@ void CollisionProximitySpace::syncObjectsWithCollisionSpace(const planning_model
   tf::Transform inv = getInverseWorldTransform(state);
   const collision_space::EnvironmentObjects *eo = collision_models_interface_->getCollisionSpace()->getObjects();
   std::vector<std::string> ns = eo->getNamespaces();
+  std::map<std::string, BodyDecompositionVector*> old_static_object_map;
+  old_static_object_map.swap(static_object_map_);
+  std::map<std::string, StaticObjectRecord> old_static_object_records;
+  old_static_object_records.swap(static_object_records_);
+  environment_changed_points_ = 0;
   for(unsigned int i = 0; i < ns.size(); i++) {
     if(ns[i] == COLLISION_MAP_NAME) continue;
     const collision_space::EnvironmentObjects::NamespaceObjects &no = eo->getObjects(ns[i]);
+    StaticObjectRecord record;
+    for(unsigned int j = 0; j < no.shape.size(); j++) {
+      record.keys.push_back(ShapeDecompositionKey(no.shape[j], resolution_, 0.01, surface_points_only_));
+      record.poses.push_back(inv*no.shape_pose[j]);
+    }
+    std::map<std::string, BodyDecompositionVector*>::iterator old_it = old_static_object_map.find(ns[i]);
+    if(old_it != old_static_object_map.end()) {
+      const StaticObjectRecord& old_record = old_static_object_records[ns[i]];
+      bool unchanged = (old_record.keys.size() == record.keys.size());
+      for(unsigned int j = 0; unchanged && j < record.keys.size(); j++) {
+        unchanged = !(old_record.keys[j] < record.keys[j]) && !(record.keys[j] < old_record.keys[j]) && 
+          areTransformsEqual(old_record.poses[j], record.poses[j]);
+      }
+      if(unchanged) {
+        static_object_map_[ns[i]] = old_it->second;
+        static_object_records_[ns[i]] = record;
+        old_static_object_map.erase(old_it);
+        continue;
+      }
+    }
     BodyDecompositionVector* bdv = new BodyDecompositionVector();
     for(unsigned int j = 0; j < no.shape.size(); j++) {
-      BodyDecomposition* bd = new BodyDecomposition(ns[i]+"_"+makeStringFromUnsignedInt(j), no.shape[j], resolution_);
-      bd->updatePose(inv*no.shape_pose[j]);
-      tf::Transform trans = bd->getBody()->getPose();
+      BodyDecomposition* bd = decomposition_cache_.createBodyDecomposition(ns[i]+"_"+makeStringFromUnsignedInt(j), no.shape[j], resolution_, 0.01, surface_points_only_);
+      bd->updatePose(record.poses[j]);
       bdv->addToVector(bd); 
     }
+    environment_changed_points_ += bdv->getCollisionPoints().size();
     static_object_map_[ns[i]] = bdv;
+    static_object_records_[ns[i]] = record;
+  }
+  //whatever is left was removed or changed
+  for(std::map<std::string, BodyDecompositionVector*>::iterator it = old_static_object_map.begin();
+      it != old_static_object_map.end();
+      it++) {
+    environment_changed_points_ += it->second->getCollisionPoints().size();
+    delete it->second;
   }
   
+  //attached objects that are still attached to the same link with the same shapes
+  //keep their handles and decompositions
+  std::vector<bool> attached_in_scene(attached_objects_.size(), false);
   const std::vector<planning_models::KinematicState::LinkState*> link_states = state.getLinkStateVector();
   for(unsigned int i = 0; i < link_states.size(); i++) {
     const planning_models::KinematicState::LinkState* ls = link_states[i];
     for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
-      BodyDecompositionVector* bdv = new BodyDecompositionVector();
       const planning_models::KinematicState::AttachedBodyState* abs = ls->getAttachedBodyStateVector()[j];
+      const planning_models::KinematicModel::AttachedBodyModel* abm = abs->getAttachedBodyModel();
       std::string id = makeAttachedObjectId(ls->getName(),abs->getName());
-      for(unsigned int k = 0; k < abs->getAttachedBodyModel()->getShapes().size(); k++) {
-        BodyDecomposition* bd = new BodyDecomposition(id+makeStringFromUnsignedInt(j), abs->getAttachedBodyModel()->getShapes()[k], resolution_);
+      AttachedObjectRecord record;
+      record.id = id;
+      record.link_state_index = i;
+      for(unsigned int k = 0; k < abm->getShapes().size(); k++) {
+        record.keys.push_back(ShapeDecompositionKey(abm->getShapes()[k], resolution_, 0.01, surface_points_only_,
+                                                    sphere_decomposition_mode_, max_sphere_error_));
+      }
+      record.fixed_transforms = abm->getAttachedBodyFixedTransforms();
+
+      std::map<std::string, unsigned int>::iterator handle_it = attached_object_handles_.find(id);
+      if(handle_it != attached_object_handles_.end()) {
+        const AttachedObjectRecord& old_record = attached_objects_[handle_it->second];
+        bool unchanged = (old_record.link_state_index == record.link_state_index &&
+                          old_record.keys.size() == record.keys.size() &&
+                          old_record.fixed_transforms.size() == record.fixed_transforms.size());
+        for(unsigned int k = 0; unchanged && k < record.keys.size(); k++) {
+          unchanged = !(old_record.keys[k] < record.keys[k]) && !(record.keys[k] < old_record.keys[k]);
+        }
+        for(unsigned int k = 0; unchanged && k < record.fixed_transforms.size(); k++) {
+          unchanged = areTransformsEqual(old_record.fixed_transforms[k], record.fixed_transforms[k]);
+        }
+        if(unchanged) {
+          attached_in_scene[handle_it->second] = true;
+          setAttachedObjectTouchLinks(id, abm->getTouchLinks());
+          continue;
+        }
+        deleteAttachedObjectDecomposition(handle_it->second);
+      }
+
+      record.decomposition = new BodyDecompositionVector();
+      for(unsigned int k = 0; k < abm->getShapes().size(); k++) {
+        BodyDecomposition* bd = decomposition_cache_.createBodyDecomposition(id+makeStringFromUnsignedInt(k), abm->getShapes()[k], resolution_, 0.01, surface_points_only_,
+                                                                             sphere_decomposition_mode_, max_sphere_error_);
         bd->updatePose(inv*abs->getGlobalCollisionBodyTransforms()[k]);
-        bdv->addToVector(bd);
+        record.decomposition->addToVector(bd);
       }
-      attached_object_map_[id] = bdv;
-      for(unsigned int k = 0; k < abs->getAttachedBodyModel()->getTouchLinks().size(); k++) {
-        attached_object_collision_links_[id][abs->getAttachedBodyModel()->getTouchLinks()[k]] = false;
+      record.decomposition->setLinkRelativeTransforms(record.fixed_transforms);
+      unsigned int handle;
+      if(free_attached_object_handles_.empty()) {
+        handle = attached_objects_.size();
+        attached_objects_.push_back(record);
+        attached_in_scene.push_back(true);
+      } else {
+        handle = free_attached_object_handles_.back();
+        free_attached_object_handles_.pop_back();
+        attached_objects_[handle] = record;
+        attached_in_scene[handle] = true;
       }
+      attached_object_handles_[id] = handle;
+      setAttachedObjectTouchLinks(id, abm->getTouchLinks());
+    }
+  }
+  //whatever is left was detached
+  for(unsigned int i = 0; i < attached_in_scene.size(); i++) {
+    if(!attached_in_scene[i] && attached_objects_[i].decomposition != NULL) {
+      deleteAttachedObjectDecomposition(i);
     }
   }
 }
@@ -499,34 +805,170 @@ void CollisionProximitySpace::setDistanceFieldForGroupQueries(const std::string&
       df_links.push_back(it->first);
     }
   }
+  if(use_signed_self_field_ || self_field_cache_max_memory_ == 0) {
+    prepareSelfDistanceField(df_links, state);
+    return;
+  }
+  distance_field::PropagationDistanceField* self_field = static_cast<distance_field::PropagationDistanceField*>(current_session_->self_distance_field.get());
+  std::string key = makeSelfFieldCacheKey(group_name, df_links, state);
+  std::map<std::string, SelfFieldCacheEntry*>::iterator it = self_field_cache_.find(key);
+  if(it != self_field_cache_.end()) {
+    self_field_cache_hits_++;
+    SelfFieldCacheEntry* entry = it->second;
+    if(entry != current_session_->self_field_entry) {
+      self_field->restoreSnapshot(entry->snapshot, current_session_->self_field_entry == NULL ? NULL : &current_session_->self_field_entry->snapshot);
+      current_session_->self_field_entry = entry;
+    }
+    self_field_cache_lru_.splice(self_field_cache_lru_.begin(), self_field_cache_lru_, entry->lru_it);
+    ROS_DEBUG_STREAM("Self field cache hit for group " << group_name << ", " << self_field_cache_hits_ << " hits and " 
+                     << self_field_cache_misses_ << " misses");
+    return;
+  }
+  self_field_cache_misses_++;
   prepareSelfDistanceField(df_links, state);
+  SelfFieldCacheEntry* entry = new SelfFieldCacheEntry();
+  self_field->takeSnapshot(entry->snapshot);
+  self_field_cache_lru_.push_front(key);
+  entry->lru_it = self_field_cache_lru_.begin();
+  self_field_cache_[key] = entry;
+  self_field_cache_memory_ += entry->snapshot.getMemorySize();
+  current_session_->self_field_entry = entry;
+  //evict least recently used snapshots, never the one just taken
+  while(self_field_cache_memory_ > self_field_cache_max_memory_ && self_field_cache_lru_.size() > 1) {
+    std::map<std::string, SelfFieldCacheEntry*>::iterator old = self_field_cache_.find(self_field_cache_lru_.back());
+    self_field_cache_memory_ -= old->second->snapshot.getMemorySize();
+    //other sessions' fields may still hold it
+    for(unsigned int i = 0; i < group_sessions_.size(); i++) {
+      if(group_sessions_[i] != NULL && group_sessions_[i]->self_field_entry == old->second) {
+        group_sessions_[i]->self_field_entry = NULL;
+      }
+    }
+    delete old->second;
+    self_field_cache_.erase(old);
+    self_field_cache_lru_.pop_back();
+  }
+  ROS_DEBUG_STREAM("Self field cache miss for group " << group_name << ", cache holds " << self_field_cache_.size()
+                   << " fields in " << self_field_cache_memory_/(1024.0*1024.0) << " MB");
+}
+
+std::string CollisionProximitySpace::makeSelfFieldCacheKey(const std::string& group_name,
+                                                           const std::vector<std::string>& df_links,
+                                                           const planning_models::KinematicState& state) const
+{
+  std::stringstream key;
+  key << group_name;
+  const planning_models::KinematicModel::JointModelGroup* jmg = 
+    collision_models_interface_->getKinematicModel()->getModelGroup(group_name);
+  //the root joint only moves the robot frame the fields are expressed in
+  for(unsigned int i = 1; i < state.getJointStateVector().size(); i++) {
+    const planning_models::KinematicState::JointState* js = state.getJointStateVector()[i];
+    if(jmg != NULL && jmg->hasJointModel(js->getName())) {
+      continue;
+    }
+    for(unsigned int j = 0; j < js->getJointStateValues().size(); j++) {
+      key << " " << (long)floor(js->getJointStateValues()[j]/self_field_cache_joint_resolution_+0.5);
+    }
+  }
+  for(unsigned int i = 0; i < df_links.size(); i++) {
+    const planning_models::KinematicState::LinkState* ls = state.getLinkState(df_links[i]);
+    if(ls == NULL) {
+      continue;
+    }
+    for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
+      const planning_models::KinematicModel::AttachedBodyModel* abm = ls->getAttachedBodyStateVector()[j]->getAttachedBodyModel();
+      key << " " << makeAttachedObjectId(ls->getName(), abm->getName());
+      for(unsigned int k = 0; k < abm->getShapes().size(); k++) {
+        ShapeDecompositionKey shape_key(abm->getShapes()[k], resolution_, 0.01, surface_points_only_);
+        key << " " << shape_key.type << " " << shape_key.mesh_hash;
+        for(unsigned int l = 0; l < shape_key.dimensions.size(); l++) {
+          key << " " << shape_key.dimensions[l];
+        }
+        const tf::Transform& fixed = abm->getAttachedBodyFixedTransforms()[k];
+        for(unsigned int l = 0; l < 3; l++) {
+          key << " " << (long)floor(fixed.getOrigin()[l]/self_field_cache_joint_resolution_+0.5);
+          for(unsigned int m = 0; m < 3; m++) {
+            key << " " << (long)floor(fixed.getBasis()[l][m]/self_field_cache_joint_resolution_+0.5);
+          }
+        }
+      }
+    }
+  }
+  return key.str();
+}
+
+void CollisionProximitySpace::clearSelfFieldCache()
+{
+  for(std::map<std::string, SelfFieldCacheEntry*>::iterator it = self_field_cache_.begin();
+      it != self_field_cache_.end();
+      it++) {
+    delete it->second;
+  }
+  self_field_cache_.clear();
+  self_field_cache_lru_.clear();
+  self_field_cache_memory_ = 0;
+  for(unsigned int i = 0; i < group_sessions_.size(); i++) {
+    if(group_sessions_[i] != NULL) {
+      group_sessions_[i]->self_field_entry = NULL;
+    }
+  }
 }
 
 void CollisionProximitySpace::prepareEnvironmentDistanceField(const planning_models::KinematicState& state)
 {
-  environment_distance_field_->reset();
+  double start_time = 0.0;
+  size_t start_voxels = 0;
+  if(profiling_enabled_) {
+    start_time = getMonotonicTime();
+    start_voxels = getNumPropagatedVoxels(environment_distance_field_, use_signed_environment_field_);
+  }
   tf::Transform inv = getInverseWorldTransform(state);
   std::vector<tf::Vector3> all_points;
   for(std::map<std::string, BodyDecompositionVector*>::iterator it = static_object_map_.begin();
       it != static_object_map_.end();
       it++) {
-    for(unsigned int i = 0; i < it->second->getSize(); i++) {
-      std::vector<tf::Vector3> obj_points = it->second->getBodyDecomposition(i)->getCollisionPoints();
-      all_points.insert(all_points.end(),obj_points.begin(), obj_points.end());
-    }
+    const std::vector<tf::Vector3>& obj_points = it->second->getCollisionPoints();
+    all_points.insert(all_points.end(),obj_points.begin(), obj_points.end());
   }
+  std::vector<tf::Vector3> collision_map_points(collision_models_interface_->getCollisionMapPoses().size());
   for(unsigned int i = 0; i < collision_models_interface_->getCollisionMapPoses().size(); i++) {
-    all_points.push_back(inv*collision_models_interface_->getCollisionMapPoses()[i].getOrigin());
+    collision_map_points[i] = inv*collision_models_interface_->getCollisionMapPoses()[i].getOrigin();
+  }
+  if(collision_map_points != environment_collision_map_points_) {
+    environment_changed_points_ += collision_map_points.size()+environment_collision_map_points_.size();
+    environment_collision_map_points_.swap(collision_map_points);
+  }
+  all_points.insert(all_points.end(), environment_collision_map_points_.begin(), environment_collision_map_points_.end());
+
+  if(use_signed_environment_field_ || !environment_field_initialized_) {
+    environment_distance_field_->reset();
+    environment_distance_field_->addPointsToField(all_points);
+    environment_field_initialized_ = true;
+  } else if(environment_changed_points_ > 0) {
+    //removal and re-propagation of the changed voxels only pays off for small changes
+    bool iterative = environment_changed_points_ <= max_incremental_update_fraction_*all_points.size();
+    ROS_DEBUG_STREAM("Updating environment field " << (iterative ? "incrementally" : "from scratch") << " for " 
+                     << environment_changed_points_ << " changed points out of " << all_points.size());
+    static_cast<distance_field::PropagationDistanceField*>(environment_distance_field_)->updatePointsInField(all_points, iterative);
+  }
+  if(profiling_enabled_) {
+    addFieldUpdate(false, getMonotonicTime()-start_time,
+                   getNumPropagatedVoxels(environment_distance_field_, use_signed_environment_field_)-start_voxels);
+  }
+  if(vis_distance_field_marker_publisher_.getNumSubscribers() > 0) {
+    visualizeDistanceField(environment_distance_field_);
   }
-  environment_distance_field_->addPointsToField(all_points);
-  visualizeDistanceField(environment_distance_field_);
-  //ROS_INFO_STREAM("Adding points took " << (n2-n1).toSec());
 }
 
 void CollisionProximitySpace::prepareSelfDistanceField(const std::vector<std::string>& link_names, 
                                                        const planning_models::KinematicState& state)
 {
-  self_distance_field_->reset();
+  double start_time = 0.0;
+  size_t start_voxels = 0;
+  if(profiling_enabled_) {
+    start_time = getMonotonicTime();
+    start_voxels = getNumPropagatedVoxels(current_session_->self_distance_field.get(), use_signed_self_field_);
+  }
+  current_session_->self_distance_field->reset();
   tf::Transform inv = getInverseWorldTransform(state);
   std::vector<tf::Vector3> all_points;
   for(unsigned int i = 0; i < link_names.size(); i++) {
@@ -540,16 +982,20 @@ void CollisionProximitySpace::prepareSelfDistanceField(const std::vector<std::st
     const planning_models::KinematicState::LinkState* ls = state.getLinkState(link_names[i]);
     for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
       std::string id = makeAttachedObjectId(ls->getName(),ls->getAttachedBodyStateVector()[j]->getName());
-      if(attached_object_map_.find(id) == attached_object_map_.end()) {
+      if(getAttachedObjectDecomposition(id) == NULL) {
         ROS_WARN_STREAM("Have no attached object body for attached object " << id);
         continue;
       }
-      const BodyDecompositionVector* att = attached_object_map_.find(id)->second;
+      const BodyDecompositionVector* att = getAttachedObjectDecomposition(id);
       const std::vector<tf::Vector3>& att_points = att->getCollisionPoints();
       all_points.insert(all_points.end(), att_points.begin(), att_points.end());
     }
   }
-  self_distance_field_->addPointsToField(all_points);
+  current_session_->self_distance_field->addPointsToField(all_points);
+  if(profiling_enabled_) {
+    addFieldUpdate(true, getMonotonicTime()-start_time,
+                   getNumPropagatedVoxels(current_session_->self_distance_field.get(), use_signed_self_field_)-start_voxels);
+  }
 }
 
 /*
@@ -581,11 +1027,11 @@ bool CollisionProximitySpace::getEnvironmentProximity(ProximityInfo& prox) const
     const planning_models::KinematicModel::LinkModel* lm = monitor_->getKinematicModel()->getLinkModel(link_names[i]);
     for(unsigned int j = 0; j < lm->getAttachedBodyModels().size(); j++) {
       std::string id = makeAttachedObjectId(lm->getName(),lm->getAttachedBodyModels()[j]->getName());
-      if(attached_object_map_.find(id) == attached_object_map_.end()) {
+      if(getAttachedObjectDecomposition(id) == NULL) {
         ROS_WARN_STREAM("Have no attached object body for attached object " << id);
         continue;
       }
-      const BodyDecompositionVector* att = attached_object_map_.find(id)->second;
+      const BodyDecompositionVector* att = getAttachedObjectDecomposition(id);
       for(unsigned int k = 0; k < att->getSize(); k++) {
         double dist = getCollisionSphereProximity(att->getBodyDecomposition(k)->getCollisionSpheres(), lc, grad);
         if(dist < prox.proximity) {
@@ -639,11 +1085,11 @@ bool CollisionProximitySpace::getEnvironmentCollision(const std::vector<std::str
     const planning_models::KinematicModel::LinkModel* lm = monitor_->getKinematicModel()->getLinkModel(link_names[i]);
     for(unsigned int j = 0; j < lm->getAttachedBodyModels().size(); j++) {
       std::string id = makeAttachedObjectId(lm->getName(),lm->getAttachedBodyModels()[j]->getName());
-      if(attached_object_map_.find(id) == attached_object_map_.end()) {
+      if(getAttachedObjectDecomposition(id) == NULL) {
         ROS_WARN_STREAM("Have no attached object body for attached object " << id);
         continue;
       }
-      const BodyDecompositionVector* att = attached_object_map_[id];
+      const BodyDecompositionVector* att = getAttachedObjectDecomposition(id);
       for(unsigned int k = 0; k < att->getSize(); k++) {
         coll = getCollisionSphereCollision(att->getBodyDecomposition(k)->getCollisionSpheres());
         if(coll) {
@@ -711,36 +1157,20 @@ bool CollisionProximitySpace::getGroupLinkAndAttachedBodyNames(const std::string
   return true;
 }
 
-bool CollisionProximitySpace::updateSphereLocations(const std::vector<std::string>& link_names,
-                                                    const std::vector<std::string>& attached_body_names, 
-                                                    std::vector<GradientInfo>& gradients)
+bool CollisionProximitySpace::updateSphereLocations(GroupQuerySession& session) const
 {
-  if(link_names.size()+attached_body_names.size() != gradients.size()) {
+  std::vector<GradientInfo>& gradients = session.gradients;
+  if(session.plan.getNumBodies() != gradients.size()) {
     ROS_WARN_STREAM("Updating sphere locations with improperly sized gradients");
     return false;
   }
-  for(unsigned int i = 0; i < link_names.size(); i++) {
-    const std::vector<CollisionSphere>& lcs1 = body_decomposition_map_.find(link_names[i])->second->getCollisionSpheres();
-    gradients[i].sphere_locations.resize(lcs1.size());
-    gradients[i].sphere_radii.resize(lcs1.size());
-    for(unsigned int j = 0; j < lcs1.size(); j++) {
-      gradients[i].sphere_locations[j] = lcs1[j].center_;
-      gradients[i].sphere_radii[j] = lcs1[j].radius_;
-    }
-  }
-  unsigned int att_index = link_names.size();
-  unsigned int att_count = attached_body_names.size();
-  for(unsigned int i = 0; i < att_count; i++) {
-    if(attached_object_map_.find(attached_body_names[i]) == attached_object_map_.end()) {
-      ROS_WARN_STREAM("No attached object " << attached_body_names[i]);
-      return false;
-    }
-    const std::vector<CollisionSphere>& att_vec = attached_object_map_.find(attached_body_names[i])->second->getCollisionSpheres();
-    gradients[att_index].sphere_locations.resize(att_vec.size());
-    gradients[att_index].sphere_radii.resize(att_vec.size());
-    for(unsigned int j = 0; j < att_vec.size(); j++) {
-      gradients[att_index].sphere_locations[j] = att_vec[j].center_;
-      gradients[att_index].sphere_radii[j] = att_vec[j].radius_;
+  for(unsigned int i = 0; i < gradients.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = session.body_spheres[i];
+    gradients[i].sphere_locations.resize(body_spheres.size());
+    gradients[i].sphere_radii.resize(body_spheres.size());
+    for(unsigned int j = 0; j < body_spheres.size(); j++) {
+      gradients[i].sphere_locations[j] = body_spheres[j].center_;
+      gradients[i].sphere_radii[j] = body_spheres[j].radius_;
     }
   }
   return true;
@@ -773,11 +1203,11 @@ bool CollisionProximitySpace::setupGradientStructures(const std::vector<std::str
   }
   unsigned int att_index = link_names.size();
   for(unsigned int i = 0; i < att_count; i++) {
-    if(attached_object_map_.find(attached_body_names[i]) == attached_object_map_.end()) {
+    if(getAttachedObjectDecomposition(attached_body_names[i]) == NULL) {
       ROS_WARN_STREAM("No attached object " << attached_body_names[i]);
       return false;
     }
-    const std::vector<CollisionSphere>& att_vec = attached_object_map_.find(attached_body_names[i])->second->getCollisionSpheres();
+    const std::vector<CollisionSphere>& att_vec = getAttachedObjectDecomposition(attached_body_names[i])->getCollisionSpheres();
     gradients[att_index].sphere_locations.resize(att_vec.size());
     gradients[att_index].sphere_radii.resize(att_vec.size());
     gradients[att_index].joint_name = collision_models_interface_->getKinematicModel()->getLinkModel(link_names[link_names.size() - 1])->getParentJointModel()->getName();
@@ -794,6 +1224,7 @@ bool CollisionProximitySpace::setupGradientStructures(const std::vector<std::str
 
 bool CollisionProximitySpace::isStateInCollision() const
 {
+  ScopedCallTimer call_timer(this, ProximityStats::IS_STATE_IN_COLLISION);
   if(isEnvironmentCollision()) return true;
   if(isSelfCollision()) return true;
   return isIntraGroupCollision();
@@ -802,15 +1233,16 @@ bool CollisionProximitySpace::isStateInCollision() const
 bool CollisionProximitySpace::getStateCollisions(bool& in_collision, 
                                                  std::vector<CollisionType>& collisions) const
 {
+  ScopedCallTimer call_timer(this, ProximityStats::GET_STATE_COLLISIONS);
   collisions.clear();
-  collisions.resize(current_link_names_.size()+current_attached_body_names_.size());
+  collisions.resize(current_session_->link_names.size()+current_session_->attached_body_names.size());
   std::vector<bool> env_collisions, intra_collisions, self_collisions;
   env_collisions.resize(collisions.size(), false);
   intra_collisions = self_collisions = env_collisions;
   bool env_collision = getEnvironmentCollisions(env_collisions, false);
   bool intra_group_collision = getIntraGroupCollisions(intra_collisions, false);
   bool self_collision = getSelfCollisions(intra_collisions, false);
-  for(unsigned int i = 0; i < current_link_names_.size()+current_attached_body_names_.size(); i++) {
+  for(unsigned int i = 0; i < current_session_->link_names.size()+current_session_->attached_body_names.size(); i++) {
     collisions[i].environment = env_collisions[i];
     collisions[i].self = self_collisions[i];
     collisions[i].intra = intra_collisions[i];
@@ -823,10 +1255,41 @@ bool CollisionProximitySpace::getStateCollisions(bool& in_collision,
   return in_collision;
 }
 
+//which of the environment, self and intra-group distances a sphere or body takes.
+//Intra-group distances are only considered if the environment or self distance is at its maximum
+enum GradientSource {
+  ENVIRONMENT_GRADIENT,
+  SELF_GRADIENT,
+  INTRA_GRADIENT
+};
+
+static GradientSource selectGradientSource(double env_distance, double self_distance, double intra_distance,
+                                           double max_environment_distance, double max_self_distance)
+{
+  bool env_at_max = env_distance >= max_environment_distance;
+  bool self_at_max = self_distance >= max_self_distance;
+  if(env_at_max) {
+    if(self_at_max || intra_distance < self_distance) {
+      return INTRA_GRADIENT;
+    }
+    return SELF_GRADIENT;
+  } else if(self_at_max) {
+    //don't need to check env_at_max, as the previous condition should take care of it
+    if(intra_distance < env_distance) {
+      return INTRA_GRADIENT;
+    }
+    return ENVIRONMENT_GRADIENT;
+  } else if(self_distance < env_distance) {
+    return SELF_GRADIENT;
+  }
+  return ENVIRONMENT_GRADIENT;
+}
+
 bool CollisionProximitySpace::getStateGradients(std::vector<GradientInfo>& gradients,
                                                 bool subtract_radii) const
 {
-  gradients = current_gradients_;
+  ScopedCallTimer call_timer(this, ProximityStats::GET_STATE_GRADIENTS);
+  gradients = current_session_->gradients;
 
   std::vector<GradientInfo> intra_gradients;
   std::vector<GradientInfo> self_gradients;
@@ -837,88 +1300,146 @@ bool CollisionProximitySpace::getStateGradients(std::vector<GradientInfo>& gradi
   bool intra_coll = getIntraGroupProximityGradients(intra_gradients, subtract_radii);
 
   for(unsigned int i = 0; i < gradients.size(); i++) {
-    if(i < current_link_names_.size()) {      
-      ROS_DEBUG_STREAM("Link " << current_link_names_[i] 
+    if(i < current_session_->link_names.size()) {      
+      ROS_DEBUG_STREAM("Link " << current_session_->link_names[i] 
                       << " env " << env_gradients[i].closest_distance
                       << " self " << self_gradients[i].closest_distance
                       << " intra " << intra_gradients[i].closest_distance);
     }
-    {
-      bool env_at_max = env_gradients[i].closest_distance >= max_environment_distance_;
-      bool self_at_max = self_gradients[i].closest_distance >= max_self_distance_;
-      if(env_at_max) {
-        if(self_at_max || intra_gradients[i].closest_distance < self_gradients[i].closest_distance) {
-          if(intra_gradients[i].closest_distance == DBL_MAX) {
-            gradients[i].closest_distance = undefined_distance_;
-          } else {
-            gradients[i].closest_distance = intra_gradients[i].closest_distance;          
-          }
-          ROS_DEBUG_STREAM("Intra gradient is closest");
-        } else {
-          ROS_DEBUG_STREAM("Self gradient is closest");
-          gradients[i].closest_distance = self_gradients[i].closest_distance;          
-        }
-      } else if(self_at_max) {
-        //don't need to check env_at_max, as the previous condition should take care of it
-        if(intra_gradients[i].closest_distance < env_gradients[i].closest_distance) {
-          gradients[i].closest_distance = intra_gradients[i].closest_distance;
-          ROS_DEBUG_STREAM("Intra gradient is closest");
-        } else {
-          gradients[i].closest_distance = env_gradients[i].closest_distance;
-          ROS_DEBUG_STREAM("Env gradient is closest");
-        }
-      } else if(self_gradients[i].closest_distance < env_gradients[i].closest_distance) {
-        gradients[i].closest_distance = self_gradients[i].closest_distance;
-          ROS_DEBUG_STREAM("Self gradient is closest");
-      } else {
-        gradients[i].closest_distance = env_gradients[i].closest_distance;
-        ROS_DEBUG_STREAM("Env gradient is closest");
-      }
+    switch(selectGradientSource(env_gradients[i].closest_distance, self_gradients[i].closest_distance, intra_gradients[i].closest_distance,
+                                max_environment_distance_, max_self_distance_)) {
+    case INTRA_GRADIENT:
+      gradients[i].closest_distance = intra_gradients[i].closest_distance;          
+      ROS_DEBUG_STREAM("Intra gradient is closest");
+      break;
+    case SELF_GRADIENT:
+      gradients[i].closest_distance = self_gradients[i].closest_distance;          
+      ROS_DEBUG_STREAM("Self gradient is closest");
+      break;
+    case ENVIRONMENT_GRADIENT:
+      gradients[i].closest_distance = env_gradients[i].closest_distance;
+      ROS_DEBUG_STREAM("Env gradient is closest");
+      break;
+    }
+    //whichever source had no reading
+    if(gradients[i].closest_distance == DBL_MAX) {
+      gradients[i].closest_distance = undefined_distance_;
     }
 
-    if(i < current_link_names_.size() && gradients[i].closest_distance < 0.0) {      
-      ROS_DEBUG_STREAM("Link " << current_link_names_[i] 
+    if(i < current_session_->link_names.size() && gradients[i].closest_distance < 0.0) {      
+      ROS_DEBUG_STREAM("Link " << current_session_->link_names[i] 
                        << " env " << env_gradients[i].closest_distance
                        << " self " << self_gradients[i].closest_distance
                        << " intra " << intra_gradients[i].closest_distance);
     }
 
-
     for(unsigned int j = 0; j < gradients[i].distances.size(); j++) {
-      bool env_at_max = env_gradients[i].distances[j] >= max_environment_distance_;
-      bool self_at_max = self_gradients[i].distances[j] >= max_self_distance_;
-      if(env_at_max) {
-        if(self_at_max || intra_gradients[i].distances[j] < self_gradients[i].distances[j]) {
-          if(intra_gradients[i].distances[j] == DBL_MAX) {
-            gradients[i].distances[j] = undefined_distance_;
-          } else {
-            gradients[i].distances[j] = intra_gradients[i].distances[j];
-          }
-          gradients[i].gradients[j] = intra_gradients[i].gradients[j]; 
-       } else {
-          gradients[i].distances[j] = self_gradients[i].distances[j];
-          gradients[i].gradients[j] = self_gradients[i].gradients[j];
-        }
-      } else if(self_at_max) {
-        if(intra_gradients[i].distances[j] < env_gradients[i].distances[j]) {
-          gradients[i].distances[j] = intra_gradients[i].distances[j];
-          gradients[i].gradients[j] = intra_gradients[i].gradients[j];
-        } else {
-          gradients[i].distances[j] = env_gradients[i].distances[j];
-          gradients[i].gradients[j] = env_gradients[i].gradients[j];
-        }
-      } else if(self_gradients[i].distances[j] < env_gradients[i].distances[j]) {
-        gradients[i].distances[j] = self_gradients[i].distances[j];
-        gradients[i].gradients[j] = self_gradients[i].gradients[j]; 
+      const GradientInfo* source = NULL;
+      switch(selectGradientSource(env_gradients[i].distances[j], self_gradients[i].distances[j], intra_gradients[i].distances[j],
+                                  max_environment_distance_, max_self_distance_)) {
+      case INTRA_GRADIENT:
+        source = &intra_gradients[i];
+        break;
+      case SELF_GRADIENT:
+        source = &self_gradients[i];
+        break;
+      case ENVIRONMENT_GRADIENT:
+        source = &env_gradients[i];
+        break;
+      }
+      if(source->distances[j] == DBL_MAX) {
+        gradients[i].distances[j] = undefined_distance_;
       } else {
-        gradients[i].distances[j] = env_gradients[i].distances[j];
-        gradients[i].gradients[j] = env_gradients[i].gradients[j];
+        gradients[i].distances[j] = source->distances[j];
       }
+      gradients[i].gradients[j] = source->gradients[j];
     }
   }
   return (env_coll || intra_coll || self_coll);
 }
 
+bool CollisionProximitySpace::getStateGradients(GradientBuffer& gradients,
+                                                bool subtract_radii) const
+{
+  return getStateGradients(*current_session_, gradients, subtract_radii);
+}
+
+bool CollisionProximitySpace::getGroupSessionStateGradients(unsigned int handle,
+                                                            GradientBuffer& gradients,
+                                                            bool subtract_radii) const
+{
+  if(handle >= group_sessions_.size() || group_sessions_[handle] == NULL) {
+    ROS_WARN_STREAM("No group session " << handle);
+    return false;
+  }
+  return getStateGradients(*group_sessions_[handle], gradients, subtract_radii);
+}
+
+bool CollisionProximitySpace::getStateGradients(const GroupQuerySession& session,
+                                                GradientBuffer& gradients,
+                                                bool subtract_radii) const
+{
+  ScopedCallTimer call_timer(this, ProximityStats::GET_STATE_GRADIENTS);
+  if(gradients.body_offsets != session.plan.sphere_offsets) {
+    gradients.setup(session.plan.sphere_offsets);
+  } else {
+    gradients.reset();
+  }
+  for(unsigned int i = 0; i+1 < session.plan.sphere_offsets.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = session.body_spheres[i];
+    unsigned int offset = session.plan.sphere_offsets[i];
+    for(unsigned int j = 0; j < body_spheres.size(); j++) {
+      gradients.sphere_locations[offset+j] = body_spheres[j].center_;
+      gradients.sphere_radii[offset+j] = body_spheres[j].radius_;
+    }
+  }
+
+  bool env_coll = getEnvironmentProximityGradients(session, gradients.environment, subtract_radii);
+  bool self_coll = getSelfProximityGradients(session, gradients.self, subtract_radii);
+  bool intra_coll = getIntraGroupProximityGradients(session, gradients.intra, subtract_radii);
+
+  for(unsigned int i = 0; i < gradients.getNumBodies(); i++) {
+    switch(selectGradientSource(gradients.environment.closest_distances[i], gradients.self.closest_distances[i], gradients.intra.closest_distances[i],
+                                max_environment_distance_, max_self_distance_)) {
+    case INTRA_GRADIENT:
+      gradients.closest_distances[i] = gradients.intra.closest_distances[i];
+      break;
+    case SELF_GRADIENT:
+      gradients.closest_distances[i] = gradients.self.closest_distances[i];
+      break;
+    case ENVIRONMENT_GRADIENT:
+      gradients.closest_distances[i] = gradients.environment.closest_distances[i];
+      break;
+    }
+    //whichever source had no reading
+    if(gradients.closest_distances[i] == DBL_MAX) {
+      gradients.closest_distances[i] = undefined_distance_;
+    }
+  }
+  for(unsigned int j = 0; j < gradients.getNumSpheres(); j++) {
+    const GradientArrays* source = NULL;
+    switch(selectGradientSource(gradients.environment.distances[j], gradients.self.distances[j], gradients.intra.distances[j],
+                                max_environment_distance_, max_self_distance_)) {
+    case INTRA_GRADIENT:
+      source = &gradients.intra;
+      break;
+    case SELF_GRADIENT:
+      source = &gradients.self;
+      break;
+    case ENVIRONMENT_GRADIENT:
+      source = &gradients.environment;
+      break;
+    }
+    if(source->distances[j] == DBL_MAX) {
+      gradients.distances[j] = undefined_distance_;
+    } else {
+      gradients.distances[j] = source->distances[j];
+    }
+    gradients.gradients[j] = source->gradients[j];
+  }
+  return (env_coll || intra_coll || self_coll);
+}
+
 bool CollisionProximitySpace::isIntraGroupCollision() const
 {
   std::vector<bool> collisions;
@@ -926,39 +1447,25 @@ bool CollisionProximitySpace::isIntraGroupCollision() const
 }
 
 bool CollisionProximitySpace::getIntraGroupCollisions(std::vector<bool>& collisions, bool stop_at_first_collision) const {
+  QueryCounter counter(this);
   bool in_collision = false;
-  unsigned int num_links = current_link_names_.size();
-  unsigned int num_attached = current_attached_body_names_.size();
+  unsigned int num_links = current_session_->link_names.size();
+  unsigned int num_attached = current_session_->attached_body_names.size();
   unsigned int tot = num_links+num_attached;
   for(unsigned int i = 0; i < tot; i++) {
     for(unsigned int j = i; j < tot; j++) {
       if(i == j) continue;
-      if(!current_intra_group_collision_links_[i][j]) continue;
-      const std::vector<CollisionSphere>* lcs1;
-      const std::vector<CollisionSphere>* lcs2; 
-      if(i < num_links) {
-        lcs1 = &(current_link_body_decompositions_[i]->getCollisionSpheres());
-      } else {
-        lcs1 = &(current_attached_body_decompositions_[i-num_links]->getCollisionSpheres());
-      }
-      if(j < num_links) {
-        lcs2 = &(current_link_body_decompositions_[j]->getCollisionSpheres());
-      } else {
-        lcs2 = &(current_attached_body_decompositions_[j-num_links]->getCollisionSpheres());
-      }
-      for(unsigned int k = 0; k < lcs1->size(); k++) {
-        for(unsigned int l = 0; l < lcs2->size(); l++) {
-          double dist = (*lcs1)[k].center_.distance((*lcs2)[l].center_);
-          dist += -(*lcs1)[k].radius_-(*lcs2)[l].radius_;
-          if(dist <= tolerance_) {
-            if(stop_at_first_collision) {
-              return true;
-            }
-            collisions[i] = true;
-            collisions[j] = true;
-            in_collision = true;
-          }
+      if(!current_session_->plan.isPairEnabled(i, j)) continue;
+      counter.intra_group_pairs += getCurrentBodySpheres(i).size()*getCurrentBodySpheres(j).size();
+      if(getSphereListCollision(getCurrentBodySpheres(i), current_session_->sphere_hierarchies[i],
+                                getCurrentBodySpheres(j), current_session_->sphere_hierarchies[j],
+                                tolerance_)) {
+        if(stop_at_first_collision) {
+          return true;
         }
+        collisions[i] = true;
+        collisions[j] = true;
+        in_collision = true;
       }
     }
   }
@@ -967,57 +1474,52 @@ bool CollisionProximitySpace::getIntraGroupCollisions(std::vector<bool>& collisi
 
 bool CollisionProximitySpace::getIntraGroupProximityGradients(std::vector<GradientInfo>& gradients,
                                                               bool subtract_radii) const {
-  gradients = current_gradients_;
+  QueryCounter counter(this);
+  gradients = current_session_->gradients;
   bool in_collision = false;
-  unsigned int count = 0;
-  unsigned int num_links = current_link_names_.size();
-  unsigned int num_attached = current_attached_body_names_.size();
+  unsigned int num_links = current_session_->link_names.size();
+  unsigned int num_attached = current_session_->attached_body_names.size();
   unsigned int tot = num_links+num_attached;
-  std::vector<std::string> all_names = current_link_names_;
-  all_names.insert(all_names.end(), current_attached_body_names_.begin(), current_attached_body_names_.end());
   for(unsigned int i = 0; i < tot; i++) {
     for(unsigned int j = 0; j < tot; j++) {
       if(i == j) continue;
-      if(!current_intra_group_collision_links_[i][j]) {
+      if(!current_session_->plan.isPairEnabled(i, j)) {
         continue;
       }
-      const std::vector<CollisionSphere>* lcs1;
-      const std::vector<CollisionSphere>* lcs2; 
-      if(i < num_links) {
-        lcs1 = &(current_link_body_decompositions_[i]->getCollisionSpheres());
-      } else {
-        lcs1 = &(current_attached_body_decompositions_[i-num_links]->getCollisionSpheres());
+      counter.intra_group_pairs += getCurrentBodySpheres(i).size()*getCurrentBodySpheres(j).size();
+      if(getSphereListProximityGradients(getCurrentBodySpheres(i), current_session_->sphere_hierarchies[i],
+                                         getCurrentBodySpheres(j), current_session_->sphere_hierarchies[j],
+                                         gradients[i], gradients[j], tolerance_, subtract_radii)) {
+        in_collision = true;
       }
-      if(j < num_links) {
-        lcs2 = &(current_link_body_decompositions_[j]->getCollisionSpheres());
-      } else {
-        lcs2 = &(current_attached_body_decompositions_[j-num_links]->getCollisionSpheres());
+    }
+  }
+  return in_collision;
+}
+
+bool CollisionProximitySpace::getIntraGroupProximityGradients(GradientArrays& gradients,
+                                                              bool subtract_radii) const {
+  return getIntraGroupProximityGradients(*current_session_, gradients, subtract_radii);
+}
+
+bool CollisionProximitySpace::getIntraGroupProximityGradients(const GroupQuerySession& session,
+                                                              GradientArrays& gradients,
+                                                              bool subtract_radii) const {
+  QueryCounter counter(this);
+  prepareGradientArrays(session, gradients);
+  bool in_collision = false;
+  unsigned int tot = session.sphere_hierarchies.size();
+  for(unsigned int i = 0; i < tot; i++) {
+    for(unsigned int j = 0; j < tot; j++) {
+      if(i == j) continue;
+      if(!session.plan.isPairEnabled(i, j)) {
+        continue;
       }
-      for(unsigned int k = 0; k < lcs1->size(); k++) {
-        for(unsigned int l = 0; l < lcs2->size(); l++) {
-          double dist = (*lcs1)[k].center_.distance((*lcs2)[l].center_);
-          if(subtract_radii) {
-            dist += -(*lcs1)[k].radius_-(*lcs2)[l].radius_;
-            if(dist <= tolerance_) {
-              in_collision = true;
-            }
-          }
-          count++;
-          if(dist < gradients[i].distances[k]) {
-            gradients[i].distances[k] = dist;
-            gradients[i].gradients[k] = (*lcs1)[k].center_-(*lcs2)[l].center_;
-          }
-          if(dist < gradients[i].closest_distance) {
-            gradients[i].closest_distance = dist;
-          }
-          if(dist < gradients[j].distances[l]) {
-            gradients[j].distances[l] = dist;
-            gradients[j].gradients[l] = (*lcs2)[l].center_-(*lcs1)[k].center_;
-          }
-          if(dist < gradients[j].closest_distance) {
-            gradients[j].closest_distance = dist;
-          }
-        }
+      counter.intra_group_pairs += session.body_spheres[i].size()*session.body_spheres[j].size();
+      if(getSphereListProximityGradients(session.body_spheres[i], session.sphere_hierarchies[i],
+                                         session.body_spheres[j], session.sphere_hierarchies[j],
+                                         gradients, i, j, tolerance_, subtract_radii)) {
+        in_collision = true;
       }
     }
   }
@@ -1033,10 +1535,12 @@ bool CollisionProximitySpace::isSelfCollision() const
 bool CollisionProximitySpace::getSelfCollisions(std::vector<bool>& collisions,
                                                 bool stop_at_first_collision) const
 {
+  QueryCounter counter(this);
   bool in_collision = false;
-  for(unsigned int i = 0; i < current_link_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_link_body_decompositions_[i]->getCollisionSpheres();
-    bool coll = getCollisionSphereCollision(self_distance_field_, body_spheres, tolerance_);
+  for(unsigned int i = 0; i < current_session_->link_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i);
+    counter.spheres += body_spheres.size();
+    bool coll = getCollisionSphereCollision(current_session_->self_distance_field.get(), body_spheres, tolerance_);
     if(coll) {
       if(stop_at_first_collision) {
         return true;
@@ -1045,15 +1549,16 @@ bool CollisionProximitySpace::getSelfCollisions(std::vector<bool>& collisions,
       collisions[i] = true;
     }
   }
-  for(unsigned int i = 0; i < current_attached_body_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_attached_body_decompositions_[i]->getCollisionSpheres();
-    bool coll = getCollisionSphereCollision(self_distance_field_, body_spheres, tolerance_);
+  for(unsigned int i = 0; i < current_session_->attached_body_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i+current_session_->plan.num_links);
+    counter.spheres += body_spheres.size();
+    bool coll = getCollisionSphereCollision(current_session_->self_distance_field.get(), body_spheres, tolerance_);
     if(coll) {
       if(stop_at_first_collision) {
         return true;
       }
       in_collision = true;
-      collisions[i+current_link_names_.size()] = true;
+      collisions[i+current_session_->link_names.size()] = true;
     }
   }
   return in_collision;
@@ -1061,22 +1566,25 @@ bool CollisionProximitySpace::getSelfCollisions(std::vector<bool>& collisions,
 
 bool CollisionProximitySpace::getSelfProximityGradients(std::vector<GradientInfo>& gradients,
                                                         bool subtract_radii) const {
-  gradients = current_gradients_;
+  QueryCounter counter(this);
+  gradients = current_session_->gradients;
   bool in_collision = false;
-  for(unsigned int i = 0; i < current_link_names_.size(); i++) {
-    if(!current_self_excludes_[i]) continue;
-    const std::vector<CollisionSphere>& body_spheres = current_link_body_decompositions_[i]->getCollisionSpheres();
+  for(unsigned int i = 0; i < current_session_->link_names.size(); i++) {
+    if(!current_session_->plan.self_checked[i]) continue;
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i);
+    counter.spheres += body_spheres.size();
     if(gradients[i].distances.size() != body_spheres.size()) {
-      ROS_INFO_STREAM("Wrong size for closest distances for link " << current_link_names_[i]);
+      ROS_INFO_STREAM("Wrong size for closest distances for link " << current_session_->link_names[i]);
     }
-    bool coll = getCollisionSphereGradients(self_distance_field_, body_spheres, gradients[i], tolerance_, subtract_radii, max_self_distance_, false);
+    bool coll = getCollisionSphereGradients(current_session_->self_distance_field.get(), body_spheres, gradients[i], tolerance_, subtract_radii, max_self_distance_, false);
     if(coll) {
       in_collision = true;
     }
   }
-  for(unsigned int i = 0; i < current_attached_body_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_attached_body_decompositions_[i]->getCollisionSpheres();
-    bool coll = getCollisionSphereGradients(self_distance_field_, body_spheres, gradients[i+current_link_names_.size()],
+  for(unsigned int i = 0; i < current_session_->attached_body_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i+current_session_->plan.num_links);
+    counter.spheres += body_spheres.size();
+    bool coll = getCollisionSphereGradients(current_session_->self_distance_field.get(), body_spheres, gradients[i+current_session_->link_names.size()],
                                             tolerance_, subtract_radii, max_self_distance_, false);
     if(coll) {
       in_collision = true;
@@ -1085,6 +1593,28 @@ bool CollisionProximitySpace::getSelfProximityGradients(std::vector<GradientInfo
   return in_collision;
 }
 
+bool CollisionProximitySpace::getSelfProximityGradients(GradientArrays& gradients,
+                                                        bool subtract_radii) const {
+  return getSelfProximityGradients(*current_session_, gradients, subtract_radii);
+}
+
+bool CollisionProximitySpace::getSelfProximityGradients(const GroupQuerySession& session,
+                                                        GradientArrays& gradients,
+                                                        bool subtract_radii) const {
+  QueryCounter counter(this);
+  prepareGradientArrays(session, gradients);
+  bool in_collision = false;
+  for(unsigned int i = 0; i < session.sphere_hierarchies.size(); i++) {
+    if(!session.plan.self_checked[i]) continue;
+    counter.spheres += session.body_spheres[i].size();
+    if(getCollisionSphereGradients(session.self_distance_field.get(), session.body_spheres[i], gradients, i, 
+                                   tolerance_, subtract_radii, max_self_distance_, false)) {
+      in_collision = true;
+    }
+  }
+  return in_collision;
+}
+
 bool CollisionProximitySpace::isEnvironmentCollision() const
 {
   std::vector<bool> collisions;
@@ -1094,9 +1624,11 @@ bool CollisionProximitySpace::isEnvironmentCollision() const
 bool CollisionProximitySpace::getEnvironmentCollisions(std::vector<bool>& collisions,
                                                        bool stop_at_first_collision) const
 {
+  QueryCounter counter(this);
   bool in_collision = false;
-  for(unsigned int i = 0; i < current_link_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_link_body_decompositions_[i]->getCollisionSpheres();
+  for(unsigned int i = 0; i < current_session_->link_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i);
+    counter.spheres += body_spheres.size();
     bool coll = getCollisionSphereCollision(environment_distance_field_, body_spheres, tolerance_);
     if(coll) {
       if(stop_at_first_collision) {
@@ -1106,15 +1638,16 @@ bool CollisionProximitySpace::getEnvironmentCollisions(std::vector<bool>& collis
       collisions[i] = true;
     }
   }
-  for(unsigned int i = 0; i < current_attached_body_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_attached_body_decompositions_[i]->getCollisionSpheres();
+  for(unsigned int i = 0; i < current_session_->attached_body_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i+current_session_->plan.num_links);
+    counter.spheres += body_spheres.size();
     bool coll = getCollisionSphereCollision(environment_distance_field_, body_spheres, tolerance_);
     if(coll) {
       if(stop_at_first_collision) {
         return true;
       }
       in_collision = true;
-      collisions[i+current_link_names_.size()] = true;
+      collisions[i+current_session_->link_names.size()] = true;
     }
   }
   return in_collision;
@@ -1122,21 +1655,24 @@ bool CollisionProximitySpace::getEnvironmentCollisions(std::vector<bool>& collis
 
 bool CollisionProximitySpace::getEnvironmentProximityGradients(std::vector<GradientInfo>& gradients,
                                                                bool subtract_radii) const {
-  gradients = current_gradients_;
+  QueryCounter counter(this);
+  gradients = current_session_->gradients;
   bool in_collision = false;
-  for(unsigned int i = 0; i < current_link_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_link_body_decompositions_[i]->getCollisionSpheres();
+  for(unsigned int i = 0; i < current_session_->link_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i);
+    counter.spheres += body_spheres.size();
     if(gradients[i].distances.size() != body_spheres.size()) {
-      ROS_INFO_STREAM("Wrong size for closest distances for link " << current_link_names_[i]);
+      ROS_INFO_STREAM("Wrong size for closest distances for link " << current_session_->link_names[i]);
     }
     bool coll = getCollisionSphereGradients(environment_distance_field_, body_spheres, gradients[i], tolerance_, subtract_radii, max_environment_distance_, false);
     if(coll) {
       in_collision = true;
     }
   }
-  for(unsigned int i = 0; i < current_attached_body_names_.size(); i++) {
-    const std::vector<CollisionSphere>& body_spheres = current_attached_body_decompositions_[i]->getCollisionSpheres();
-    bool coll = getCollisionSphereGradients(environment_distance_field_, body_spheres, gradients[i+current_link_names_.size()], tolerance_, subtract_radii, max_environment_distance_, false);
+  for(unsigned int i = 0; i < current_session_->attached_body_names.size(); i++) {
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i+current_session_->plan.num_links);
+    counter.spheres += body_spheres.size();
+    bool coll = getCollisionSphereGradients(environment_distance_field_, body_spheres, gradients[i+current_session_->link_names.size()], tolerance_, subtract_radii, max_environment_distance_, false);
     if(coll) {
       in_collision = true;
     }
@@ -1144,6 +1680,57 @@ bool CollisionProximitySpace::getEnvironmentProximityGradients(std::vector<Gradi
   return in_collision;
 }
 
+bool CollisionProximitySpace::getEnvironmentProximityGradients(GradientArrays& gradients,
+                                                               bool subtract_radii) const {
+  return getEnvironmentProximityGradients(*current_session_, gradients, subtract_radii);
+}
+
+bool CollisionProximitySpace::getEnvironmentProximityGradients(const GroupQuerySession& session,
+                                                               GradientArrays& gradients,
+                                                               bool subtract_radii) const {
+  QueryCounter counter(this);
+  prepareGradientArrays(session, gradients);
+  bool in_collision = false;
+  for(unsigned int i = 0; i < session.sphere_hierarchies.size(); i++) {
+    counter.spheres += session.body_spheres[i].size();
+    if(getCollisionSphereGradients(environment_distance_field_, session.body_spheres[i], gradients, i, 
+                                   tolerance_, subtract_radii, max_environment_distance_, false)) {
+      in_collision = true;
+    }
+  }
+  return in_collision;
+}
+
+void CollisionProximitySpace::getEnvironmentDistances(GradientArrays& distances) const
+{
+  QueryCounter counter(this);
+  prepareGradientArrays(*current_session_, distances);
+  for(unsigned int i = 0; i < current_session_->sphere_hierarchies.size(); i++) {
+    counter.spheres += getCurrentBodySpheres(i).size();
+    getCollisionSphereDistances(environment_distance_field_, getCurrentBodySpheres(i), distances, i);
+  }
+}
+
+void CollisionProximitySpace::getSelfDistances(GradientArrays& distances) const
+{
+  QueryCounter counter(this);
+  prepareGradientArrays(*current_session_, distances);
+  for(unsigned int i = 0; i < current_session_->sphere_hierarchies.size(); i++) {
+    if(!current_session_->plan.self_checked[i]) continue;
+    counter.spheres += getCurrentBodySpheres(i).size();
+    getCollisionSphereDistances(current_session_->self_distance_field.get(), getCurrentBodySpheres(i), distances, i);
+  }
+}
+
+void CollisionProximitySpace::prepareGradientArrays(const GroupQuerySession& session, GradientArrays& gradients) const
+{
+  if(gradients.body_offsets != session.plan.sphere_offsets) {
+    gradients.setup(session.plan.sphere_offsets);
+  } else {
+    gradients.reset();
+  }
+}
+
 void CollisionProximitySpace::getProximityGradientMarkers(const std::vector<std::string>& link_names, 
                                                           const std::vector<std::string>& attached_body_names, 
                                                           const std::vector<GradientInfo>& gradients,
@@ -1159,7 +1746,7 @@ void CollisionProximitySpace::getProximityGradientMarkers(const std::vector<std:
       lcs = &(body_decomposition_map_.find(name)->second->getCollisionSpheres());
     } else {
       name = attached_body_names[i-link_names.size()];
-      lcs = &(attached_object_map_.find(name)->second->getCollisionSpheres());
+      lcs = &(getAttachedObjectDecomposition(name)->getCollisionSpheres());
     }
     for(unsigned int j = 0; j < gradients[i].distances.size(); j++) {
       visualization_msgs::Marker arrow_mark;
@@ -1186,9 +1773,12 @@ void CollisionProximitySpace::getProximityGradientMarkers(const std::vector<std:
         ROS_DEBUG_STREAM("Negative dist for " << name << " " << arrow_mark.id);
       }
       arrow_mark.points.resize(2);
-      arrow_mark.points[1].x = (*lcs)[j].center_.x();
-      arrow_mark.points[1].y = (*lcs)[j].center_.y();
-      arrow_mark.points[1].z = (*lcs)[j].center_.z();
+      //the shared decompositions aren't posed by group queries, the gradients carry the posed centers
+      const tf::Vector3& center = (gradients[i].sphere_locations.size() == gradients[i].distances.size()) ?
+        gradients[i].sphere_locations[j] : (*lcs)[j].center_;
+      arrow_mark.points[1].x = center.x();
+      arrow_mark.points[1].y = center.y();
+      arrow_mark.points[1].z = center.z();
       arrow_mark.points[0] = arrow_mark.points[1];
       arrow_mark.points[0].x -= xscale*gradients[i].distances[j];
       arrow_mark.points[0].y -= yscale*gradients[i].distances[j];
@@ -1209,7 +1799,10 @@ CollisionProximitySpace::TrajectorySafety CollisionProximitySpace::isTrajectoryS
                                                                                     const arm_navigation_msgs::Constraints& path_constraints,
                                                                                     const std::string& groupName)
 {
+  ScopedCallTimer call_timer(this, ProximityStats::IS_TRAJECTORY_SAFE);
   ROS_DEBUG_NAMED("safety", "Calling isTrajectorySafe");
+  segment_state_evaluations_ = 0;
+  skipped_state_evaluations_ = 0;
 
   collision_models_interface_->resetToStartState(*collision_models_interface_->getPlanningSceneState());
 
@@ -1220,6 +1813,12 @@ CollisionProximitySpace::TrajectorySafety CollisionProximitySpace::isTrajectoryS
   }
   planning_models::KinematicState::JointStateGroup* stateGroup = collision_models_interface_->getPlanningSceneState()->
       getJointStateGroup(groupName);
+  std::vector<std::vector<double> > values;
+  if(!getGroupTrajectoryValues(groupName, trajectory, values))
+  {
+    ROS_ERROR("Trajectory doesn't give values for the joints of group %s. Cannot evaluate trajectory safety.", groupName.c_str());
+    return ErrorUnsafe;
+  }
   arm_navigation_msgs::ArmNavigationErrorCodes error_code;
   std::vector<arm_navigation_msgs::ArmNavigationErrorCodes> error_codes;
   std::map<std::string, double> stateMap;
@@ -1252,6 +1851,26 @@ CollisionProximitySpace::TrajectorySafety CollisionProximitySpace::isTrajectoryS
 
     std::vector<double> lastDistances;
     TrajectoryPointType type = None;
+    // Segments between consecutive clear points can be proven free from swept sphere samples of the
+    // current group, which replaces relying on the density of the points. With conservative advancement,
+    // points the spheres can't reach from the clearance of the last evaluated clear point are clear
+    // without being evaluated.
+    bool check_segments = check_trajectory_segments_;
+    bool advance = conservative_advancement_;
+    if((check_segments || advance) && current_session_->group_name != groupName)
+    {
+      ROS_DEBUG_STREAM("Current group is " << current_session_->group_name << ", only evaluating the points of " << groupName);
+      check_segments = false;
+      advance = false;
+    }
+    double field_slack = getFieldLipschitzSlack();
+    SweptSphereSample samples[2];
+    size_t sample_points[2] = {trajectory.points.size(), trajectory.points.size()};
+    SweptSphereSample reference_sample;
+    size_t reference_point = 0;
+    bool reference_clear = false;
+    std::vector<double> envelope, bounds;
+    bool last_in_collision = true;
     // For each trajectory point, get gradients and assert that the collision cost of start points
     // is monotonically decreasing, and that the collision cost of end points is monotonically increasing.
     // Midpoints must never have collisions.
@@ -1262,28 +1881,80 @@ CollisionProximitySpace::TrajectorySafety CollisionProximitySpace::isTrajectoryS
     //+--------------------------------------------------------------------------------------------------------------+
     for(size_t i = 0; i < trajectory.points.size(); i++)
     {
-      std::vector<GradientInfo> gradients;
       std::vector<double> distances;
-      const trajectory_msgs::JointTrajectoryPoint& trajectoryPoint =  trajectory.points[i];
-      stateGroup->setKinematicState(trajectoryPoint.positions);
-      setCurrentGroupState(*(collision_models_interface_->getPlanningSceneState()));
-
-      getStateGradients(gradients, true);
       bool in_collision = false;
-      for(size_t j = 0; j < gradients.size(); j++)
+
+      // The points between the reference and this one, and the segment from the last point when segments
+      // are checked, lie within the per joint envelope of the motion from the reference.
+      bool skipped = false;
+      if(advance && reference_clear && i != 0)
       {
-        GradientInfo& gradient = gradients[j];
-        in_collision = in_collision || gradient.collision;
+        const std::vector<double>& reference = values[reference_point];
+        if(check_segments)
+        {
+          envelope.resize(reference.size());
+          for(size_t v = 0; v < reference.size(); v++)
+          {
+            envelope[v] = reference[v]+std::max(fabs(values[i-1][v]-reference[v]), fabs(values[i][v]-reference[v]));
+          }
+          computeSphereMotionBounds(reference_sample, reference, envelope, bounds);
+        }
+        else
+        {
+          computeSphereMotionBounds(reference_sample, reference, values[i], bounds);
+        }
+        if(isSweptRegionClear(reference_sample, bounds, field_slack, tolerance_))
+        {
+          skipped = true;
+          skipped_state_evaluations_++;
+        }
+      }
 
-        for(size_t k = 0; k < gradient.distances.size(); k++)
+      if(!skipped)
+      {
+        // The one query of the point gives both its distances and the clearances of its sample.
+        stateGroup->setKinematicState(values[i]);
+        setCurrentGroupState(*(collision_models_interface_->getPlanningSceneState()));
+        in_collision = getStateGradients(swept_sphere_buffer_, true);
+        distances = swept_sphere_buffer_.distances;
+        for(size_t k = 0; k < distances.size(); k++)
         {
-          distances.push_back(gradient.distances[k]);
-          in_collision = in_collision || gradient.distances[k] < tolerance_;
-          //if(gradient.distances[k] < tolerance_) {
-          //  ROS_INFO_STREAM("Point i " << i << " sphere " << k << " distance " << gradient.distances[k] << " less than tolerance " << tolerance_);
+          in_collision = in_collision || distances[k] < tolerance_;
+          //if(distances[k] < tolerance_) {
+          //  ROS_INFO_STREAM("Point i " << i << " sphere " << k << " distance " << distances[k] << " less than tolerance " << tolerance_);
           //}
         }
+        SweptSphereSample& sample = samples[i%2];
+        if(check_segments || advance)
+        {
+          segment_state_evaluations_++;
+          fillSweptSphereSample(swept_sphere_buffer_, true, sample);
+          sample_points[i%2] = i;
+        }
+
+        // Moving between two clear points must not pass through an obstacle.
+        if(check_segments && i != 0 && !in_collision && !last_in_collision)
+        {
+          if(sample_points[(i-1)%2] != i-1)
+          {
+            computeSweptSphereSample(values[i-1], samples[(i-1)%2]);
+            sample_points[(i-1)%2] = i-1;
+          }
+          if(!isSegmentCollisionFree(values[i-1], values[i], samples[(i-1)%2], sample, 0))
+          {
+            ROS_DEBUG_NAMED("safety","Segment ending at point %lu could not be proven collision free", (long unsigned int)i);
+            return MiddleUnsafe;
+          }
+        }
+
+        reference_clear = !in_collision;
+        if(advance && reference_clear)
+        {
+          reference_sample = sample;
+          reference_point = i;
+        }
       }
+      last_in_collision = in_collision;
 
       // If the first point is in collision, we're in the start collision phase
       if(type == None && in_collision && i == 0)
@@ -1391,10 +2062,442 @@ CollisionProximitySpace::TrajectorySafety CollisionProximitySpace::isTrajectoryS
 
 }
 
+///
+/// Swept sphere checks
+///
+
+void CollisionProximitySpace::setupBodyJointChains(const planning_models::KinematicState& state)
+{
+  current_session_->body_joint_chains.clear();
+  current_session_->group_dimension = 0;
+  const planning_models::KinematicState::JointStateGroup* jsg = state.getJointStateGroup(current_session_->group_name);
+  if(jsg == NULL) {
+    return;
+  }
+  std::map<std::string, unsigned int> variable_indices;
+  for(unsigned int i = 0; i < jsg->getJointStateVector().size(); i++) {
+    const planning_models::KinematicState::JointState* js = jsg->getJointStateVector()[i];
+    variable_indices[js->getName()] = current_session_->group_dimension;
+    current_session_->group_dimension += js->getDimension();
+  }
+  std::map<std::string, unsigned int> link_state_indices;
+  for(unsigned int i = 0; i < state.getLinkStateVector().size(); i++) {
+    link_state_indices[state.getLinkStateVector()[i]->getName()] = i;
+  }
+  current_session_->body_joint_chains.resize(current_session_->plan.getNumBodies());
+  for(unsigned int i = 0; i < current_session_->body_joint_chains.size(); i++) {
+    unsigned int link_index = current_session_->plan.link_state_indices[i];
+    BodyJointChain& chain = current_session_->body_joint_chains[i];
+    const planning_models::KinematicModel::JointModel* joint = state.getLinkStateVector()[link_index]->getLinkModel()->getParentJointModel();
+    while(joint != NULL) {
+      std::map<std::string, unsigned int>::iterator it = variable_indices.find(joint->getName());
+      if(it != variable_indices.end()) {
+        ChainJointType type = CHAIN_UNBOUNDED;
+        if(dynamic_cast<const planning_models::KinematicModel::RevoluteJointModel*>(joint) != NULL) {
+          type = CHAIN_REVOLUTE;
+        } else if(dynamic_cast<const planning_models::KinematicModel::PrismaticJointModel*>(joint) != NULL) {
+          type = CHAIN_PRISMATIC;
+        }
+        chain.joint_types.insert(chain.joint_types.begin(), type);
+        chain.variable_indices.insert(chain.variable_indices.begin(), it->second);
+        chain.variable_counts.insert(chain.variable_counts.begin(), 
+                                     state.getJointState(joint->getName())->getDimension());
+        chain.link_state_indices.insert(chain.link_state_indices.begin(), 
+                                        link_state_indices[joint->getChildLinkModel()->getName()]);
+      }
+      if(joint->getParentLinkModel() == NULL) {
+        break;
+      }
+      joint = joint->getParentLinkModel()->getParentJointModel();
+    }
+  }
+}
+
+bool CollisionProximitySpace::getGroupValueIndices(const std::string& group_name,
+                                                   const std::vector<std::string>& joint_names,
+                                                   std::vector<unsigned int>& indices) const
+{
+  indices.clear();
+  const planning_models::KinematicState::JointStateGroup* jsg = collision_models_interface_->getPlanningSceneState()->getJointStateGroup(group_name);
+  if(jsg == NULL) {
+    ROS_WARN_STREAM("No group " << group_name);
+    return false;
+  }
+  std::map<std::string, unsigned int> name_indices;
+  for(unsigned int i = 0; i < joint_names.size(); i++) {
+    name_indices[joint_names[i]] = i;
+  }
+  for(unsigned int i = 0; i < jsg->getJointStateVector().size(); i++) {
+    const planning_models::KinematicState::JointState* js = jsg->getJointStateVector()[i];
+    std::map<std::string, unsigned int>::iterator it = name_indices.find(js->getName());
+    if(it == name_indices.end()) {
+      ROS_WARN_STREAM("No values given for joint " << js->getName() << " of group " << group_name);
+      return false;
+    }
+    if(js->getDimension() != 1) {
+      ROS_WARN_STREAM("Joint " << js->getName() << " of group " << group_name << " has " 
+                      << js->getDimension() << " values, which can't be given by name");
+      return false;
+    }
+    indices.push_back(it->second);
+  }
+  return true;
+}
+
+bool CollisionProximitySpace::getGroupTrajectoryValues(const std::string& group_name,
+                                                       const trajectory_msgs::JointTrajectory& trajectory,
+                                                       std::vector<std::vector<double> >& values) const
+{
+  values.clear();
+  std::vector<unsigned int> indices;
+  if(!getGroupValueIndices(group_name, trajectory.joint_names, indices)) {
+    return false;
+  }
+  values.resize(trajectory.points.size(), std::vector<double>(indices.size()));
+  for(unsigned int i = 0; i < trajectory.points.size(); i++) {
+    if(trajectory.points[i].positions.size() != trajectory.joint_names.size()) {
+      ROS_WARN_STREAM("Trajectory point " << i << " has " << trajectory.points[i].positions.size() 
+                      << " values for " << trajectory.joint_names.size() << " joints");
+      values.clear();
+      return false;
+    }
+    for(unsigned int j = 0; j < indices.size(); j++) {
+      values[i][j] = trajectory.points[i].positions[indices[j]];
+    }
+  }
+  return true;
+}
+
+bool CollisionProximitySpace::computeSweptSphereSample(const std::vector<double>& group_values,
+                                                       SweptSphereSample& sample)
+{
+  segment_state_evaluations_++;
+  planning_models::KinematicState* state = collision_models_interface_->getPlanningSceneState();
+  state->getJointStateGroup(current_session_->group_name)->setKinematicState(group_values);
+  setCurrentGroupState(*state);
+
+  //distances of the fields are taken without the radii, as the fields saturate
+  getEnvironmentDistances(swept_sphere_buffer_.environment);
+  getSelfDistances(swept_sphere_buffer_.self);
+  getIntraGroupProximityGradients(swept_sphere_buffer_.intra, true);
+  return fillSweptSphereSample(swept_sphere_buffer_, false, sample);
+}
+
+bool CollisionProximitySpace::fillSweptSphereSample(const GradientBuffer& gradients,
+                                                    bool field_radii_subtracted,
+                                                    SweptSphereSample& sample) const
+{
+  const planning_models::KinematicState* state = collision_models_interface_->getPlanningSceneState();
+  tf::Transform inv = getInverseWorldTransform(*state);
+  unsigned int num_spheres = current_session_->plan.sphere_offsets.back();
+  sample.field_clearances.resize(num_spheres);
+  sample.intra_clearances.resize(num_spheres);
+  sample.lever_arms.resize(num_spheres);
+  sample.chain_lengths.resize(current_session_->body_joint_chains.size());
+  bool in_collision = false;
+  for(unsigned int i = 0; i < current_session_->body_joint_chains.size(); i++) {
+    const BodyJointChain& chain = current_session_->body_joint_chains[i];
+    sample.chain_lengths[i].resize(chain.link_state_indices.size());
+    tf::Vector3 last_origin(0.0, 0.0, 0.0);
+    for(unsigned int j = 0; j < chain.link_state_indices.size(); j++) {
+      tf::Vector3 origin = inv*state->getLinkStateVector()[chain.link_state_indices[j]]->getGlobalLinkTransform().getOrigin();
+      if(j > 0) {
+        sample.chain_lengths[i][j-1] = origin.distance(last_origin);
+      }
+      last_origin = origin;
+    }
+    const std::vector<CollisionSphere>& body_spheres = getCurrentBodySpheres(i);
+    for(unsigned int j = 0; j < body_spheres.size(); j++) {
+      unsigned int k = current_session_->plan.sphere_offsets[i]+j;
+      //the gradient queries leave the radius on saturated field distances
+      double env = gradients.environment.distances[k];
+      if(!field_radii_subtracted || env >= max_environment_distance_) {
+        env -= body_spheres[j].radius_;
+      }
+      double self = gradients.self.distances[k];
+      if(!field_radii_subtracted || self >= max_self_distance_) {
+        self -= body_spheres[j].radius_;
+      }
+      sample.field_clearances[k] = std::min(env, self);
+      sample.intra_clearances[k] = gradients.intra.distances[k];
+      sample.lever_arms[k] = chain.link_state_indices.empty() ? 0.0 : body_spheres[j].center_.distance(last_origin);
+      if(sample.field_clearances[k] < tolerance_ || sample.intra_clearances[k] <= tolerance_) {
+        in_collision = true;
+      }
+    }
+  }
+  return !in_collision;
+}
+
+void CollisionProximitySpace::computeSphereMotionBounds(const SweptSphereSample& sample,
+                                                        const std::vector<double>& start,
+                                                        const std::vector<double>& end,
+                                                        std::vector<double>& bounds) const
+{
+  bounds.resize(current_session_->plan.sphere_offsets.back());
+  for(unsigned int i = 0; i < current_session_->body_joint_chains.size(); i++) {
+    const BodyJointChain& chain = current_session_->body_joint_chains[i];
+    double fixed_motion, lever_motion;
+    computeChainMotionBounds(chain, sample.chain_lengths[i], start, end, fixed_motion, lever_motion);
+    for(unsigned int k = current_session_->plan.sphere_offsets[i]; k < current_session_->plan.sphere_offsets[i+1]; k++) {
+      if(fixed_motion == DBL_MAX) {
+        bounds[k] = DBL_MAX;
+      } else {
+        bounds[k] = fixed_motion+lever_motion*sample.lever_arms[k];
+      }
+    }
+  }
+}
+
+bool CollisionProximitySpace::isSegmentCollisionFree(const std::vector<double>& start,
+                                                     const std::vector<double>& end,
+                                                     const SweptSphereSample& start_sample,
+                                                     const SweptSphereSample& end_sample,
+                                                     unsigned int depth)
+{
+  //the fields are 1-Lipschitz up to the quantization of the lookups at either end
+  double field_slack = getFieldLipschitzSlack();
+  std::vector<double> bounds;
+  computeSphereMotionBounds(start_sample, start, end, bounds);
+  if(isSweptSegmentClear(start_sample, end_sample, bounds, field_slack, tolerance_)) {
+    return true;
+  }
+  if(depth >= max_segment_subdivision_depth_) {
+    ROS_DEBUG_STREAM("Rejecting unproven segment at subdivision depth " << depth);
+    return false;
+  }
+  std::vector<double> middle(start.size());
+  for(unsigned int i = 0; i < start.size(); i++) {
+    middle[i] = (start[i]+end[i])*0.5;
+  }
+  SweptSphereSample middle_sample;
+  if(!computeSweptSphereSample(middle, middle_sample)) {
+    return false;
+  }
+  return(isSegmentCollisionFree(start, middle, start_sample, middle_sample, depth+1) &&
+         isSegmentCollisionFree(middle, end, middle_sample, end_sample, depth+1));
+}
+
+bool CollisionProximitySpace::isSegmentCollisionFree(const std::vector<std::string>& joint_names,
+                                                     const std::vector<double>& start,
+                                                     const std::vector<double>& end)
+{
+  ScopedCallTimer call_timer(this, ProximityStats::IS_SEGMENT_COLLISION_FREE);
+  segment_state_evaluations_ = 0;
+  if(current_session_->group_name.empty()) {
+    ROS_WARN_STREAM("No group set up for segment checks");
+    return false;
+  }
+  std::vector<unsigned int> indices;
+  if(!getGroupValueIndices(current_session_->group_name, joint_names, indices)) {
+    return false;
+  }
+  if(start.size() != joint_names.size() || end.size() != joint_names.size()) {
+    ROS_WARN_STREAM("Segment has " << start.size() << " and " << end.size() << " values for " 
+                    << joint_names.size() << " joints");
+    return false;
+  }
+  std::vector<double> group_start(indices.size()), group_end(indices.size());
+  for(unsigned int i = 0; i < indices.size(); i++) {
+    group_start[i] = start[indices[i]];
+    group_end[i] = end[indices[i]];
+  }
+  planning_models::KinematicState::JointStateGroup* jsg = collision_models_interface_->getPlanningSceneState()->getJointStateGroup(current_session_->group_name);
+  std::vector<double> saved_values;
+  jsg->getKinematicStateValues(saved_values);
+
+  SweptSphereSample start_sample, end_sample;
+  bool free = (computeSweptSphereSample(group_start, start_sample) && 
+               computeSweptSphereSample(group_end, end_sample) &&
+               isSegmentCollisionFree(group_start, group_end, start_sample, end_sample, 0));
+  ROS_DEBUG_STREAM("Segment check evaluated " << segment_state_evaluations_ << " states");
+
+  jsg->setKinematicState(saved_values);
+  setCurrentGroupState(*collision_models_interface_->getPlanningSceneState());
+  return free;
+}
+
+bool CollisionProximitySpace::isTrajectoryCollisionFree(const trajectory_msgs::JointTrajectory& trajectory)
+{
+  ScopedCallTimer call_timer(this, ProximityStats::IS_TRAJECTORY_COLLISION_FREE);
+  segment_state_evaluations_ = 0;
+  if(current_session_->group_name.empty()) {
+    ROS_WARN_STREAM("No group set up for trajectory checks");
+    return false;
+  }
+  std::vector<std::vector<double> > values;
+  if(!getGroupTrajectoryValues(current_session_->group_name, trajectory, values)) {
+    return false;
+  }
+  if(values.empty()) {
+    return true;
+  }
+  planning_models::KinematicState::JointStateGroup* jsg = collision_models_interface_->getPlanningSceneState()->getJointStateGroup(current_session_->group_name);
+  std::vector<double> saved_values;
+  jsg->getKinematicStateValues(saved_values);
+
+  //each sample is reused as the start of the next segment
+  SweptSphereSample samples[2];
+  bool free = computeSweptSphereSample(values[0], samples[0]);
+  for(unsigned int i = 1; i < values.size() && free; i++) {
+    const SweptSphereSample& start_sample = samples[(i-1)%2];
+    SweptSphereSample& end_sample = samples[i%2];
+    free = (computeSweptSphereSample(values[i], end_sample) &&
+            isSegmentCollisionFree(values[i-1], values[i], start_sample, end_sample, 0));
+  }
+  ROS_DEBUG_STREAM("Trajectory check of " << trajectory.points.size() << " points evaluated " 
+                   << segment_state_evaluations_ << " states");
+
+  jsg->setKinematicState(saved_values);
+  setCurrentGroupState(*collision_models_interface_->getPlanningSceneState());
+  return free;
+}
+
 ////////////
 // Visualization functions
 ///////////
   
+const char* collision_proximity::ProximityStats::getCallName(Call call)
+{
+  switch(call) {
+  case SET_PLANNING_SCENE:
+    return "set_planning_scene";
+  case SETUP_FOR_GROUP_QUERIES:
+    return "setup_for_group_queries";
+  case SET_CURRENT_GROUP_STATE:
+    return "set_current_group_state";
+  case IS_STATE_IN_COLLISION:
+    return "is_state_in_collision";
+  case GET_STATE_COLLISIONS:
+    return "get_state_collisions";
+  case GET_STATE_GRADIENTS:
+    return "get_state_gradients";
+  case IS_TRAJECTORY_SAFE:
+    return "is_trajectory_safe";
+  case IS_SEGMENT_COLLISION_FREE:
+    return "is_segment_collision_free";
+  case IS_TRAJECTORY_COLLISION_FREE:
+    return "is_trajectory_collision_free";
+  default:
+    return "unknown";
+  }
+}
+
+CollisionProximitySpace::ScopedCallTimer::ScopedCallTimer(const CollisionProximitySpace* space, 
+                                                          ProximityStats::Call call) :
+  space_(space->profiling_enabled_ ? space : NULL),
+  call_(call),
+  start_(0.0)
+{
+  if(space_ != NULL) {
+    start_ = getMonotonicTime();
+  }
+}
+
+CollisionProximitySpace::ScopedCallTimer::~ScopedCallTimer()
+{
+  if(space_ != NULL) {
+    space_->addCallTime(call_, getMonotonicTime()-start_);
+  }
+}
+
+double CollisionProximitySpace::getMonotonicTime()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+void CollisionProximitySpace::addCallTime(ProximityStats::Call call, double time) const
+{
+  boost::mutex::scoped_lock lock(profiling_stats_lock_);
+  ProximityStats::CallStats& call_stats = profiling_stats_.calls[call];
+  call_stats.calls++;
+  call_stats.total_time += time;
+  call_stats.max_time = std::max(call_stats.max_time, time);
+}
+
+void CollisionProximitySpace::addQueryCounts(unsigned int spheres, unsigned int intra_group_pairs) const
+{
+  boost::mutex::scoped_lock lock(profiling_stats_lock_);
+  profiling_stats_.spheres_queried += spheres;
+  profiling_stats_.intra_group_pairs_tested += intra_group_pairs;
+}
+
+void CollisionProximitySpace::addFieldUpdate(bool self_field, double time, size_t voxels_propagated) const
+{
+  boost::mutex::scoped_lock lock(profiling_stats_lock_);
+  if(self_field) {
+    profiling_stats_.self_field_updates++;
+    profiling_stats_.self_field_time += time;
+  } else {
+    profiling_stats_.environment_field_updates++;
+    profiling_stats_.environment_field_time += time;
+  }
+  profiling_stats_.voxels_propagated += voxels_propagated;
+}
+
+size_t CollisionProximitySpace::getNumPropagatedVoxels(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* field,
+                                                       bool is_signed)
+{
+  if(is_signed) {
+    return ((const distance_field::SignedPropagationDistanceField*)field)->getNumPropagatedVoxels();
+  }
+  return static_cast<const distance_field::PropagationDistanceField*>(field)->getNumPropagatedVoxels();
+}
+
+collision_proximity::ProximityStats CollisionProximitySpace::getProfilingStats() const
+{
+  boost::mutex::scoped_lock lock(profiling_stats_lock_);
+  return profiling_stats_;
+}
+
+void CollisionProximitySpace::resetProfilingStats()
+{
+  boost::mutex::scoped_lock lock(profiling_stats_lock_);
+  profiling_stats_.reset();
+}
+
+void CollisionProximitySpace::publishDiagnostics(const ros::WallTimerEvent& event)
+{
+  ProximityStats stats = getProfilingStats();
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = "collision_proximity: "+ros::this_node::getName();
+  status.message = profiling_enabled_ ? "Profiling" : "Profiling disabled";
+
+  std::vector<std::pair<std::string, double> > values;
+  values.push_back(std::pair<std::string, double>("environment_field_updates", stats.environment_field_updates));
+  values.push_back(std::pair<std::string, double>("environment_field_time", stats.environment_field_time));
+  values.push_back(std::pair<std::string, double>("self_field_updates", stats.self_field_updates));
+  values.push_back(std::pair<std::string, double>("self_field_time", stats.self_field_time));
+  values.push_back(std::pair<std::string, double>("voxels_propagated", stats.voxels_propagated));
+  values.push_back(std::pair<std::string, double>("spheres_queried", stats.spheres_queried));
+  values.push_back(std::pair<std::string, double>("intra_group_pairs_tested", stats.intra_group_pairs_tested));
+  values.push_back(std::pair<std::string, double>("lock_wait_time", stats.lock_wait_time));
+  for(unsigned int i = 0; i < ProximityStats::NUM_CALLS; i++) {
+    const ProximityStats::CallStats& call_stats = stats.calls[i];
+    std::string name = ProximityStats::getCallName(static_cast<ProximityStats::Call>(i));
+    values.push_back(std::pair<std::string, double>(name+"_calls", call_stats.calls));
+    values.push_back(std::pair<std::string, double>(name+"_mean_time", call_stats.getMeanTime()));
+    values.push_back(std::pair<std::string, double>(name+"_max_time", call_stats.max_time));
+  }
+  for(unsigned int i = 0; i < values.size(); i++) {
+    diagnostic_msgs::KeyValue kv;
+    kv.key = values[i].first;
+    std::stringstream ss;
+    ss << values[i].second;
+    kv.value = ss.str();
+    status.values.push_back(kv);
+  }
+
+  diagnostic_msgs::DiagnosticArray arr;
+  arr.header.stamp = ros::Time::now();
+  arr.status.push_back(status);
+  diagnostics_publisher_.publish(arr);
+}
+
 void CollisionProximitySpace::visualizeDistanceField(distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field) const
 {
   tf::Transform ident;
@@ -1433,7 +2536,7 @@ void CollisionProximitySpace::visualizeClosestCollisionSpheres(const std::vector
   getEnvironmentProximity(current_link_names, prox);
   const BodyDecomposition* bsd = body_decomposition_map_.find(prox.link_name)->second;
   if(!prox.attached_object_name.empty()) {
-    bsd = attached_object_map_.find(prox.attached_object_name)->second->getBodyDecomposition(prox.att_index);
+    bsd = getAttachedObjectDecomposition(prox.attached_object_name)->getBodyDecomposition(prox.att_index);
   }
   if(prox.sphere_index < bsd->getCollisionSpheres().size()) {
     visualization_msgs::Marker mark;
@@ -1466,10 +2569,10 @@ void CollisionProximitySpace::visualizeClosestCollisionSpheres(const std::vector
     for(unsigned int j = 0; j < ls->getAttachedBodyStateVector().size(); j++) {
       const planning_models::KinematicState::AttachedBodyState* att_state = ls->getAttachedBodyStateVector()[j];
       std::string id = makeAttachedObjectId(ls->getName(), att_state->getName());
-      if(attached_object_map_.find(id) == attached_object_map_.end()) {
+      if(getAttachedObjectDecomposition(id) == NULL) {
         continue;
       }
-      const std::vector<CollisionSphere>& body_spheres2 = attached_object_map_.find(id)->second->getCollisionSpheres();
+      const std::vector<CollisionSphere>& body_spheres2 = getAttachedObjectDecomposition(id)->getCollisionSpheres();
       all_collision_spheres.insert(all_collision_spheres.end(), body_spheres2.begin(), body_spheres2.end());
     }
   }
@@ -1572,7 +2675,7 @@ void CollisionProximitySpace::visualizeCollisions(const std::vector<std::string>
   }
   for(unsigned int i = 0; i < attached_body_names.size(); i++) {
     std::string name = attached_body_names[i];
-    const BodyDecompositionVector* bdv = attached_object_map_.find(attached_body_names[i])->second;
+    const BodyDecompositionVector* bdv = getAttachedObjectDecomposition(attached_body_names[i]);
     for(unsigned int j = 0; j < bdv->getSize(); j++) {
       const BodyDecomposition* bd = bdv->getBodyDecomposition(j);
       visualization_msgs::Marker mark;
@@ -1628,8 +2731,8 @@ void CollisionProximitySpace::visualizeObjectVoxels(const std::vector<std::strin
       coll_points = &(body_decomposition_map_.find(object_names[i])->second)->getCollisionPoints();
     } else if(static_object_map_.find(object_names[i]) != static_object_map_.end()) {
       coll_points = &(static_object_map_.find(object_names[i])->second)->getCollisionPoints();
-    } else if(attached_object_map_.find(object_names[i]) != attached_object_map_.end()) {
-      coll_points = &(attached_object_map_.find(object_names[i])->second)->getCollisionPoints();
+    } else if(getAttachedObjectDecomposition(object_names[i]) != NULL) {
+      coll_points = &getAttachedObjectDecomposition(object_names[i])->getCollisionPoints();
     } else {
       ROS_WARN_STREAM("Don't have object named " << object_names[i]);
       continue;
@@ -1663,8 +2766,8 @@ void CollisionProximitySpace::visualizeObjectSpheres(const std::vector<std::stri
       coll_spheres = &(body_decomposition_map_.find(object_names[i])->second)->getCollisionSpheres();
     } else if(static_object_map_.find(object_names[i]) != static_object_map_.end()) {
       coll_spheres = &(static_object_map_.find(object_names[i])->second)->getCollisionSpheres();
-    } else if(attached_object_map_.find(object_names[i]) != attached_object_map_.end()) {
-      coll_spheres = &(attached_object_map_.find(object_names[i])->second)->getCollisionSpheres();
+    } else if(getAttachedObjectDecomposition(object_names[i]) != NULL) {
+      coll_spheres = &getAttachedObjectDecomposition(object_names[i])->getCollisionSpheres();
     } else {
       ROS_WARN_STREAM("Don't have object named " << object_names[i]);
       continue;
@@ -1712,8 +2815,8 @@ void CollisionProximitySpace::visualizeBoundingCylinders(const std::vector<std::
       bsd = body_decomposition_map_.find(object_names[i])->second;
     } else if(static_object_map_.find(object_names[i]) != static_object_map_.end()) {
       bsd = static_object_map_.find(object_names[i])->second->getBodyDecomposition(0);
-    } else if(attached_object_map_.find(object_names[i]) != attached_object_map_.end()) {
-      bsd = attached_object_map_.find(object_names[i])->second->getBodyDecomposition(0);
+    } else if(getAttachedObjectDecomposition(object_names[i]) != NULL) {
+      bsd = getAttachedObjectDecomposition(object_names[i])->getBodyDecomposition(0);
     } else {
       ROS_WARN_STREAM("Don't have object named " << object_names[i]);
       continue;
@@ -35,6 +35,7 @@
 /** \author E. Gil Jones */
 
 #include <collision_proximity/collision_proximity_types.h>
+#include <set>
 
 std::vector<collision_proximity::CollisionSphere> collision_proximity::determineCollisionSpheres(const bodies::Body* body, tf::Transform& relativeTransform)
 {
@@ -55,6 +56,83 @@ std::vector<collision_proximity::CollisionSphere> collision_proximity::determine
   return css; 
 }
 
+//how far the sphere reaches beyond the voxels centered on the points, along the axes and the
+//diagonals in both directions
+static double getSphereExcess(const std::vector<tf::Vector3>& points, unsigned int begin, unsigned int end,
+                              const tf::Vector3& center, double radius, double resolution)
+{
+  static const double DIRECTIONS[7][3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0},
+                                          {1.0, 1.0, 1.0}, {1.0, 1.0, -1.0}, {1.0, -1.0, 1.0}, {-1.0, 1.0, 1.0}};
+  double excess = 0.0;
+  for(unsigned int i = 0; i < 7; i++) {
+    tf::Vector3 dir(DIRECTIONS[i][0], DIRECTIONS[i][1], DIRECTIONS[i][2]);
+    dir.normalize();
+    double voxel_extent = 0.5*resolution*(fabs(dir.x())+fabs(dir.y())+fabs(dir.z()));
+    double lo = points[begin].dot(dir);
+    double hi = lo;
+    for(unsigned int j = begin+1; j < end; j++) {
+      double d = points[j].dot(dir);
+      lo = std::min(lo, d);
+      hi = std::max(hi, d);
+    }
+    double c = center.dot(dir);
+    excess = std::max(excess, (c+radius)-(hi+voxel_extent));
+    excess = std::max(excess, (lo-voxel_extent)-(c-radius));
+  }
+  return excess;
+}
+
+struct IsBelowOnAxis {
+  IsBelowOnAxis(int axis, double value) : axis_(axis), value_(value) {}
+  bool operator()(const tf::Vector3& p) const {
+    return p[axis_] < value_;
+  }
+  int axis_;
+  double value_;
+};
+
+static void fitAdaptiveSpheres(std::vector<tf::Vector3>& points, unsigned int begin, unsigned int end,
+                               double resolution, double max_error,
+                               std::vector<collision_proximity::CollisionSphere>& spheres)
+{
+  tf::Vector3 lo = points[begin];
+  tf::Vector3 hi = lo;
+  for(unsigned int i = begin+1; i < end; i++) {
+    lo.setMin(points[i]);
+    hi.setMax(points[i]);
+  }
+  tf::Vector3 center = (lo+hi)*0.5;
+  double max_dist2 = 0.0;
+  for(unsigned int i = begin; i < end; i++) {
+    max_dist2 = std::max(max_dist2, (points[i]-center).length2());
+  }
+  //reaches the far corner of every voxel
+  double radius = sqrt(max_dist2)+0.5*resolution*sqrt(3.0);
+  if(end-begin > 1 && getSphereExcess(points, begin, end, center, radius, resolution) > max_error) {
+    int axis = (hi-lo).maxAxis();
+    unsigned int mid = std::partition(points.begin()+begin, points.begin()+end, IsBelowOnAxis(axis, center[axis]))-points.begin();
+    if(mid != begin && mid != end) {
+      fitAdaptiveSpheres(points, begin, mid, resolution, max_error, spheres);
+      fitAdaptiveSpheres(points, mid, end, resolution, max_error, spheres);
+      return;
+    }
+  }
+  spheres.push_back(collision_proximity::CollisionSphere(center, radius));
+}
+
+std::vector<collision_proximity::CollisionSphere> collision_proximity::determineAdaptiveCollisionSpheres(const std::vector<tf::Vector3>& points,
+                                                                                                       double resolution,
+                                                                                                       double max_error)
+{
+  std::vector<collision_proximity::CollisionSphere> css;
+  if(points.empty()) {
+    return css;
+  }
+  std::vector<tf::Vector3> sorted_points(points);
+  fitAdaptiveSpheres(sorted_points, 0, sorted_points.size(), resolution, max_error, css);
+  return css;
+}
+
 std::vector<tf::Vector3> collision_proximity::determineCollisionPoints(const bodies::Body* body, double resolution)
 {
   std::vector<tf::Vector3> ret_vec;
@@ -75,14 +153,415 @@ std::vector<tf::Vector3> collision_proximity::determineCollisionPoints(const bod
   return ret_vec;
 }
 
-bool collision_proximity::getCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
-                                                      const std::vector<CollisionSphere>& sphere_list,
-                                                      GradientInfo& gradient, 
-                                                      double tolerance, 
-                                                      bool subtract_radii, 
-                                                      double maximum_value,
-                                                      bool stop_at_first_collision) {
-  //assumes gradient is properly initialized
+//inclusive range of lattice indices whose points lie in [lo, hi]
+static void getLatticeRange(double lo, double hi, double resolution, int& kmin, int& kmax)
+{
+  kmin = (int)ceil(lo/resolution);
+  kmax = (int)floor(hi/resolution);
+}
+
+static bool getPrimitiveHalfExtents(const shapes::Shape* shape, double padding, tf::Vector3& extents)
+{
+  switch(shape->type) {
+  case shapes::BOX:
+    {
+      const double* size = static_cast<const shapes::Box*>(shape)->size;
+      extents = tf::Vector3(size[0]/2.0+padding, size[1]/2.0+padding, size[2]/2.0+padding);
+    }
+    return true;
+  case shapes::CYLINDER:
+    {
+      const shapes::Cylinder* cyl = static_cast<const shapes::Cylinder*>(shape);
+      extents = tf::Vector3(cyl->radius+padding, cyl->radius+padding, cyl->length/2.0+padding);
+    }
+    return true;
+  case shapes::SPHERE:
+    {
+      double r = static_cast<const shapes::Sphere*>(shape)->radius+padding;
+      extents = tf::Vector3(r, r, r);
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+//returns false if the vertical line through (x,y) misses the shape, otherwise its z extent
+static bool getPrimitiveColumnExtent(const shapes::Shape* shape, double padding, double x, double y, double& zlo, double& zhi)
+{
+  switch(shape->type) {
+  case shapes::BOX:
+    {
+      const double* size = static_cast<const shapes::Box*>(shape)->size;
+      if(fabs(x) > size[0]/2.0+padding || fabs(y) > size[1]/2.0+padding) {
+        return false;
+      }
+      zhi = size[2]/2.0+padding;
+    }
+    break;
+  case shapes::CYLINDER:
+    {
+      const shapes::Cylinder* cyl = static_cast<const shapes::Cylinder*>(shape);
+      double r = cyl->radius+padding;
+      if(x*x+y*y > r*r) {
+        return false;
+      }
+      zhi = cyl->length/2.0+padding;
+    }
+    break;
+  case shapes::SPHERE:
+    {
+      double r = static_cast<const shapes::Sphere*>(shape)->radius+padding;
+      double d2 = r*r-x*x-y*y;
+      if(d2 < 0.0) {
+        return false;
+      }
+      zhi = sqrt(d2);
+    }
+    break;
+  default:
+    return false;
+  }
+  zlo = -zhi;
+  return true;
+}
+
+//appends the lattice points of the columns, given the inclusive z range of each column.
+//Empty columns have kmin > kmax
+static void appendColumnPoints(int imin, int jmin, int nx, int ny, 
+                               const std::vector<int>& kmin, const std::vector<int>& kmax,
+                               double resolution, bool surface_only, std::vector<tf::Vector3>& points)
+{
+  const int di[4] = {-1, 1, 0, 0};
+  const int dj[4] = {0, 0, -1, 1};
+  for(int i = 0; i < nx; i++) {
+    for(int j = 0; j < ny; j++) {
+      int ind = i*ny+j;
+      for(int k = kmin[ind]; k <= kmax[ind]; k++) {
+        if(surface_only && k != kmin[ind] && k != kmax[ind]) {
+          //interior of the column, on the surface only if a neighboring column doesn't contain it
+          bool boundary = false;
+          for(unsigned int n = 0; n < 4 && !boundary; n++) {
+            int ni = i+di[n];
+            int nj = j+dj[n];
+            if(ni < 0 || ni >= nx || nj < 0 || nj >= ny) {
+              boundary = true;
+            } else if(k < kmin[ni*ny+nj] || k > kmax[ni*ny+nj]) {
+              boundary = true;
+            }
+          }
+          if(!boundary) {
+            continue;
+          }
+        }
+        points.push_back(tf::Vector3((i+imin)*resolution, (j+jmin)*resolution, k*resolution));
+      }
+    }
+  }
+}
+
+static void rasterizePrimitive(const shapes::Shape* shape, double padding, double resolution, bool surface_only, 
+                               std::vector<tf::Vector3>& points)
+{
+  tf::Vector3 extents;
+  getPrimitiveHalfExtents(shape, padding, extents);
+  int imin, imax, jmin, jmax;
+  getLatticeRange(-extents.x(), extents.x(), resolution, imin, imax);
+  getLatticeRange(-extents.y(), extents.y(), resolution, jmin, jmax);
+  int nx = imax-imin+1;
+  int ny = jmax-jmin+1;
+  if(nx <= 0 || ny <= 0) {
+    return;
+  }
+  //lattice z range of each column, empty columns have kmin > kmax
+  std::vector<int> kmin(nx*ny, 1);
+  std::vector<int> kmax(nx*ny, 0);
+  for(int i = 0; i < nx; i++) {
+    for(int j = 0; j < ny; j++) {
+      double zlo, zhi;
+      if(getPrimitiveColumnExtent(shape, padding, (i+imin)*resolution, (j+jmin)*resolution, zlo, zhi)) {
+        getLatticeRange(zlo, zhi, resolution, kmin[i*ny+j], kmax[i*ny+j]);
+      }
+    }
+  }
+  appendColumnPoints(imin, jmin, nx, ny, kmin, kmax, resolution, surface_only, points);
+}
+
+//separating axis test between a triangle and an axis-aligned cube
+static bool triangleIntersectsVoxel(const tf::Vector3& center, double half_size,
+                                    const tf::Vector3& a, const tf::Vector3& b, const tf::Vector3& c)
+{
+  tf::Vector3 v[3] = {a-center, b-center, c-center};
+  for(unsigned int i = 0; i < 3; i++) {
+    double mn = std::min(v[0][i], std::min(v[1][i], v[2][i]));
+    double mx = std::max(v[0][i], std::max(v[1][i], v[2][i]));
+    if(mn > half_size || mx < -half_size) {
+      return false;
+    }
+  }
+  tf::Vector3 e[3] = {v[1]-v[0], v[2]-v[1], v[0]-v[2]};
+  tf::Vector3 normal = e[0].cross(e[1]);
+  if(fabs(normal.dot(v[0])) > half_size*(fabs(normal.x())+fabs(normal.y())+fabs(normal.z()))) {
+    return false;
+  }
+  const tf::Vector3 unit[3] = {tf::Vector3(1.0,0.0,0.0), tf::Vector3(0.0,1.0,0.0), tf::Vector3(0.0,0.0,1.0)};
+  for(unsigned int i = 0; i < 3; i++) {
+    for(unsigned int j = 0; j < 3; j++) {
+      tf::Vector3 axis = unit[j].cross(e[i]);
+      double p0 = axis.dot(v[0]);
+      double p1 = axis.dot(v[1]);
+      double p2 = axis.dot(v[2]);
+      double r = half_size*(fabs(axis.x())+fabs(axis.y())+fabs(axis.z()));
+      if(std::min(p0, std::min(p1, p2)) > r || std::max(p0, std::max(p1, p2)) < -r) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+struct HullFace
+{
+  unsigned int v[3];
+  tf::Vector3 normal;
+  double offset;
+};
+
+static bool makeHullFace(const std::vector<tf::Vector3>& points, unsigned int a, unsigned int b, unsigned int c,
+                         const tf::Vector3& interior, HullFace& face)
+{
+  tf::Vector3 normal = (points[b]-points[a]).cross(points[c]-points[a]);
+  double len = normal.length();
+  if(len == 0.0) {
+    return false;
+  }
+  face.v[0] = a;
+  face.v[1] = b;
+  face.v[2] = c;
+  face.normal = normal/len;
+  face.offset = face.normal.dot(points[a]);
+  //keeps the faces pointing away from the interior even for nearly coplanar points
+  if(face.normal.dot(interior) > face.offset) {
+    std::swap(face.v[1], face.v[2]);
+    face.normal = -face.normal;
+    face.offset = -face.offset;
+  }
+  return true;
+}
+
+//incremental convex hull; points within eps of the current hull are skipped. Returns false
+//if the points are (nearly) flat and have no hull volume
+static bool computeConvexHull(const std::vector<tf::Vector3>& points, double eps, std::vector<HullFace>& hull)
+{
+  hull.clear();
+  //initial tetrahedron from extreme points
+  unsigned int i0 = 0;
+  for(unsigned int i = 1; i < points.size(); i++) {
+    if(points[i].x() < points[i0].x()) {
+      i0 = i;
+    }
+  }
+  unsigned int i1 = i0;
+  for(unsigned int i = 0; i < points.size(); i++) {
+    if(points[i].distance2(points[i0]) > points[i1].distance2(points[i0])) {
+      i1 = i;
+    }
+  }
+  tf::Vector3 axis = points[i1]-points[i0];
+  if(axis.length() <= eps) {
+    return false;
+  }
+  axis.normalize();
+  unsigned int i2 = i0;
+  double best = 0.0;
+  for(unsigned int i = 0; i < points.size(); i++) {
+    double d = axis.cross(points[i]-points[i0]).length();
+    if(d > best) {
+      best = d;
+      i2 = i;
+    }
+  }
+  if(best <= eps) {
+    return false;
+  }
+  tf::Vector3 plane = (points[i1]-points[i0]).cross(points[i2]-points[i0]).normalized();
+  unsigned int i3 = i0;
+  best = 0.0;
+  for(unsigned int i = 0; i < points.size(); i++) {
+    double d = fabs(plane.dot(points[i]-points[i0]));
+    if(d > best) {
+      best = d;
+      i3 = i;
+    }
+  }
+  if(best <= eps) {
+    return false;
+  }
+  tf::Vector3 interior = (points[i0]+points[i1]+points[i2]+points[i3])/4.0;
+  unsigned int tet[4][3] = {{i0, i1, i2}, {i0, i1, i3}, {i0, i2, i3}, {i1, i2, i3}};
+  for(unsigned int i = 0; i < 4; i++) {
+    HullFace face;
+    makeHullFace(points, tet[i][0], tet[i][1], tet[i][2], interior, face);
+    hull.push_back(face);
+  }
+
+  std::vector<HullFace> kept;
+  std::set<std::pair<unsigned int, unsigned int> > visible_edges;
+  for(unsigned int p = 0; p < points.size(); p++) {
+    kept.clear();
+    visible_edges.clear();
+    for(unsigned int f = 0; f < hull.size(); f++) {
+      if(hull[f].normal.dot(points[p])-hull[f].offset > eps) {
+        for(unsigned int e = 0; e < 3; e++) {
+          visible_edges.insert(std::make_pair(hull[f].v[e], hull[f].v[(e+1)%3]));
+        }
+      } else {
+        kept.push_back(hull[f]);
+      }
+    }
+    if(visible_edges.empty()) {
+      continue;
+    }
+    //the horizon is made of the visible edges whose reverse isn't visible
+    for(std::set<std::pair<unsigned int, unsigned int> >::iterator it = visible_edges.begin();
+        it != visible_edges.end(); it++) {
+      if(visible_edges.find(std::make_pair(it->second, it->first)) == visible_edges.end()) {
+        HullFace face;
+        if(makeHullFace(points, it->first, it->second, p, interior, face)) {
+          kept.push_back(face);
+        }
+      }
+    }
+    hull.swap(kept);
+  }
+  return true;
+}
+
+static void rasterizeTriangles(const shapes::Mesh* mesh, const std::vector<tf::Vector3>& vertices, double resolution, 
+                               std::vector<tf::Vector3>& points)
+{
+  double half = resolution/2.0;
+  std::set<std::vector<int> > cells;
+  std::vector<int> cell(3);
+  for(unsigned int t = 0; t < mesh->triangleCount; t++) {
+    const tf::Vector3& a = vertices[mesh->triangles[3*t]];
+    const tf::Vector3& b = vertices[mesh->triangles[3*t+1]];
+    const tf::Vector3& c = vertices[mesh->triangles[3*t+2]];
+    int kmin[3], kmax[3];
+    for(unsigned int i = 0; i < 3; i++) {
+      getLatticeRange(std::min(a[i], std::min(b[i], c[i]))-half, std::max(a[i], std::max(b[i], c[i]))+half, 
+                      resolution, kmin[i], kmax[i]);
+    }
+    for(cell[0] = kmin[0]; cell[0] <= kmax[0]; cell[0]++) {
+      for(cell[1] = kmin[1]; cell[1] <= kmax[1]; cell[1]++) {
+        for(cell[2] = kmin[2]; cell[2] <= kmax[2]; cell[2]++) {
+          tf::Vector3 center(cell[0]*resolution, cell[1]*resolution, cell[2]*resolution);
+          if(cells.find(cell) == cells.end() && triangleIntersectsVoxel(center, half, a, b, c)) {
+            cells.insert(cell);
+            points.push_back(center);
+          }
+        }
+      }
+    }
+  }
+}
+
+//meshes are filled to their convex hull, as bodies::ConvexMesh::containsPoint does, so concave
+//and open meshes get the same points the body-based scan gave them
+static void rasterizeMesh(const shapes::Mesh* mesh, double padding, double resolution, bool surface_only, 
+                          std::vector<tf::Vector3>& points)
+{
+  if(mesh->vertexCount == 0 || mesh->triangleCount == 0) {
+    return;
+  }
+  //padding pushes the vertices away from the centroid
+  std::vector<tf::Vector3> vertices(mesh->vertexCount);
+  tf::Vector3 centroid(0.0,0.0,0.0);
+  for(unsigned int i = 0; i < mesh->vertexCount; i++) {
+    vertices[i] = tf::Vector3(mesh->vertices[3*i], mesh->vertices[3*i+1], mesh->vertices[3*i+2]);
+    centroid += vertices[i];
+  }
+  centroid /= mesh->vertexCount;
+  tf::Vector3 mn(DBL_MAX, DBL_MAX, DBL_MAX);
+  tf::Vector3 mx(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  for(unsigned int i = 0; i < vertices.size(); i++) {
+    tf::Vector3 dir = vertices[i]-centroid;
+    double len = dir.length();
+    if(padding != 0.0 && len > 0.0) {
+      vertices[i] += dir*(padding/len);
+    }
+    mn.setMin(vertices[i]);
+    mx.setMax(vertices[i]);
+  }
+
+  double eps = 1e-9*std::max(1.0, (mx-mn).length());
+  std::vector<HullFace> hull;
+  if(!computeConvexHull(vertices, eps, hull)) {
+    //a flat mesh has no interior, only its triangles are voxelized
+    rasterizeTriangles(mesh, vertices, resolution, points);
+    return;
+  }
+
+  int imin, imax, jmin, jmax, kmin_all, kmax_all;
+  getLatticeRange(mn.x()-eps, mx.x()+eps, resolution, imin, imax);
+  getLatticeRange(mn.y()-eps, mx.y()+eps, resolution, jmin, jmax);
+  getLatticeRange(mn.z()-eps, mx.z()+eps, resolution, kmin_all, kmax_all);
+  int nx = imax-imin+1;
+  int ny = jmax-jmin+1;
+  if(nx <= 0 || ny <= 0 || kmin_all > kmax_all) {
+    return;
+  }
+  std::vector<int> kmin(nx*ny, 1);
+  std::vector<int> kmax(nx*ny, 0);
+  for(int i = 0; i < nx; i++) {
+    for(int j = 0; j < ny; j++) {
+      double x = (i+imin)*resolution;
+      double y = (j+jmin)*resolution;
+      //the column is clipped by every face plane
+      double zlo = mn.z()-eps;
+      double zhi = mx.z()+eps;
+      for(unsigned int f = 0; f < hull.size() && zlo <= zhi; f++) {
+        const tf::Vector3& n = hull[f].normal;
+        double rhs = hull[f].offset+eps-n.x()*x-n.y()*y;
+        if(fabs(n.z()) < 1e-12) {
+          if(rhs < 0.0) {
+            zhi = zlo-1.0;
+          }
+        } else if(n.z() > 0.0) {
+          zhi = std::min(zhi, rhs/n.z());
+        } else {
+          zlo = std::max(zlo, rhs/n.z());
+        }
+      }
+      if(zlo <= zhi) {
+        getLatticeRange(zlo, zhi, resolution, kmin[i*ny+j], kmax[i*ny+j]);
+      }
+    }
+  }
+  appendColumnPoints(imin, jmin, nx, ny, kmin, kmax, resolution, surface_only, points);
+}
+
+std::vector<tf::Vector3> collision_proximity::determineCollisionPoints(const shapes::Shape* shape, double padding, double resolution, bool surface_only)
+{
+  std::vector<tf::Vector3> ret_vec;
+  if(shape->type == shapes::MESH) {
+    rasterizeMesh(static_cast<const shapes::Mesh*>(shape), padding, resolution, surface_only, ret_vec);
+  } else {
+    rasterizePrimitive(shape, padding, resolution, surface_only, ret_vec);
+  }
+  return ret_vec;
+}
+
+//distances and gradients are the arrays for the spheres of the list
+static bool computeCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                            const std::vector<collision_proximity::CollisionSphere>& sphere_list,
+                                            double* distances,
+                                            tf::Vector3* gradients,
+                                            double& closest_distance,
+                                            double tolerance, 
+                                            bool subtract_radii, 
+                                            double maximum_value,
+                                            bool stop_at_first_collision) {
   bool in_collision = false;
   for(unsigned int i = 0; i < sphere_list.size(); i++) {
     tf::Vector3 p = sphere_list[i].center_;
@@ -97,23 +576,72 @@ bool collision_proximity::getCollisionSphereGradients(const distance_field::Dist
         in_collision = true;
       } 
     }
-    if(dist < gradient.closest_distance) {
-      gradient.closest_distance = dist;
+    if(dist < closest_distance) {
+      closest_distance = dist;
     }
-    gradient.distances[i] = dist;
-    gradient.gradients[i] = tf::Vector3(gx,gy,gz);
+    distances[i] = dist;
+    gradients[i] = tf::Vector3(gx,gy,gz);
   }
   return in_collision;
 }
 
+bool collision_proximity::getCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                                      const std::vector<CollisionSphere>& sphere_list,
+                                                      GradientInfo& gradient, 
+                                                      double tolerance, 
+                                                      bool subtract_radii, 
+                                                      double maximum_value,
+                                                      bool stop_at_first_collision) {
+  //assumes gradient is properly initialized
+  if(sphere_list.empty()) {
+    return false;
+  }
+  return computeCollisionSphereGradients(distance_field, sphere_list, &gradient.distances[0], &gradient.gradients[0], gradient.closest_distance,
+                                         tolerance, subtract_radii, maximum_value, stop_at_first_collision);
+}
+
+bool collision_proximity::getCollisionSphereGradients(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                                      const std::vector<CollisionSphere>& sphere_list,
+                                                      GradientArrays& gradients,
+                                                      unsigned int body,
+                                                      double tolerance, 
+                                                      bool subtract_radii, 
+                                                      double maximum_value,
+                                                      bool stop_at_first_collision) {
+  //assumes the arrays are set up for the body
+  if(sphere_list.empty()) {
+    return false;
+  }
+  unsigned int offset = gradients.body_offsets[body];
+  return computeCollisionSphereGradients(distance_field, sphere_list, &gradients.distances[offset], &gradients.gradients[offset], 
+                                         gradients.closest_distances[body], tolerance, subtract_radii, maximum_value, stop_at_first_collision);
+}
+
+void collision_proximity::getCollisionSphereDistances(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
+                                                      const std::vector<CollisionSphere>& sphere_list,
+                                                      GradientArrays& gradients,
+                                                      unsigned int body)
+{
+  //assumes the arrays are set up for the body
+  unsigned int offset = gradients.body_offsets[body];
+  double& closest_distance = gradients.closest_distances[body];
+  for(unsigned int i = 0; i < sphere_list.size(); i++) {
+    const tf::Vector3& p = sphere_list[i].center_;
+    double dist = distance_field->getDistanceWithoutGradient(p.x(), p.y(), p.z());
+    if(dist < closest_distance) {
+      closest_distance = dist;
+    }
+    gradients.distances[offset+i] = dist;
+  }
+}
+
 bool collision_proximity::getCollisionSphereCollision(const distance_field::DistanceField<distance_field::PropDistanceFieldVoxel>* distance_field,
                                                       const std::vector<CollisionSphere>& sphere_list,
                                                       double tolerance)
 {
   for(unsigned int i = 0; i < sphere_list.size(); i++) {
-    tf::Vector3 p = sphere_list[i].center_;
-    double gx, gy, gz;
-    double dist = distance_field->getDistanceGradient(p.x(), p.y(), p.z(), gx, gy, gz);
+    const tf::Vector3& p = sphere_list[i].center_;
+    double dist = distance_field->getDistanceWithoutGradient(p.x(), p.y(), p.z());
     if(dist - sphere_list[i].radius_ < tolerance) {
       return true;
     }
@@ -122,11 +650,336 @@ bool collision_proximity::getCollisionSphereCollision(const distance_field::Dist
 
 }
 
+///
+/// SphereHierarchy
+///
+
+//slack for rounding, so that bounds never exceed the distances computed pair by pair
+static const double SPHERE_BOUND_EPSILON = 1e-9;
+
+static void computeBoundingSphere(const std::vector<collision_proximity::CollisionSphere>& spheres,
+                                  unsigned int start, unsigned int end,
+                                  tf::Vector3& center, double& center_radius, double& radius)
+{
+  tf::Vector3 mn = spheres[start].center_;
+  tf::Vector3 mx = spheres[start].center_;
+  for(unsigned int i = start+1; i < end; i++) {
+    mn.setMin(spheres[i].center_);
+    mx.setMax(spheres[i].center_);
+  }
+  center = (mn+mx)*0.5;
+  center_radius = 0.0;
+  radius = 0.0;
+  for(unsigned int i = start; i < end; i++) {
+    double dist = center.distance(spheres[i].center_);
+    center_radius = std::max(center_radius, dist);
+    radius = std::max(radius, dist+spheres[i].radius_);
+  }
+}
+
+const unsigned int collision_proximity::SphereHierarchy::CHUNK_SIZE;
+
+void collision_proximity::SphereHierarchy::build(const std::vector<CollisionSphere>& spheres)
+{
+  unsigned int num_chunks = (spheres.size()+CHUNK_SIZE-1)/CHUNK_SIZE;
+  chunk_centers.resize(num_chunks);
+  chunk_center_radii.resize(num_chunks);
+  chunk_radii.resize(num_chunks);
+  arrays.resize(spheres.size());
+  for(unsigned int i = 0; i < spheres.size(); i++) {
+    arrays.x[i] = spheres[i].center_.x();
+    arrays.y[i] = spheres[i].center_.y();
+    arrays.z[i] = spheres[i].center_.z();
+    arrays.radius[i] = spheres[i].radius_;
+  }
+  if(spheres.empty()) {
+    return;
+  }
+  computeBoundingSphere(spheres, 0, spheres.size(), center, center_radius, radius);
+  for(unsigned int i = 0; i < num_chunks; i++) {
+    computeBoundingSphere(spheres, i*CHUNK_SIZE, std::min((i+1)*CHUNK_SIZE, (unsigned int)spheres.size()),
+                          chunk_centers[i], chunk_center_radii[i], chunk_radii[i]);
+  }
+}
+
+bool collision_proximity::getSphereListCollision(const std::vector<CollisionSphere>& spheres1,
+                                                 const SphereHierarchy& hierarchy1,
+                                                 const std::vector<CollisionSphere>& spheres2,
+                                                 const SphereHierarchy& hierarchy2,
+                                                 double tolerance)
+{
+  if(spheres1.empty() || spheres2.empty()) {
+    return false;
+  }
+  if(hierarchy1.center.distance(hierarchy2.center)-hierarchy1.radius-hierarchy2.radius-SPHERE_BOUND_EPSILON > tolerance) {
+    return false;
+  }
+  const unsigned int chunk_size = SphereHierarchy::CHUNK_SIZE;
+  for(unsigned int a = 0; a < hierarchy1.getNumChunks(); a++) {
+    unsigned int a_end = std::min((a+1)*chunk_size, (unsigned int)spheres1.size());
+    for(unsigned int b = 0; b < hierarchy2.getNumChunks(); b++) {
+      if(hierarchy1.chunk_centers[a].distance(hierarchy2.chunk_centers[b])
+         -hierarchy1.chunk_radii[a]-hierarchy2.chunk_radii[b]-SPHERE_BOUND_EPSILON > tolerance) {
+        continue;
+      }
+      unsigned int b_end = std::min((b+1)*chunk_size, (unsigned int)spheres2.size());
+      unsigned int argmin1, argmin2;
+      if(computeMinimumSphereDistance(hierarchy1.arrays, a*chunk_size, a_end, 
+                                      hierarchy2.arrays, b*chunk_size, b_end, 
+                                      true, argmin1, argmin2) <= tolerance) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool computeSphereListProximityGradients(const std::vector<collision_proximity::CollisionSphere>& spheres1,
+                                               const collision_proximity::SphereHierarchy& hierarchy1,
+                                               const std::vector<collision_proximity::CollisionSphere>& spheres2,
+                                               const collision_proximity::SphereHierarchy& hierarchy2,
+                                               double* distances1,
+                                               tf::Vector3* gradients1,
+                                               double& closest_distance1,
+                                               double* distances2,
+                                               tf::Vector3* gradients2,
+                                               double& closest_distance2,
+                                               double tolerance,
+                                               bool subtract_radii)
+{
+  const unsigned int chunk_size = collision_proximity::SphereHierarchy::CHUNK_SIZE;
+  double max_distance1 = -DBL_MAX;
+  for(unsigned int k = 0; k < spheres1.size(); k++) {
+    max_distance1 = std::max(max_distance1, distances1[k]);
+  }
+  double max_distance2 = -DBL_MAX;
+  for(unsigned int l = 0; l < spheres2.size(); l++) {
+    max_distance2 = std::max(max_distance2, distances2[l]);
+  }
+  double bound = hierarchy1.center.distance(hierarchy2.center)-SPHERE_BOUND_EPSILON;
+  if(subtract_radii) {
+    bound -= hierarchy1.radius+hierarchy2.radius;
+  } else {
+    bound -= hierarchy1.center_radius+hierarchy2.center_radius;
+  }
+  if(bound >= max_distance1 && bound >= max_distance2 && (!subtract_radii || bound > tolerance)) {
+    return false;
+  }
+
+  bool in_collision = false;
+  double distances[chunk_size];
+  for(unsigned int k = 0; k < spheres1.size(); k++) {
+    for(unsigned int b = 0; b < hierarchy2.getNumChunks(); b++) {
+      double chunk_bound = spheres1[k].center_.distance(hierarchy2.chunk_centers[b])-SPHERE_BOUND_EPSILON;
+      if(subtract_radii) {
+        chunk_bound -= spheres1[k].radius_+hierarchy2.chunk_radii[b];
+      } else {
+        chunk_bound -= hierarchy2.chunk_center_radii[b];
+      }
+      unsigned int b_begin = b*chunk_size;
+      unsigned int b_end = std::min(b_begin+chunk_size, (unsigned int)spheres2.size());
+      if(chunk_bound >= distances1[k] && (!subtract_radii || chunk_bound > tolerance)) {
+        bool can_lower = false;
+        for(unsigned int l = b_begin; l < b_end && !can_lower; l++) {
+          can_lower = chunk_bound < distances2[l];
+        }
+        if(!can_lower) {
+          continue;
+        }
+      }
+      collision_proximity::computeSphereDistances(hierarchy1.arrays.x[k], hierarchy1.arrays.y[k], hierarchy1.arrays.z[k], hierarchy1.arrays.radius[k],
+                             hierarchy2.arrays, b_begin, b_end, subtract_radii, distances);
+      for(unsigned int l = b_begin; l < b_end; l++) {
+        double dist = distances[l-b_begin];
+        if(subtract_radii && dist <= tolerance) {
+          in_collision = true;
+        }
+        if(dist < distances1[k]) {
+          distances1[k] = dist;
+          gradients1[k] = spheres1[k].center_-spheres2[l].center_;
+        }
+        if(dist < closest_distance1) {
+          closest_distance1 = dist;
+        }
+        if(dist < distances2[l]) {
+          distances2[l] = dist;
+          gradients2[l] = spheres2[l].center_-spheres1[k].center_;
+        }
+        if(dist < closest_distance2) {
+          closest_distance2 = dist;
+        }
+      }
+    }
+  }
+  return in_collision;
+}
+
+bool collision_proximity::getSphereListProximityGradients(const std::vector<CollisionSphere>& spheres1,
+                                                          const SphereHierarchy& hierarchy1,
+                                                          const std::vector<CollisionSphere>& spheres2,
+                                                          const SphereHierarchy& hierarchy2,
+                                                          GradientInfo& gradient1,
+                                                          GradientInfo& gradient2,
+                                                          double tolerance,
+                                                          bool subtract_radii)
+{
+  if(spheres1.empty() || spheres2.empty()) {
+    return false;
+  }
+  return computeSphereListProximityGradients(spheres1, hierarchy1, spheres2, hierarchy2,
+                                             &gradient1.distances[0], &gradient1.gradients[0], gradient1.closest_distance,
+                                             &gradient2.distances[0], &gradient2.gradients[0], gradient2.closest_distance,
+                                             tolerance, subtract_radii);
+}
+
+bool collision_proximity::getSphereListProximityGradients(const std::vector<CollisionSphere>& spheres1,
+                                                          const SphereHierarchy& hierarchy1,
+                                                          const std::vector<CollisionSphere>& spheres2,
+                                                          const SphereHierarchy& hierarchy2,
+                                                          GradientArrays& gradients,
+                                                          unsigned int body1,
+                                                          unsigned int body2,
+                                                          double tolerance,
+                                                          bool subtract_radii)
+{
+  if(spheres1.empty() || spheres2.empty()) {
+    return false;
+  }
+  unsigned int offset1 = gradients.body_offsets[body1];
+  unsigned int offset2 = gradients.body_offsets[body2];
+  return computeSphereListProximityGradients(spheres1, hierarchy1, spheres2, hierarchy2,
+                                             &gradients.distances[offset1], &gradients.gradients[offset1], gradients.closest_distances[body1],
+                                             &gradients.distances[offset2], &gradients.gradients[offset2], gradients.closest_distances[body2],
+                                             tolerance, subtract_radii);
+}
+
+///
+/// GradientArrays
+///
+
+///
+/// Swept sphere bounds
+///
+
+void collision_proximity::computeChainMotionBounds(const BodyJointChain& chain,
+                                                   const std::vector<double>& chain_lengths,
+                                                   const std::vector<double>& start,
+                                                   const std::vector<double>& end,
+                                                   double& fixed_motion,
+                                                   double& lever_motion)
+{
+  //walking up from the body, the chain below each joint is known when it is reached.
+  //Prismatic joints lengthen the chain above them
+  fixed_motion = 0.0;
+  lever_motion = 0.0;
+  double chain_length = 0.0;
+  for(int j = (int)chain.joint_types.size()-1; j >= 0; j--) {
+    double dq = 0.0;
+    for(unsigned int v = chain.variable_indices[j]; v < chain.variable_indices[j]+chain.variable_counts[j]; v++) {
+      dq += fabs(end[v]-start[v]);
+    }
+    if(chain.joint_types[j] == CHAIN_REVOLUTE) {
+      fixed_motion += dq*chain_length;
+      lever_motion += dq;
+    } else if(chain.joint_types[j] == CHAIN_PRISMATIC) {
+      fixed_motion += dq;
+    } else if(dq > 0.0) {
+      fixed_motion = DBL_MAX;
+      return;
+    }
+    if(j > 0) {
+      chain_length += chain_lengths[j-1];
+      if(chain.joint_types[j] == CHAIN_PRISMATIC) {
+        chain_length += dq;
+      }
+    }
+  }
+}
+
+static double getMaxBound(const std::vector<double>& bounds)
+{
+  double max_bound = 0.0;
+  for(unsigned int k = 0; k < bounds.size(); k++) {
+    max_bound = std::max(max_bound, bounds[k]);
+  }
+  return max_bound;
+}
+
+bool collision_proximity::isSweptSegmentClear(const SweptSphereSample& start_sample,
+                                              const SweptSphereSample& end_sample,
+                                              const std::vector<double>& bounds,
+                                              double field_slack,
+                                              double tolerance)
+{
+  double max_bound = getMaxBound(bounds);
+  for(unsigned int k = 0; k < bounds.size(); k++) {
+    if(bounds[k] == DBL_MAX) {
+      return false;
+    }
+    //a sphere that moves at most bounds[k] can't get closer than this anywhere in between
+    if((start_sample.field_clearances[k]+end_sample.field_clearances[k]-bounds[k])*0.5-field_slack <= tolerance) {
+      return false;
+    }
+    if(start_sample.intra_clearances[k] != DBL_MAX && end_sample.intra_clearances[k] != DBL_MAX &&
+       (start_sample.intra_clearances[k]+end_sample.intra_clearances[k]-bounds[k]-max_bound)*0.5 <= tolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool collision_proximity::isSweptRegionClear(const SweptSphereSample& sample,
+                                             const std::vector<double>& bounds,
+                                             double field_slack,
+                                             double tolerance)
+{
+  double max_bound = getMaxBound(bounds);
+  for(unsigned int k = 0; k < bounds.size(); k++) {
+    if(bounds[k] == DBL_MAX) {
+      return false;
+    }
+    if(sample.field_clearances[k]-bounds[k]-field_slack <= tolerance) {
+      return false;
+    }
+    if(sample.intra_clearances[k] != DBL_MAX && sample.intra_clearances[k]-bounds[k]-max_bound <= tolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void collision_proximity::GradientArrays::setup(const std::vector<unsigned int>& offsets)
+{
+  body_offsets = offsets;
+  unsigned int num_spheres = offsets.empty() ? 0 : offsets.back();
+  closest_distances.resize(offsets.empty() ? 0 : offsets.size()-1);
+  distances.resize(num_spheres);
+  gradients.resize(num_spheres);
+  reset();
+}
+
+void collision_proximity::GradientArrays::reset()
+{
+  std::fill(closest_distances.begin(), closest_distances.end(), DBL_MAX);
+  std::fill(distances.begin(), distances.end(), DBL_MAX);
+}
+
+void collision_proximity::GradientBuffer::setup(const std::vector<unsigned int>& offsets)
+{
+  GradientArrays::setup(offsets);
+  sphere_locations.resize(getNumSpheres());
+  sphere_radii.resize(getNumSpheres());
+  environment.setup(offsets);
+  self.setup(offsets);
+  intra.setup(offsets);
+}
+
 ///
 /// BodyDecomposition
 ///
 
-collision_proximity::BodyDecomposition::BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, double resolution, double padding) :
+collision_proximity::BodyDecomposition::BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, double resolution, double padding, bool surface_points_only,
+                                                          SphereDecompositionMode sphere_mode, double max_sphere_error) :
   object_name_(object_name)
 {
   body_ = bodies::createBodyFromShape(shape); //unpadded
@@ -134,10 +987,43 @@ collision_proximity::BodyDecomposition::BodyDecomposition(const std::string& obj
   ident.setIdentity();
   body_->setPose(ident);
   body_->setPadding(padding);
-  collision_spheres_ = determineCollisionSpheres(body_, relative_cylinder_pose_);
-  relative_collision_points_ = determineCollisionPoints(body_, resolution);
+  tf::Vector3 extents;
+  bool rasterized = (shape->type == shapes::MESH || getPrimitiveHalfExtents(shape, padding, extents));
+  if(rasterized) {
+    relative_collision_points_ = determineCollisionPoints(shape, padding, resolution, surface_points_only);
+  } else {
+    relative_collision_points_ = determineCollisionPoints(body_, resolution);
+  }
   posed_collision_points_ = relative_collision_points_;
-  ROS_DEBUG_STREAM("Object " << object_name << " has " << relative_collision_points_.size() << " collision points");
+  if(sphere_mode == ADAPTIVE_SPHERE_DECOMPOSITION) {
+    //the spheres have to cover the inside as well
+    if(rasterized && surface_points_only) {
+      collision_spheres_ = determineAdaptiveCollisionSpheres(determineCollisionPoints(shape, padding, resolution, false),
+                                                             resolution, max_sphere_error);
+    } else {
+      collision_spheres_ = determineAdaptiveCollisionSpheres(relative_collision_points_, resolution, max_sphere_error);
+    }
+    relative_cylinder_pose_.setIdentity();
+  }
+  if(collision_spheres_.empty()) {
+    collision_spheres_ = determineCollisionSpheres(body_, relative_cylinder_pose_);
+  }
+  ROS_DEBUG_STREAM("Object " << object_name << " has " << relative_collision_points_.size() << " collision points and "
+                   << collision_spheres_.size() << " collision spheres");
+}
+
+collision_proximity::BodyDecomposition::BodyDecomposition(const std::string& object_name, const shapes::Shape* shape, const BodyDecomposition& prototype) :
+  relative_cylinder_pose_(prototype.relative_cylinder_pose_),
+  object_name_(object_name),
+  collision_spheres_(prototype.collision_spheres_),
+  relative_collision_points_(prototype.relative_collision_points_),
+  posed_collision_points_(prototype.relative_collision_points_)
+{
+  body_ = bodies::createBodyFromShape(shape);
+  tf::Transform ident;
+  ident.setIdentity();
+  body_->setPose(ident);
+  body_->setPadding(prototype.body_->getPadding());
 }
 
 collision_proximity::BodyDecomposition::~BodyDecomposition()
@@ -148,9 +1034,17 @@ collision_proximity::BodyDecomposition::~BodyDecomposition()
 void collision_proximity::BodyDecomposition::updateSpheresPose(const tf::Transform& trans) 
 {
  //body_->setPose(trans);
+  getPosedSpheres(trans, collision_spheres_);
+}
+
+void collision_proximity::BodyDecomposition::getPosedSpheres(const tf::Transform& trans, std::vector<CollisionSphere>& spheres) const
+{
   tf::Transform cylTransform = trans * relative_cylinder_pose_;
-  for(unsigned int i = 0; i < collision_spheres_.size(); i++) {
-    collision_spheres_[i].center_ = cylTransform*collision_spheres_[i].relative_vec_;
+  if(spheres.size() != collision_spheres_.size()) {
+    spheres = collision_spheres_;
+  }
+  for(unsigned int i = 0; i < spheres.size(); i++) {
+    spheres[i].center_ = cylTransform*collision_spheres_[i].relative_vec_;
   }
 }
 
@@ -169,3 +1063,114 @@ void collision_proximity::BodyDecomposition::updatePose(const tf::Transform& tra
   updateSpheresPose(trans);
   updatePointsPose(trans);
 }
+
+///
+/// ShapeDecompositionKey
+///
+
+collision_proximity::ShapeDecompositionKey::ShapeDecompositionKey(const shapes::Shape* shape, double res, double pad, bool surface_only,
+                                                                  SphereDecompositionMode mode, double max_error) :
+  type(shape->type),
+  mesh_hash(0),
+  resolution(res),
+  padding(pad),
+  surface_points_only(surface_only),
+  sphere_mode(mode),
+  max_sphere_error(mode == ADAPTIVE_SPHERE_DECOMPOSITION ? max_error : 0.0)
+{
+  switch(shape->type) {
+  case shapes::SPHERE:
+    dimensions.push_back(static_cast<const shapes::Sphere*>(shape)->radius);
+    break;
+  case shapes::CYLINDER:
+    dimensions.push_back(static_cast<const shapes::Cylinder*>(shape)->radius);
+    dimensions.push_back(static_cast<const shapes::Cylinder*>(shape)->length);
+    break;
+  case shapes::BOX:
+    dimensions.assign(static_cast<const shapes::Box*>(shape)->size, static_cast<const shapes::Box*>(shape)->size+3);
+    break;
+  case shapes::MESH:
+    {
+      //FNV-1a over the raw vertex and triangle data
+      const shapes::Mesh* mesh = static_cast<const shapes::Mesh*>(shape);
+      dimensions.push_back(mesh->vertexCount);
+      dimensions.push_back(mesh->triangleCount);
+      mesh_hash = 14695981039346656037ULL;
+      const unsigned char* vb = reinterpret_cast<const unsigned char*>(mesh->vertices);
+      for(unsigned int i = 0; i < mesh->vertexCount*3*sizeof(double); i++) {
+        mesh_hash = (mesh_hash ^ vb[i])*1099511628211ULL;
+      }
+      const unsigned char* tb = reinterpret_cast<const unsigned char*>(mesh->triangles);
+      for(unsigned int i = 0; i < mesh->triangleCount*3*sizeof(unsigned int); i++) {
+        mesh_hash = (mesh_hash ^ tb[i])*1099511628211ULL;
+      }
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+bool collision_proximity::ShapeDecompositionKey::operator<(const ShapeDecompositionKey& rhs) const
+{
+  if(type != rhs.type) return type < rhs.type;
+  if(resolution != rhs.resolution) return resolution < rhs.resolution;
+  if(padding != rhs.padding) return padding < rhs.padding;
+  if(surface_points_only != rhs.surface_points_only) return surface_points_only < rhs.surface_points_only;
+  if(sphere_mode != rhs.sphere_mode) return sphere_mode < rhs.sphere_mode;
+  if(max_sphere_error != rhs.max_sphere_error) return max_sphere_error < rhs.max_sphere_error;
+  if(mesh_hash != rhs.mesh_hash) return mesh_hash < rhs.mesh_hash;
+  return dimensions < rhs.dimensions;
+}
+
+///
+/// BodyDecompositionCache
+///
+
+collision_proximity::BodyDecompositionCache::BodyDecompositionCache(unsigned int max_entries) :
+  max_entries_(max_entries),
+  num_hits_(0),
+  num_misses_(0)
+{
+}
+
+collision_proximity::BodyDecompositionCache::~BodyDecompositionCache()
+{
+  clear();
+}
+
+void collision_proximity::BodyDecompositionCache::clear()
+{
+  for(std::map<ShapeDecompositionKey, BodyDecomposition*>::iterator it = entries_.begin();
+      it != entries_.end();
+      it++) {
+    delete it->second;
+  }
+  entries_.clear();
+}
+
+collision_proximity::BodyDecomposition* 
+collision_proximity::BodyDecompositionCache::createBodyDecomposition(const std::string& object_name, 
+                                                                     const shapes::Shape* shape, 
+                                                                     double resolution, 
+                                                                     double padding,
+                                                                     bool surface_points_only,
+                                                                     SphereDecompositionMode sphere_mode,
+                                                                     double max_sphere_error)
+{
+  ShapeDecompositionKey key(shape, resolution, padding, surface_points_only, sphere_mode, max_sphere_error);
+  std::map<ShapeDecompositionKey, BodyDecomposition*>::iterator it = entries_.find(key);
+  if(it != entries_.end()) {
+    num_hits_++;
+    return new BodyDecomposition(object_name, shape, *(it->second));
+  }
+  num_misses_++;
+  if(entries_.size() >= max_entries_) {
+    ROS_DEBUG_STREAM("Body decomposition cache full with " << entries_.size() << " entries, clearing");
+    clear();
+  }
+  BodyDecomposition* prototype = new BodyDecomposition(object_name, shape, resolution, padding, surface_points_only,
+                                                       sphere_mode, max_sphere_error);
+  entries_[key] = prototype;
+  return new BodyDecomposition(object_name, shape, *prototype);
+}
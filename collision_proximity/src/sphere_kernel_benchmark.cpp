@@ -0,0 +1,129 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+
+//compares the throughput of the all-pairs sphere loop over CollisionSphere lists
+//with the structure-of-arrays distance kernels
+
+#include <ros/ros.h>
+#include <collision_proximity/collision_proximity_types.h>
+#include <collision_proximity/sphere_kernels.h>
+
+using namespace collision_proximity;
+
+static double gen_rand(double min, double max)
+{
+  return min+(max-min)*(rand()/(double)RAND_MAX);
+}
+
+static void makeSpheres(unsigned int num, std::vector<CollisionSphere>& spheres, SphereArrays& arrays)
+{
+  spheres.clear();
+  arrays.resize(num);
+  for(unsigned int i = 0; i < num; i++) {
+    CollisionSphere cs(tf::Vector3(0.0,0.0,0.0), gen_rand(0.02, 0.1));
+    cs.center_ = tf::Vector3(gen_rand(-1.0, 1.0), gen_rand(-1.0, 1.0), gen_rand(-1.0, 1.0));
+    spheres.push_back(cs);
+    arrays.x[i] = cs.center_.x();
+    arrays.y[i] = cs.center_.y();
+    arrays.z[i] = cs.center_.z();
+    arrays.radius[i] = cs.radius_;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int num_spheres = 64;
+  unsigned int num_trials = 20000;
+  if(argc > 1) {
+    num_spheres = atoi(argv[1]);
+  }
+  if(argc > 2) {
+    num_trials = atoi(argv[2]);
+  }
+  srand(0);
+  std::vector<CollisionSphere> spheres1, spheres2;
+  SphereArrays arrays1, arrays2;
+  makeSpheres(num_spheres, spheres1, arrays1);
+  makeSpheres(num_spheres, spheres2, arrays2);
+  double pairs = (double)num_spheres*num_spheres*num_trials;
+
+  double loop_min = DBL_MAX;
+  ros::WallTime n1 = ros::WallTime::now();
+  for(unsigned int t = 0; t < num_trials; t++) {
+    for(unsigned int k = 0; k < spheres1.size(); k++) {
+      for(unsigned int l = 0; l < spheres2.size(); l++) {
+        double dist = spheres1[k].center_.distance(spheres2[l].center_);
+        dist += -spheres1[k].radius_-spheres2[l].radius_;
+        if(dist < loop_min) {
+          loop_min = dist;
+        }
+      }
+    }
+  }
+  double loop_time = (ros::WallTime::now()-n1).toSec();
+
+  double kernel_min = DBL_MAX;
+  unsigned int argmin1, argmin2;
+  n1 = ros::WallTime::now();
+  for(unsigned int t = 0; t < num_trials; t++) {
+    kernel_min = std::min(kernel_min, computeMinimumSphereDistance(arrays1, 0, num_spheres, arrays2, 0, num_spheres, 
+                                                                   true, argmin1, argmin2));
+  }
+  double kernel_time = (ros::WallTime::now()-n1).toSec();
+
+  std::vector<double> matrix(num_spheres*num_spheres);
+  n1 = ros::WallTime::now();
+  for(unsigned int t = 0; t < num_trials; t++) {
+    computeSphereDistanceMatrix(arrays1, 0, num_spheres, arrays2, 0, num_spheres, true, &matrix[0]);
+  }
+  double matrix_time = (ros::WallTime::now()-n1).toSec();
+
+#if defined(COLLISION_PROXIMITY_NO_SIMD)
+  const char* path = "scalar";
+#elif defined(__AVX__)
+  const char* path = "avx";
+#elif defined(__SSE2__)
+  const char* path = "sse2";
+#else
+  const char* path = "scalar";
+#endif
+  printf("%u x %u spheres, %u trials, %s kernels\n", num_spheres, num_spheres, num_trials, path);
+  printf("current loop:   %8.2f Mpairs/s (min %f)\n", pairs/loop_time*1e-6, loop_min);
+  printf("minimum kernel: %8.2f Mpairs/s (min %f)\n", pairs/kernel_time*1e-6, kernel_min);
+  printf("matrix kernel:  %8.2f Mpairs/s\n", pairs/matrix_time*1e-6);
+  return 0;
+}
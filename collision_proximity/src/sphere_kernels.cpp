@@ -0,0 +1,222 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+
+#include <collision_proximity/sphere_kernels.h>
+#include <cfloat>
+#include <cmath>
+
+#if !defined(COLLISION_PROXIMITY_NO_SIMD) && defined(__AVX__)
+#include <immintrin.h>
+#define COLLISION_PROXIMITY_USE_AVX
+#elif !defined(COLLISION_PROXIMITY_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define COLLISION_PROXIMITY_USE_SSE2
+#endif
+
+using collision_proximity::SphereArrays;
+
+//the vector paths evaluate exactly the same expression, so all paths agree bit for bit
+static inline double getSphereDistance(double x, double y, double z, double radius,
+                                       const SphereArrays& spheres, unsigned int i, bool subtract_radii)
+{
+  double dx = spheres.x[i]-x;
+  double dy = spheres.y[i]-y;
+  double dz = spheres.z[i]-z;
+  double dist = sqrt(dx*dx+dy*dy+dz*dz);
+  if(subtract_radii) {
+    dist -= radius+spheres.radius[i];
+  }
+  return dist;
+}
+
+void collision_proximity::computeSphereDistances(double x, double y, double z, double radius,
+                                                 const SphereArrays& spheres, unsigned int begin, unsigned int end,
+                                                 bool subtract_radii, double* distances)
+{
+  unsigned int i = begin;
+#if defined(COLLISION_PROXIMITY_USE_AVX)
+  __m256d px = _mm256_set1_pd(x);
+  __m256d py = _mm256_set1_pd(y);
+  __m256d pz = _mm256_set1_pd(z);
+  __m256d pr = _mm256_set1_pd(radius);
+  for(; i+4 <= end; i += 4) {
+    __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&spheres.x[i]), px);
+    __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&spheres.y[i]), py);
+    __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&spheres.z[i]), pz);
+    __m256d dist = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)));
+    if(subtract_radii) {
+      dist = _mm256_sub_pd(dist, _mm256_add_pd(pr, _mm256_loadu_pd(&spheres.radius[i])));
+    }
+    _mm256_storeu_pd(distances+(i-begin), dist);
+  }
+#elif defined(COLLISION_PROXIMITY_USE_SSE2)
+  __m128d px = _mm_set1_pd(x);
+  __m128d py = _mm_set1_pd(y);
+  __m128d pz = _mm_set1_pd(z);
+  __m128d pr = _mm_set1_pd(radius);
+  for(; i+2 <= end; i += 2) {
+    __m128d dx = _mm_sub_pd(_mm_loadu_pd(&spheres.x[i]), px);
+    __m128d dy = _mm_sub_pd(_mm_loadu_pd(&spheres.y[i]), py);
+    __m128d dz = _mm_sub_pd(_mm_loadu_pd(&spheres.z[i]), pz);
+    __m128d dist = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz)));
+    if(subtract_radii) {
+      dist = _mm_sub_pd(dist, _mm_add_pd(pr, _mm_loadu_pd(&spheres.radius[i])));
+    }
+    _mm_storeu_pd(distances+(i-begin), dist);
+  }
+#endif
+  for(; i < end; i++) {
+    distances[i-begin] = getSphereDistance(x, y, z, radius, spheres, i, subtract_radii);
+  }
+}
+
+void collision_proximity::computeSphereDistanceMatrix(const SphereArrays& spheres1, unsigned int begin1, unsigned int end1,
+                                                      const SphereArrays& spheres2, unsigned int begin2, unsigned int end2,
+                                                      bool subtract_radii, double* distances)
+{
+  unsigned int row_size = end2-begin2;
+  for(unsigned int k = begin1; k < end1; k++) {
+    computeSphereDistances(spheres1.x[k], spheres1.y[k], spheres1.z[k], spheres1.radius[k],
+                           spheres2, begin2, end2, subtract_radii, distances+(k-begin1)*row_size);
+  }
+}
+
+double collision_proximity::computeMinimumSphereDistance(double x, double y, double z, double radius,
+                                                         const SphereArrays& spheres, unsigned int begin, unsigned int end,
+                                                         bool subtract_radii, unsigned int& argmin)
+{
+  double min_dist = DBL_MAX;
+  argmin = begin;
+  unsigned int i = begin;
+#if defined(COLLISION_PROXIMITY_USE_AVX) || defined(COLLISION_PROXIMITY_USE_SSE2)
+#if defined(COLLISION_PROXIMITY_USE_AVX)
+  const unsigned int width = 4;
+#else
+  const unsigned int width = 2;
+#endif
+  if(end-begin >= width) {
+    //lane-wise minima with the first index reaching them, reduced below
+    double lane_min[width];
+    double lane_index[width];
+    unsigned int count = (end-begin)/width*width;
+#if defined(COLLISION_PROXIMITY_USE_AVX)
+    __m256d px = _mm256_set1_pd(x);
+    __m256d py = _mm256_set1_pd(y);
+    __m256d pz = _mm256_set1_pd(z);
+    __m256d pr = _mm256_set1_pd(radius);
+    __m256d vmin = _mm256_set1_pd(DBL_MAX);
+    __m256d vindex = _mm256_set1_pd(begin);
+    __m256d index = _mm256_set_pd(begin+3, begin+2, begin+1, begin);
+    __m256d step = _mm256_set1_pd(width);
+    for(; i < begin+count; i += width) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&spheres.x[i]), px);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&spheres.y[i]), py);
+      __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&spheres.z[i]), pz);
+      __m256d dist = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)));
+      if(subtract_radii) {
+        dist = _mm256_sub_pd(dist, _mm256_add_pd(pr, _mm256_loadu_pd(&spheres.radius[i])));
+      }
+      __m256d less = _mm256_cmp_pd(dist, vmin, _CMP_LT_OQ);
+      vmin = _mm256_blendv_pd(vmin, dist, less);
+      vindex = _mm256_blendv_pd(vindex, index, less);
+      index = _mm256_add_pd(index, step);
+    }
+    _mm256_storeu_pd(lane_min, vmin);
+    _mm256_storeu_pd(lane_index, vindex);
+#else
+    __m128d px = _mm_set1_pd(x);
+    __m128d py = _mm_set1_pd(y);
+    __m128d pz = _mm_set1_pd(z);
+    __m128d pr = _mm_set1_pd(radius);
+    __m128d vmin = _mm_set1_pd(DBL_MAX);
+    __m128d vindex = _mm_set1_pd(begin);
+    __m128d index = _mm_set_pd(begin+1, begin);
+    __m128d step = _mm_set1_pd(width);
+    for(; i < begin+count; i += width) {
+      __m128d dx = _mm_sub_pd(_mm_loadu_pd(&spheres.x[i]), px);
+      __m128d dy = _mm_sub_pd(_mm_loadu_pd(&spheres.y[i]), py);
+      __m128d dz = _mm_sub_pd(_mm_loadu_pd(&spheres.z[i]), pz);
+      __m128d dist = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz)));
+      if(subtract_radii) {
+        dist = _mm_sub_pd(dist, _mm_add_pd(pr, _mm_loadu_pd(&spheres.radius[i])));
+      }
+      __m128d less = _mm_cmplt_pd(dist, vmin);
+      vmin = _mm_or_pd(_mm_and_pd(less, dist), _mm_andnot_pd(less, vmin));
+      vindex = _mm_or_pd(_mm_and_pd(less, index), _mm_andnot_pd(less, vindex));
+      index = _mm_add_pd(index, step);
+    }
+    _mm_storeu_pd(lane_min, vmin);
+    _mm_storeu_pd(lane_index, vindex);
+#endif
+    for(unsigned int l = 0; l < width; l++) {
+      unsigned int lane_argmin = (unsigned int)lane_index[l];
+      if(lane_min[l] < min_dist || (lane_min[l] == min_dist && lane_argmin < argmin)) {
+        min_dist = lane_min[l];
+        argmin = lane_argmin;
+      }
+    }
+  }
+#endif
+  for(; i < end; i++) {
+    double dist = getSphereDistance(x, y, z, radius, spheres, i, subtract_radii);
+    if(dist < min_dist) {
+      min_dist = dist;
+      argmin = i;
+    }
+  }
+  return min_dist;
+}
+
+double collision_proximity::computeMinimumSphereDistance(const SphereArrays& spheres1, unsigned int begin1, unsigned int end1,
+                                                         const SphereArrays& spheres2, unsigned int begin2, unsigned int end2,
+                                                         bool subtract_radii, unsigned int& argmin1, unsigned int& argmin2)
+{
+  double min_dist = DBL_MAX;
+  argmin1 = begin1;
+  argmin2 = begin2;
+  for(unsigned int k = begin1; k < end1; k++) {
+    unsigned int l;
+    double dist = computeMinimumSphereDistance(spheres1.x[k], spheres1.y[k], spheres1.z[k], spheres1.radius[k],
+                                               spheres2, begin2, end2, subtract_radii, l);
+    if(dist < min_dist) {
+      min_dist = dist;
+      argmin1 = k;
+      argmin2 = l;
+    }
+  }
+  return min_dist;
+}
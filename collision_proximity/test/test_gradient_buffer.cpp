@@ -0,0 +1,243 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <new>
+
+#include <collision_proximity/collision_proximity_types.h>
+#include <distance_field/propagation_distance_field.h>
+
+using namespace collision_proximity;
+
+static bool count_allocations = false;
+static unsigned int num_allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+  if(count_allocations) {
+    num_allocations++;
+  }
+  void* p = malloc(size == 0 ? 1 : size);
+  if(p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+static const double resolution = 0.02;
+static const double max_dist = 0.25;
+
+//three short chains of spheres, the first two close enough to see each other
+static void makeBodies(std::vector<std::vector<CollisionSphere> >& bodies,
+                       std::vector<SphereHierarchy>& hierarchies,
+                       std::vector<unsigned int>& offsets)
+{
+  bodies.resize(3);
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    for(unsigned int j = 0; j < 3+2*i; j++) {
+      CollisionSphere cs(tf::Vector3(0.0, 0.0, 0.0), 0.03+0.01*i);
+      cs.center_ = tf::Vector3(0.3+0.04*j, 0.3+0.08*i, 0.3+0.1*i*i);
+      bodies[i].push_back(cs);
+    }
+  }
+  hierarchies.resize(bodies.size());
+  offsets.resize(bodies.size()+1);
+  offsets[0] = 0;
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    hierarchies[i].build(bodies[i]);
+    offsets[i+1] = offsets[i]+bodies[i].size();
+  }
+}
+
+static void makeField(distance_field::PropagationDistanceField& df)
+{
+  std::vector<tf::Vector3> points;
+  points.push_back(tf::Vector3(0.3, 0.3, 0.2));
+  points.push_back(tf::Vector3(0.5, 0.5, 0.5));
+  df.addPointsToField(points);
+}
+
+static bool computeGradients(const distance_field::PropagationDistanceField& df,
+                             const std::vector<std::vector<CollisionSphere> >& bodies,
+                             const std::vector<SphereHierarchy>& hierarchies,
+                             GradientBuffer& buffer)
+{
+  bool in_collision = false;
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    in_collision |= getCollisionSphereGradients(&df, bodies[i], buffer.environment, i, 0.0, true, max_dist, false);
+    for(unsigned int j = 0; j < bodies.size(); j++) {
+      if(i == j) continue;
+      in_collision |= getSphereListProximityGradients(bodies[i], hierarchies[i], bodies[j], hierarchies[j], 
+                                                      buffer.intra, i, j, 0.0, true);
+    }
+  }
+  return in_collision;
+}
+
+TEST(TestGradientBuffer, TestMatchesGradientInfo)
+{
+  distance_field::PropagationDistanceField df(1.0, 1.0, 1.0, resolution, 0.0, 0.0, 0.0, max_dist);
+  makeField(df);
+
+  std::vector<std::vector<CollisionSphere> > bodies;
+  std::vector<SphereHierarchy> hierarchies;
+  std::vector<unsigned int> offsets;
+  makeBodies(bodies, hierarchies, offsets);
+
+  GradientBuffer buffer;
+  buffer.setup(offsets);
+  EXPECT_EQ(bodies.size(), buffer.getNumBodies());
+  EXPECT_EQ(offsets.back(), buffer.getNumSpheres());
+  computeGradients(df, bodies, hierarchies, buffer);
+
+  std::vector<GradientInfo> env_gradients(bodies.size());
+  std::vector<GradientInfo> intra_gradients(bodies.size());
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    env_gradients[i].distances.resize(bodies[i].size(), DBL_MAX);
+    env_gradients[i].gradients.resize(bodies[i].size());
+    intra_gradients[i] = env_gradients[i];
+  }
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    getCollisionSphereGradients(&df, bodies[i], env_gradients[i], 0.0, true, max_dist, false);
+    for(unsigned int j = 0; j < bodies.size(); j++) {
+      if(i == j) continue;
+      getSphereListProximityGradients(bodies[i], hierarchies[i], bodies[j], hierarchies[j],
+                                      intra_gradients[i], intra_gradients[j], 0.0, true);
+    }
+  }
+
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    EXPECT_EQ(env_gradients[i].closest_distance, buffer.environment.closest_distances[i]);
+    EXPECT_EQ(intra_gradients[i].closest_distance, buffer.intra.closest_distances[i]);
+    for(unsigned int j = 0; j < bodies[i].size(); j++) {
+      unsigned int k = offsets[i]+j;
+      EXPECT_EQ(env_gradients[i].distances[j], buffer.environment.distances[k]);
+      EXPECT_TRUE(env_gradients[i].gradients[j] == buffer.environment.gradients[k]);
+      EXPECT_EQ(intra_gradients[i].distances[j], buffer.intra.distances[k]);
+      EXPECT_TRUE(intra_gradients[i].gradients[j] == buffer.intra.gradients[k]);
+    }
+  }
+}
+
+TEST(TestGradientBuffer, TestDistancesMatchGradients)
+{
+  distance_field::PropagationDistanceField df(1.0, 1.0, 1.0, resolution, 0.0, 0.0, 0.0, max_dist);
+  makeField(df);
+
+  std::vector<std::vector<CollisionSphere> > bodies;
+  std::vector<SphereHierarchy> hierarchies;
+  std::vector<unsigned int> offsets;
+  makeBodies(bodies, hierarchies, offsets);
+
+  GradientArrays gradients;
+  GradientArrays distances;
+  gradients.setup(offsets);
+  distances.setup(offsets);
+  for(unsigned int i = 0; i < bodies.size(); i++) {
+    getCollisionSphereGradients(&df, bodies[i], gradients, i, 0.0, false, max_dist, false);
+    getCollisionSphereDistances(&df, bodies[i], distances, i);
+    EXPECT_EQ(gradients.closest_distances[i], distances.closest_distances[i]);
+
+    //the collision check reads the same cells as the gradients
+    for(double tolerance = -0.05; tolerance < 0.1; tolerance += 0.01) {
+      bool in_collision = false;
+      for(unsigned int j = 0; j < bodies[i].size(); j++) {
+        in_collision |= (gradients.distances[offsets[i]+j]-bodies[i][j].radius_ < tolerance);
+      }
+      EXPECT_EQ(in_collision, getCollisionSphereCollision(&df, bodies[i], tolerance));
+    }
+  }
+  EXPECT_TRUE(gradients.distances == distances.distances);
+}
+
+TEST(TestGradientBuffer, TestNoAllocationsOnReuse)
+{
+  distance_field::PropagationDistanceField df(1.0, 1.0, 1.0, resolution, 0.0, 0.0, 0.0, max_dist);
+  makeField(df);
+
+  std::vector<std::vector<CollisionSphere> > bodies;
+  std::vector<SphereHierarchy> hierarchies;
+  std::vector<unsigned int> offsets;
+  makeBodies(bodies, hierarchies, offsets);
+
+  GradientBuffer buffer;
+  buffer.setup(offsets);
+  bool first_collision = computeGradients(df, bodies, hierarchies, buffer);
+  std::vector<double> first_distances = buffer.intra.distances;
+
+  num_allocations = 0;
+  count_allocations = true;
+  bool in_collision = false;
+  for(unsigned int n = 0; n < 10; n++) {
+    buffer.setup(offsets);
+    in_collision = computeGradients(df, bodies, hierarchies, buffer);
+  }
+  count_allocations = false;
+
+  EXPECT_EQ(0u, num_allocations);
+  EXPECT_EQ(first_collision, in_collision);
+  EXPECT_TRUE(first_distances == buffer.intra.distances);
+
+  //growing the buffer does allocate, shrinking back doesn't
+  std::vector<unsigned int> larger_offsets = offsets;
+  larger_offsets.push_back(offsets.back()+5);
+  num_allocations = 0;
+  count_allocations = true;
+  buffer.setup(larger_offsets);
+  count_allocations = false;
+  EXPECT_GT(num_allocations, 0u);
+  EXPECT_EQ(bodies.size()+1, buffer.getNumBodies());
+  num_allocations = 0;
+  count_allocations = true;
+  buffer.setup(offsets);
+  buffer.setup(larger_offsets);
+  count_allocations = false;
+  EXPECT_EQ(0u, num_allocations);
+}
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+
+  return RUN_ALL_TESTS();
+}
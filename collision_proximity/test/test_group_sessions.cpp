@@ -0,0 +1,296 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#include <ros/ros.h>
+#include <collision_proximity/collision_proximity_space.h>
+#include <planning_environment/models/model_utils.h>
+
+using namespace collision_proximity;
+
+static bool count_allocations = false;
+static unsigned int num_allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+  if(count_allocations) {
+    num_allocations++;
+  }
+  void* p = malloc(size == 0 ? 1 : size);
+  if(p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+//the launch file sets this, so that it can't be mistaken for a distance
+static const double undefined_distance = 7.5;
+
+//the robot state of the scene with one joint moved away from its default
+static arm_navigation_msgs::RobotState makeRobotState(const planning_models::KinematicModel* kmodel,
+                                                      const std::string& world_frame_id,
+                                                      const std::string& joint_name,
+                                                      double value)
+{
+  planning_models::KinematicState state(kmodel);
+  state.setKinematicStateToDefault();
+  std::map<std::string, double> values;
+  state.getKinematicStateValues(values);
+  values[joint_name] = value;
+  state.setKinematicState(values);
+  arm_navigation_msgs::RobotState robot_state;
+  planning_environment::convertKinematicStateToRobotState(state, ros::Time(0), world_frame_id, robot_state);
+  return robot_state;
+}
+
+static double getJointValue(CollisionProximitySpace& cps, const std::string& joint_name)
+{
+  return cps.getCollisionModelsInterface()->getPlanningSceneState()->getJointState(joint_name)->getJointStateValues()[0];
+}
+
+static bool isCollisionAllowed(CollisionProximitySpace& cps, const std::string& link_1, const std::string& link_2)
+{
+  bool allowed = false;
+  cps.getCollisionModelsInterface()->getCurrentAllowedCollisionMatrix().getAllowedCollision(link_1, link_2, allowed);
+  return allowed;
+}
+
+static void expectSameDistances(const GradientBuffer& g1, const GradientBuffer& g2)
+{
+  ASSERT_EQ(g1.distances.size(), g2.distances.size());
+  for(unsigned int i = 0; i < g1.distances.size(); i++) {
+    EXPECT_NEAR(g1.distances[i], g2.distances[i], 1e-9);
+  }
+}
+
+class TestGroupSessions : public testing::Test
+{
+protected:
+
+  virtual void SetUp() {
+    ros::NodeHandle nh;
+    cps_ = new CollisionProximitySpace(nh.resolveName("robot_description", true), false);
+    planning_environment::CollisionModelsInterface* cmi = cps_->getCollisionModelsInterface();
+    ASSERT_TRUE(cmi->loadedModels());
+    right_state_ = makeRobotState(cmi->getKinematicModel(), cmi->getWorldFrameId(), "r_shoulder_pan_joint", -0.3);
+    left_state_ = makeRobotState(cmi->getKinematicModel(), cmi->getWorldFrameId(), "l_shoulder_pan_joint", 0.3);
+    arm_navigation_msgs::PlanningScene scene;
+    scene.robot_state = right_state_;
+    ASSERT_TRUE(cps_->setPlanningScene(scene));
+  }
+
+  virtual void TearDown() {
+    delete cps_;
+  }
+
+  void setupGroup(unsigned int handle, const std::string& group_name, const arm_navigation_msgs::RobotState& state) {
+    ASSERT_TRUE(cps_->setCurrentGroupSession(handle));
+    std::vector<std::string> link_names, attached_body_names;
+    cps_->setupForGroupQueries(group_name, state, link_names, attached_body_names);
+  }
+
+  CollisionProximitySpace* cps_;
+  arm_navigation_msgs::RobotState right_state_;
+  arm_navigation_msgs::RobotState left_state_;
+};
+
+TEST_F(TestGroupSessions, TestCreateSwitchDestroy)
+{
+  EXPECT_EQ(0u, cps_->getCurrentGroupSession());
+  unsigned int h1 = cps_->createGroupSession();
+  unsigned int h2 = cps_->createGroupSession();
+  EXPECT_EQ(1u, h1);
+  EXPECT_EQ(2u, h2);
+  EXPECT_FALSE(cps_->setCurrentGroupSession(3));
+  EXPECT_EQ(0u, cps_->getCurrentGroupSession());
+
+  setupGroup(h1, "right_arm", right_state_);
+  EXPECT_EQ(h1, cps_->getCurrentGroupSession());
+
+  //destroying the current session falls back to session 0, and its handle is reused
+  cps_->destroyGroupSession(h1);
+  EXPECT_EQ(0u, cps_->getCurrentGroupSession());
+  EXPECT_FALSE(cps_->setCurrentGroupSession(h1));
+  EXPECT_EQ(h1, cps_->createGroupSession());
+  EXPECT_TRUE(cps_->setCurrentGroupSession(h2));
+
+  //session 0 can't be destroyed
+  cps_->destroyGroupSession(0);
+  EXPECT_TRUE(cps_->setCurrentGroupSession(0));
+}
+
+TEST_F(TestGroupSessions, TestSwitchRestoresSetup)
+{
+  unsigned int right = cps_->createGroupSession();
+  unsigned int left = cps_->createGroupSession();
+  setupGroup(right, "right_arm", right_state_);
+  setupGroup(left, "left_arm", left_state_);
+  EXPECT_NEAR(0.0, getJointValue(*cps_, "r_shoulder_pan_joint"), 1e-9);
+  EXPECT_NEAR(0.3, getJointValue(*cps_, "l_shoulder_pan_joint"), 1e-9);
+  EXPECT_FALSE(isCollisionAllowed(*cps_, "l_forearm_link", "base_link"));
+
+  //links the group doesn't move don't need checking against each other
+  ASSERT_TRUE(cps_->setCurrentGroupSession(right));
+  EXPECT_NEAR(-0.3, getJointValue(*cps_, "r_shoulder_pan_joint"), 1e-9);
+  EXPECT_NEAR(0.0, getJointValue(*cps_, "l_shoulder_pan_joint"), 1e-9);
+  EXPECT_TRUE(isCollisionAllowed(*cps_, "l_forearm_link", "base_link"));
+  EXPECT_FALSE(isCollisionAllowed(*cps_, "r_forearm_link", "base_link"));
+
+  ASSERT_TRUE(cps_->setCurrentGroupSession(left));
+  EXPECT_NEAR(0.3, getJointValue(*cps_, "l_shoulder_pan_joint"), 1e-9);
+  EXPECT_TRUE(isCollisionAllowed(*cps_, "r_forearm_link", "base_link"));
+}
+
+TEST_F(TestGroupSessions, TestCacheEvictionAcrossSessions)
+{
+  //the cache is configured to hold a single self field
+  unsigned int right = cps_->createGroupSession();
+  unsigned int left = cps_->createGroupSession();
+  setupGroup(right, "right_arm", right_state_);
+  GradientBuffer before;
+  cps_->getStateGradients(before, true);
+
+  setupGroup(left, "left_arm", left_state_);
+  EXPECT_EQ(2u, cps_->getSelfFieldCacheMisses());
+  setupGroup(left, "left_arm", left_state_);
+  EXPECT_EQ(1u, cps_->getSelfFieldCacheHits());
+
+  //the evicted snapshot was the right arm's, whose session still holds its field
+  ASSERT_TRUE(cps_->setCurrentGroupSession(right));
+  GradientBuffer after;
+  cps_->getStateGradients(after, true);
+  expectSameDistances(before, after);
+
+  //setting it up again rebuilds the field, evicting the left arm's snapshot in turn
+  setupGroup(right, "right_arm", right_state_);
+  EXPECT_EQ(3u, cps_->getSelfFieldCacheMisses());
+  cps_->getStateGradients(after, true);
+  expectSameDistances(before, after);
+
+  ASSERT_TRUE(cps_->setCurrentGroupSession(left));
+  GradientBuffer left_before, left_after;
+  cps_->getStateGradients(left_before, true);
+  cps_->destroyGroupSession(right);
+  setupGroup(left, "left_arm", left_state_);
+  EXPECT_EQ(4u, cps_->getSelfFieldCacheMisses());
+  cps_->getStateGradients(left_after, true);
+  expectSameDistances(left_before, left_after);
+}
+
+//states of the right arm spread over its joints
+static void makeRightArmStates(CollisionProximitySpace& cps, std::vector<std::vector<double> >& states)
+{
+  const planning_models::KinematicState::JointStateGroup* jsg = cps.getCollisionModelsInterface()->getPlanningSceneState()->getJointStateGroup("right_arm");
+  std::vector<double> values;
+  jsg->getKinematicStateValues(values);
+  states.clear();
+  for(unsigned int i = 0; i < 5; i++) {
+    for(unsigned int j = 0; j < values.size(); j++) {
+      values[j] = 0.3*sin(1.7*i+0.9*j);
+    }
+    states.push_back(values);
+  }
+}
+
+TEST_F(TestGroupSessions, TestGradientApisAgree)
+{
+  setupGroup(0, "right_arm", right_state_);
+  planning_models::KinematicState* state = cps_->getCollisionModelsInterface()->getPlanningSceneState();
+  std::vector<std::vector<double> > states;
+  makeRightArmStates(*cps_, states);
+  unsigned int num_undefined = 0;
+  for(unsigned int n = 0; n < states.size(); n++) {
+    state->getJointStateGroup("right_arm")->setKinematicState(states[n]);
+    cps_->setCurrentGroupState(*state);
+    std::vector<GradientInfo> infos;
+    GradientBuffer buffer;
+    EXPECT_EQ(cps_->getStateGradients(infos, true), cps_->getStateGradients(buffer, true));
+    ASSERT_EQ(infos.size(), buffer.getNumBodies());
+    for(unsigned int i = 0; i < infos.size(); i++) {
+      //bodies without any reading report the undefined distance either way
+      EXPECT_EQ(infos[i].closest_distance, buffer.closest_distances[i]);
+      if(infos[i].closest_distance == undefined_distance) {
+        num_undefined++;
+      }
+      ASSERT_EQ(infos[i].distances.size(), buffer.body_offsets[i+1]-buffer.body_offsets[i]);
+      for(unsigned int j = 0; j < infos[i].distances.size(); j++) {
+        EXPECT_EQ(infos[i].distances[j], buffer.distances[buffer.body_offsets[i]+j]);
+      }
+    }
+  }
+  ROS_INFO_STREAM(num_undefined << " bodies had no distance reading");
+}
+
+TEST_F(TestGroupSessions, TestStateGradientsDoNotAllocate)
+{
+  setupGroup(0, "right_arm", right_state_);
+  planning_models::KinematicState* state = cps_->getCollisionModelsInterface()->getPlanningSceneState();
+  planning_models::KinematicState::JointStateGroup* jsg = state->getJointStateGroup("right_arm");
+  std::vector<std::vector<double> > states;
+  makeRightArmStates(*cps_, states);
+
+  //the first query sizes the buffer
+  GradientBuffer buffer;
+  cps_->setCurrentGroupState(*state);
+  cps_->getStateGradients(buffer, true);
+
+  //posing the group and querying into the reused buffer, leaving out the kinematic update
+  num_allocations = 0;
+  for(unsigned int n = 0; n < states.size(); n++) {
+    jsg->setKinematicState(states[n]);
+    count_allocations = true;
+    cps_->setCurrentGroupState(*state);
+    cps_->getStateGradients(buffer, true);
+    count_allocations = false;
+  }
+  EXPECT_EQ(0u, num_allocations);
+}
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "test_group_sessions");
+  return RUN_ALL_TESTS();
+}
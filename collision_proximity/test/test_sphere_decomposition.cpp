@@ -0,0 +1,246 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/** \author E. Gil Jones */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include <collision_proximity/collision_proximity_types.h>
+
+using namespace collision_proximity;
+
+static const double resolution = 0.01;
+
+//a flat plate, which the bounding cylinder spheres badly over-approximate
+static std::vector<tf::Vector3> makePlatePoints(double& half_x, double& half_y, double& half_z)
+{
+  shapes::Box box(0.3, 0.2, 0.02);
+  half_x = 0.15;
+  half_y = 0.1;
+  half_z = 0.01;
+  return determineCollisionPoints(&box, 0.0, resolution, false);
+}
+
+TEST(TestSphereDecomposition, TestAdaptiveSpheresCoverPoints)
+{
+  double half_x, half_y, half_z;
+  std::vector<tf::Vector3> points = makePlatePoints(half_x, half_y, half_z);
+  ASSERT_FALSE(points.empty());
+
+  std::vector<CollisionSphere> spheres = determineAdaptiveCollisionSpheres(points, resolution, 0.01);
+  ASSERT_FALSE(spheres.empty());
+  EXPECT_LT(spheres.size(), points.size());
+
+  for(unsigned int i = 0; i < points.size(); i++) {
+    bool covered = false;
+    for(unsigned int j = 0; j < spheres.size() && !covered; j++) {
+      covered = (points[i]-spheres[j].relative_vec_).length() <= spheres[j].radius_-0.5*resolution;
+    }
+    EXPECT_TRUE(covered) << "Point " << i << " isn't covered with its voxel";
+  }
+}
+
+TEST(TestSphereDecomposition, TestAdaptiveSpheresRespectError)
+{
+  double half_x, half_y, half_z;
+  std::vector<tf::Vector3> points = makePlatePoints(half_x, half_y, half_z);
+
+  double max_error = 0.01;
+  std::vector<CollisionSphere> spheres = determineAdaptiveCollisionSpheres(points, resolution, max_error);
+  //no sphere made of more than one voxel reaches further than the error beyond the voxels of the plate
+  double slack = max_error+0.5*resolution+1e-9;
+  for(unsigned int i = 0; i < spheres.size(); i++) {
+    if(spheres[i].radius_ <= 0.5*resolution*sqrt(3.0)+1e-9) continue;
+    const tf::Vector3& c = spheres[i].relative_vec_;
+    EXPECT_LE(fabs(c.x())+spheres[i].radius_, half_x+slack);
+    EXPECT_LE(fabs(c.y())+spheres[i].radius_, half_y+slack);
+    EXPECT_LE(fabs(c.z())+spheres[i].radius_, half_z+slack);
+  }
+
+  //a looser error needs fewer spheres
+  std::vector<CollisionSphere> loose_spheres = determineAdaptiveCollisionSpheres(points, resolution, 0.05);
+  EXPECT_LT(loose_spheres.size(), spheres.size());
+  std::vector<CollisionSphere> single_sphere = determineAdaptiveCollisionSpheres(points, resolution, 1.0);
+  EXPECT_EQ(1u, single_sphere.size());
+}
+
+TEST(TestSphereDecomposition, TestPosingFromLink)
+{
+  shapes::Box box(0.1, 0.05, 0.2);
+  shapes::Box handle(0.02, 0.02, 0.1);
+  std::vector<tf::Transform> fixed_transforms(2);
+  fixed_transforms[0] = tf::Transform(tf::Quaternion(tf::Vector3(0.0, 1.0, 0.0), 0.3), tf::Vector3(0.1, 0.0, 0.05));
+  fixed_transforms[1] = tf::Transform(tf::Quaternion(tf::Vector3(1.0, 0.0, 0.0), -0.7), tf::Vector3(0.1, 0.08, 0.0));
+
+  BodyDecompositionVector by_body, by_link;
+  by_body.addToVector(new BodyDecomposition("box", &box, resolution, 0.01, false, ADAPTIVE_SPHERE_DECOMPOSITION, 0.01));
+  by_body.addToVector(new BodyDecomposition("handle", &handle, resolution, 0.01, false, ADAPTIVE_SPHERE_DECOMPOSITION, 0.01));
+  by_link.addToVector(new BodyDecomposition("box", &box, resolution, 0.01, false, ADAPTIVE_SPHERE_DECOMPOSITION, 0.01));
+  by_link.addToVector(new BodyDecomposition("handle", &handle, resolution, 0.01, false, ADAPTIVE_SPHERE_DECOMPOSITION, 0.01));
+  by_link.setLinkRelativeTransforms(fixed_transforms);
+
+  tf::Transform link_pose(tf::Quaternion(tf::Vector3(0.3, 0.2, 1.0).normalized(), 1.1), tf::Vector3(0.5, -0.2, 0.8));
+  for(unsigned int i = 0; i < fixed_transforms.size(); i++) {
+    by_body.updateSpheresPose(i, link_pose*fixed_transforms[i]);
+  }
+  by_link.updateSpheresPoseFromLink(link_pose);
+
+  ASSERT_EQ(by_body.getCollisionSpheres().size(), by_link.getCollisionSpheres().size());
+  for(unsigned int i = 0; i < by_body.getCollisionSpheres().size(); i++) {
+    EXPECT_NEAR(0.0, by_body.getCollisionSpheres()[i].center_.distance(by_link.getCollisionSpheres()[i].center_), 1e-9);
+  }
+}
+
+TEST(TestSphereDecomposition, TestPosedCopies)
+{
+  shapes::Box box(0.1, 0.05, 0.2);
+  BodyDecomposition bd("box", &box, resolution, 0.01, false, ADAPTIVE_SPHERE_DECOMPOSITION, 0.01);
+  std::vector<CollisionSphere> start_spheres = bd.getCollisionSpheres();
+
+  tf::Transform pose(tf::Quaternion(tf::Vector3(0.3, 0.2, 1.0).normalized(), 1.1), tf::Vector3(0.5, -0.2, 0.8));
+  std::vector<CollisionSphere> posed;
+  bd.getPosedSpheres(pose, posed);
+
+  //the decomposition itself doesn't move
+  ASSERT_EQ(start_spheres.size(), bd.getCollisionSpheres().size());
+  for(unsigned int i = 0; i < start_spheres.size(); i++) {
+    EXPECT_TRUE(start_spheres[i].center_ == bd.getCollisionSpheres()[i].center_);
+  }
+
+  bd.updateSpheresPose(pose);
+  ASSERT_EQ(posed.size(), bd.getCollisionSpheres().size());
+  for(unsigned int i = 0; i < posed.size(); i++) {
+    EXPECT_NEAR(0.0, posed[i].center_.distance(bd.getCollisionSpheres()[i].center_), 1e-9);
+    EXPECT_EQ(posed[i].radius_, bd.getCollisionSpheres()[i].radius_);
+  }
+}
+
+static bool containsPoint(const std::vector<tf::Vector3>& points, const tf::Vector3& p)
+{
+  for(unsigned int i = 0; i < points.size(); i++) {
+    if(points[i].distance(p) < 1e-6) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//the mesh owns its arrays and deletes them, so they are copies
+static void makeMesh(shapes::Mesh& mesh, const std::vector<double>& vertices, const std::vector<unsigned int>& triangles)
+{
+  mesh.vertexCount = vertices.size()/3;
+  mesh.vertices = new double[vertices.size()];
+  std::copy(vertices.begin(), vertices.end(), mesh.vertices);
+  mesh.triangleCount = triangles.size()/3;
+  mesh.triangles = new unsigned int[triangles.size()];
+  std::copy(triangles.begin(), triangles.end(), mesh.triangles);
+  mesh.normals = NULL;
+}
+
+TEST(TestSphereDecomposition, TestConcaveMeshFilledToHull)
+{
+  //an L shaped prism, whose hull also covers the notch between the legs
+  double outline[6][2] = {{0.0, 0.0}, {0.2, 0.0}, {0.2, 0.1}, {0.1, 0.1}, {0.1, 0.2}, {0.0, 0.2}};
+  std::vector<double> vertices;
+  for(unsigned int z = 0; z < 2; z++) {
+    for(unsigned int i = 0; i < 6; i++) {
+      vertices.push_back(outline[i][0]+0.0025);
+      vertices.push_back(outline[i][1]+0.0025);
+      vertices.push_back(z == 0 ? -0.0525 : 0.0525);
+    }
+  }
+  unsigned int caps[4][3] = {{0, 1, 2}, {0, 2, 3}, {0, 3, 4}, {0, 4, 5}};
+  std::vector<unsigned int> triangles;
+  for(unsigned int i = 0; i < 4; i++) {
+    triangles.push_back(caps[i][0]); triangles.push_back(caps[i][2]); triangles.push_back(caps[i][1]);
+    triangles.push_back(caps[i][0]+6); triangles.push_back(caps[i][1]+6); triangles.push_back(caps[i][2]+6);
+  }
+  for(unsigned int i = 0; i < 6; i++) {
+    unsigned int j = (i+1)%6;
+    triangles.push_back(i); triangles.push_back(j); triangles.push_back(j+6);
+    triangles.push_back(i); triangles.push_back(j+6); triangles.push_back(i+6);
+  }
+  shapes::Mesh mesh;
+  makeMesh(mesh, vertices, triangles);
+
+  std::vector<tf::Vector3> points = determineCollisionPoints(&mesh, 0.0, resolution, false);
+  EXPECT_TRUE(containsPoint(points, tf::Vector3(0.05, 0.05, 0.0)));
+  EXPECT_TRUE(containsPoint(points, tf::Vector3(0.13, 0.13, 0.0)));
+  EXPECT_TRUE(containsPoint(points, tf::Vector3(0.13, 0.13, 0.05)));
+  EXPECT_FALSE(containsPoint(points, tf::Vector3(0.18, 0.18, 0.0)));
+  EXPECT_FALSE(containsPoint(points, tf::Vector3(0.05, 0.05, 0.06)));
+}
+
+TEST(TestSphereDecomposition, TestOpenMeshFilled)
+{
+  //a box without its top, which voxelizes like the closed box
+  double half = 0.0525;
+  std::vector<double> vertices;
+  for(unsigned int i = 0; i < 8; i++) {
+    vertices.push_back(i & 1 ? half : -half);
+    vertices.push_back(i & 2 ? half : -half);
+    vertices.push_back(i & 4 ? half : -half);
+  }
+  unsigned int faces[5][4] = {{0, 2, 3, 1}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+  std::vector<unsigned int> triangles;
+  for(unsigned int i = 0; i < 5; i++) {
+    triangles.push_back(faces[i][0]); triangles.push_back(faces[i][1]); triangles.push_back(faces[i][2]);
+    triangles.push_back(faces[i][0]); triangles.push_back(faces[i][2]); triangles.push_back(faces[i][3]);
+  }
+  shapes::Mesh mesh;
+  makeMesh(mesh, vertices, triangles);
+  shapes::Box box(2.0*half, 2.0*half, 2.0*half);
+
+  std::vector<tf::Vector3> mesh_points = determineCollisionPoints(&mesh, 0.0, resolution, false);
+  std::vector<tf::Vector3> box_points = determineCollisionPoints(&box, 0.0, resolution, false);
+  EXPECT_TRUE(containsPoint(mesh_points, tf::Vector3(0.0, 0.0, 0.0)));
+  ASSERT_EQ(box_points.size(), mesh_points.size());
+  for(unsigned int i = 0; i < box_points.size(); i++) {
+    EXPECT_TRUE(containsPoint(mesh_points, box_points[i]));
+  }
+
+  //the surface points also agree
+  mesh_points = determineCollisionPoints(&mesh, 0.0, resolution, true);
+  box_points = determineCollisionPoints(&box, 0.0, resolution, true);
+  EXPECT_EQ(box_points.size(), mesh_points.size());
+  EXPECT_FALSE(containsPoint(mesh_points, tf::Vector3(0.0, 0.0, 0.0)));
+}
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,192 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/** \author E. Gil Jones */
+#include <gtest/gtest.h>
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+
+#include <collision_proximity/collision_proximity_types.h>
+
+using namespace collision_proximity;
+
+static const double link_1 = 0.4;
+static const double link_2 = 0.3;
+
+//planar arm with two revolute joints, the sphere at the end of the second link
+static BodyJointChain makePlanarChain(std::vector<double>& chain_lengths)
+{
+  BodyJointChain chain;
+  for(unsigned int i = 0; i < 2; i++) {
+    chain.joint_types.push_back(CHAIN_REVOLUTE);
+    chain.variable_indices.push_back(i);
+    chain.variable_counts.push_back(1);
+    chain.link_state_indices.push_back(i);
+  }
+  chain_lengths.assign(1, link_1);
+  return chain;
+}
+
+static void getPlanarPosition(double q0, double q1, double& x, double& y)
+{
+  x = link_1*cos(q0)+link_2*cos(q0+q1);
+  y = link_1*sin(q0)+link_2*sin(q0+q1);
+}
+
+static double randomValue(double min, double max)
+{
+  return min+(max-min)*(rand()/(double)RAND_MAX);
+}
+
+TEST(TestSweptSpheres, TestRevoluteBoundsCoverMotion)
+{
+  std::vector<double> chain_lengths;
+  BodyJointChain chain = makePlanarChain(chain_lengths);
+  srand(7);
+  for(unsigned int t = 0; t < 200; t++) {
+    std::vector<double> start(2), end(2);
+    for(unsigned int i = 0; i < 2; i++) {
+      start[i] = randomValue(-M_PI, M_PI);
+      end[i] = start[i]+randomValue(-0.5, 0.5);
+    }
+    double fixed_motion, lever_motion;
+    computeChainMotionBounds(chain, chain_lengths, start, end, fixed_motion, lever_motion);
+    double dq0 = fabs(end[0]-start[0]);
+    double dq1 = fabs(end[1]-start[1]);
+    EXPECT_NEAR(dq0*link_1, fixed_motion, 1e-12);
+    EXPECT_NEAR(dq0+dq1, lever_motion, 1e-12);
+
+    double bound = fixed_motion+lever_motion*link_2;
+    double sx, sy;
+    getPlanarPosition(start[0], start[1], sx, sy);
+    for(unsigned int s = 0; s <= 20; s++) {
+      double a = s/20.0;
+      double x, y;
+      getPlanarPosition(start[0]+a*(end[0]-start[0]), start[1]+a*(end[1]-start[1]), x, y);
+      EXPECT_LE(hypot(x-sx, y-sy), bound+1e-12);
+    }
+  }
+}
+
+TEST(TestSweptSpheres, TestPrismaticAndUnboundedJoints)
+{
+  //prismatic joint under a revolute joint lengthens the chain the revolute joint swings
+  BodyJointChain chain;
+  chain.joint_types.push_back(CHAIN_REVOLUTE);
+  chain.joint_types.push_back(CHAIN_PRISMATIC);
+  for(unsigned int i = 0; i < 2; i++) {
+    chain.variable_indices.push_back(i);
+    chain.variable_counts.push_back(1);
+    chain.link_state_indices.push_back(i);
+  }
+  std::vector<double> chain_lengths(1, link_1);
+  std::vector<double> start(2, 0.0), end(2, 0.0);
+  end[0] = 0.2;
+  end[1] = 0.1;
+  double fixed_motion, lever_motion;
+  computeChainMotionBounds(chain, chain_lengths, start, end, fixed_motion, lever_motion);
+  EXPECT_NEAR(0.1+0.2*(link_1+0.1), fixed_motion, 1e-12);
+  EXPECT_NEAR(0.2, lever_motion, 1e-12);
+
+  //an unbounded joint only makes the bound infinite if it moves
+  BodyJointChain floating_chain;
+  floating_chain.joint_types.push_back(CHAIN_UNBOUNDED);
+  floating_chain.joint_types.push_back(CHAIN_REVOLUTE);
+  floating_chain.variable_indices.push_back(0);
+  floating_chain.variable_indices.push_back(3);
+  floating_chain.variable_counts.push_back(3);
+  floating_chain.variable_counts.push_back(1);
+  floating_chain.link_state_indices.push_back(0);
+  floating_chain.link_state_indices.push_back(1);
+  start.assign(4, 0.0);
+  end.assign(4, 0.0);
+  end[3] = 0.5;
+  computeChainMotionBounds(floating_chain, chain_lengths, start, end, fixed_motion, lever_motion);
+  EXPECT_NEAR(0.0, fixed_motion, 1e-12);
+  EXPECT_NEAR(0.5, lever_motion, 1e-12);
+  end[1] = 0.01;
+  computeChainMotionBounds(floating_chain, chain_lengths, start, end, fixed_motion, lever_motion);
+  EXPECT_EQ(DBL_MAX, fixed_motion);
+}
+
+static SweptSphereSample makeSample(double field_clearance, double intra_clearance)
+{
+  SweptSphereSample sample;
+  sample.field_clearances.assign(2, field_clearance);
+  sample.intra_clearances.assign(2, intra_clearance);
+  sample.lever_arms.assign(2, 0.0);
+  return sample;
+}
+
+TEST(TestSweptSpheres, TestSegmentClearance)
+{
+  double slack = 0.01;
+  double tolerance = 0.0;
+  std::vector<double> bounds(2, 0.1);
+
+  //ends 0.1 and 0.2 clear leave (0.3-0.1)/2-0.01 = 0.09 in between
+  EXPECT_TRUE(isSweptSegmentClear(makeSample(0.1, DBL_MAX), makeSample(0.2, DBL_MAX), bounds, slack, tolerance));
+  EXPECT_FALSE(isSweptSegmentClear(makeSample(0.1, DBL_MAX), makeSample(0.2, DBL_MAX), bounds, slack, 0.1));
+  EXPECT_FALSE(isSweptSegmentClear(makeSample(0.05, DBL_MAX), makeSample(0.05, DBL_MAX), bounds, slack, tolerance));
+
+  //two spheres of the group can close by both of their motions
+  EXPECT_TRUE(isSweptSegmentClear(makeSample(1.0, 0.25), makeSample(1.0, 0.25), bounds, slack, tolerance));
+  EXPECT_FALSE(isSweptSegmentClear(makeSample(1.0, 0.09), makeSample(1.0, 0.09), bounds, slack, tolerance));
+
+  bounds[1] = DBL_MAX;
+  EXPECT_FALSE(isSweptSegmentClear(makeSample(1.0, DBL_MAX), makeSample(1.0, DBL_MAX), bounds, slack, tolerance));
+}
+
+TEST(TestSweptSpheres, TestRegionClearance)
+{
+  double slack = 0.01;
+  double tolerance = 0.0;
+  std::vector<double> bounds(2, 0.1);
+
+  EXPECT_TRUE(isSweptRegionClear(makeSample(0.12, DBL_MAX), bounds, slack, tolerance));
+  EXPECT_FALSE(isSweptRegionClear(makeSample(0.1, DBL_MAX), bounds, slack, tolerance));
+  EXPECT_TRUE(isSweptRegionClear(makeSample(1.0, 0.25), bounds, slack, tolerance));
+  EXPECT_FALSE(isSweptRegionClear(makeSample(1.0, 0.2), bounds, slack, tolerance));
+
+  bounds[0] = DBL_MAX;
+  EXPECT_FALSE(isSweptRegionClear(makeSample(1.0, DBL_MAX), bounds, slack, tolerance));
+}
+
+int main(int argc, char **argv){
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
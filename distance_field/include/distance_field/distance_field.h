@@ -122,6 +122,21 @@ public:
    */
   double getDistanceGradient(double x, double y, double z, double& gradient_x, double& gradient_y, double& gradient_z) const;
 
+  /**
+   * \brief Gets the distance at a location as getDistanceGradient() does, without computing the gradient.
+   *
+   * Locations outside the field or within one cell of its border have distance 0, as they
+   * do for getDistanceGradient(), but only a single cell is read.
+   */
+  double getDistanceWithoutGradient(double x, double y, double z) const;
+
+  /**
+   * \brief Gets the distances at a set of locations without computing gradients.
+   *
+   * \param distances resized to the number of points, doesn't allocate if it already has that size
+   */
+  void getDistancesWithoutGradient(const std::vector<tf::Vector3>& points, std::vector<double>& distances) const;
+
   /**
    * \brief Gets the distance to the closest obstacle at the given integer cell location.
    */
@@ -167,6 +182,9 @@ protected:
   virtual double getDistance(const T& object) const=0;
 
 private:
+  // cells for which all six neighbours are in the grid
+  bool isCellInGradientBounds(int x, int y, int z) const;
+
   int inv_twice_resolution_;
 };
 
@@ -201,7 +219,7 @@ double DistanceField<T>::getDistanceGradient(double x, double y, double z, doubl
 
   // if out of bounds, return 0 distance, and 0 gradient
   // we need extra padding of 1 to get gradients
-  if (gx<1 || gy<1 || gz<1 || gx>=this->num_cells_[this->DIM_X]-1 || gy>=this->num_cells_[this->DIM_Y]-1 || gz>=this->num_cells_[this->DIM_Z]-1)
+  if (!isCellInGradientBounds(gx, gy, gz))
   {
     gradient_x = 0.0;
     gradient_y = 0.0;
@@ -217,6 +235,36 @@ double DistanceField<T>::getDistanceGradient(double x, double y, double z, doubl
 
 }
 
+template <typename T>
+double DistanceField<T>::getDistanceWithoutGradient(double x, double y, double z) const
+{
+  int gx, gy, gz;
+
+  this->worldToGrid(x, y, z, gx, gy, gz);
+
+  // same bounds as getDistanceGradient, so that the two agree on collisions
+  if (!isCellInGradientBounds(gx, gy, gz))
+    return 0;
+
+  return getDistanceFromCell(gx,gy,gz);
+}
+
+template <typename T>
+void DistanceField<T>::getDistancesWithoutGradient(const std::vector<tf::Vector3>& points, std::vector<double>& distances) const
+{
+  distances.resize(points.size());
+  for (unsigned int i=0; i<points.size(); ++i)
+  {
+    distances[i] = getDistanceWithoutGradient(points[i].x(), points[i].y(), points[i].z());
+  }
+}
+
+template <typename T>
+inline bool DistanceField<T>::isCellInGradientBounds(int x, int y, int z) const
+{
+  return (x>=1 && y>=1 && z>=1 && x<this->num_cells_[this->DIM_X]-1 && y<this->num_cells_[this->DIM_Y]-1 && z<this->num_cells_[this->DIM_Z]-1);
+}
+
 template <typename T>
 double DistanceField<T>::getDistanceFromCell(int x, int y, int z) const
 {
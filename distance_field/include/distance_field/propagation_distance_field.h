@@ -85,6 +85,22 @@ struct PropDistanceFieldVoxel
   static const int UNINITIALIZED=-1;
 };
 
+/**
+ * \brief Compact copy of a PropagationDistanceField, holding only the voxels that are
+ * closer than the maximum distance to an obstacle.
+ */
+struct PropDistanceFieldSnapshot
+{
+  std::vector<int> cells;                       /**< Grid indices of the stored voxels */
+  std::vector<PropDistanceFieldVoxel> voxels;   /**< Voxels closer than the maximum distance */
+  std::vector<int3> obstacle_voxels;            /**< Locations of the obstacle voxels */
+
+  /**
+   * \brief Approximate memory held by the snapshot, in bytes.
+   */
+  size_t getMemorySize() const;
+};
+
 struct SignedPropDistanceFieldVoxel : public PropDistanceFieldVoxel
 {
     SignedPropDistanceFieldVoxel();
@@ -131,10 +147,30 @@ public:
   virtual void addPointsToField(const std::vector<tf::Vector3>& points);
 
   /**
-   * \brief Resets the distance field to the max_distance.
+   * \brief Resets the distance field to the max_distance and clears the set of obstacle voxels.
    */
   virtual void reset();
 
+  /**
+   * \brief Stores the voxels within the maximum distance of an obstacle in the snapshot.
+   */
+  void takeSnapshot(PropDistanceFieldSnapshot& snapshot) const;
+
+  /**
+   * \brief Restores the field to the state it was in when the snapshot was taken.
+   * \param current If the field currently holds exactly this snapshot only its voxels are
+   *        cleared, otherwise the whole field is reset first.
+   */
+  void restoreSnapshot(const PropDistanceFieldSnapshot& snapshot, const PropDistanceFieldSnapshot* current = NULL);
+
+  /**
+   * \brief Returns the number of voxels taken off the propagation queue since construction.
+   */
+  size_t getNumPropagatedVoxels() const
+  {
+    return num_propagated_voxels_;
+  }
+
   /**
    * \brief Get visualization markers for the set of occupied cells
    * \param marker the marker to be published
@@ -153,6 +189,7 @@ private:
   std::vector<std::vector<PropDistanceFieldVoxel*> > bucket_queue_;
   double max_distance_;
   int max_distance_sq_;
+  size_t num_propagated_voxels_;
 
   std::vector<double> sqrt_table_;
 
@@ -209,11 +246,20 @@ class SignedPropagationDistanceField : public DistanceField<SignedPropDistanceFi
 
     virtual void reset();
 
+    /**
+     * \brief Returns the number of voxels taken off the propagation queues since construction.
+     */
+    size_t getNumPropagatedVoxels() const
+    {
+      return num_propagated_voxels_;
+    }
+
   private:
     std::vector<std::vector<SignedPropDistanceFieldVoxel*> > positive_bucket_queue_;
     std::vector<std::vector<SignedPropDistanceFieldVoxel*> > negative_bucket_queue_;
     double max_distance_;
     int max_distance_sq_;
+    size_t num_propagated_voxels_;
 
     std::vector<double> sqrt_table_;
 
@@ -46,7 +46,8 @@ PropagationDistanceField::~PropagationDistanceField()
 
 PropagationDistanceField::PropagationDistanceField(double size_x, double size_y, double size_z, double resolution,
     double origin_x, double origin_y, double origin_z, double max_distance):
-      DistanceField<PropDistanceFieldVoxel>(size_x, size_y, size_z, resolution, origin_x, origin_y, origin_z, PropDistanceFieldVoxel(max_distance))
+      DistanceField<PropDistanceFieldVoxel>(size_x, size_y, size_z, resolution, origin_x, origin_y, origin_z, PropDistanceFieldVoxel(max_distance)),
+      num_propagated_voxels_(0)
 {
   max_distance_ = max_distance;
   int max_dist_int = ceil(max_distance_/resolution);
@@ -204,6 +205,8 @@ void PropagationDistanceField::removeObstacleVoxels(const VoxelSet& locations )
   for( it=locations.begin(); it!=locations.end(); ++it)
   {
     int3 loc = *it;
+    // no longer an obstacle, so it is added again if the obstacle comes back
+    object_voxel_locations_.erase(loc);
     bool valid = isCellValid( loc.x(), loc.y(), loc.z());
     if (!valid)
       continue;
@@ -230,6 +233,9 @@ void PropagationDistanceField::removeObstacleVoxels(const VoxelSet& locations )
       {
         PropDistanceFieldVoxel& nvoxel = getCell(nloc.x(), nloc.y(), nloc.z());
         int3& close_point = nvoxel.closest_point_;
+        // voxels that were never reached have no closest point
+        if( !isCellValid(close_point.x(), close_point.y(), close_point.z()) )
+          continue;
         PropDistanceFieldVoxel& closest_point_voxel = getCell( close_point.x(), close_point.y(), close_point.z() );
 
         if( closest_point_voxel.distance_square_ != 0 )
@@ -266,6 +272,7 @@ void PropagationDistanceField::propogate()
     while(list_it!=bucket_queue_[i].end())
     {
       PropDistanceFieldVoxel* vptr = *list_it;
+      num_propagated_voxels_++;
 
       x = vptr->location_.x();
       y = vptr->location_.y();
@@ -371,6 +378,47 @@ void PropagationDistanceField::getOccupiedVoxelMarkers(const std::string & frame
 void PropagationDistanceField::reset()
 {
   VoxelGrid<PropDistanceFieldVoxel>::reset(PropDistanceFieldVoxel(max_distance_sq_));
+  object_voxel_locations_.clear();
+}
+
+size_t PropDistanceFieldSnapshot::getMemorySize() const
+{
+  return cells.size()*(sizeof(int)+sizeof(PropDistanceFieldVoxel)) + obstacle_voxels.size()*sizeof(int3);
+}
+
+void PropagationDistanceField::takeSnapshot(PropDistanceFieldSnapshot& snapshot) const
+{
+  snapshot.cells.clear();
+  snapshot.voxels.clear();
+  for (int i=0; i<num_cells_total_; ++i)
+  {
+    if (data_[i].distance_square_ < max_distance_sq_)
+    {
+      snapshot.cells.push_back(i);
+      snapshot.voxels.push_back(data_[i]);
+    }
+  }
+  snapshot.obstacle_voxels.assign(object_voxel_locations_.begin(), object_voxel_locations_.end());
+}
+
+void PropagationDistanceField::restoreSnapshot(const PropDistanceFieldSnapshot& snapshot, const PropDistanceFieldSnapshot* current)
+{
+  if (current == NULL)
+  {
+    reset();
+  }
+  else
+  {
+    PropDistanceFieldVoxel empty(max_distance_sq_);
+    for (unsigned int i=0; i<current->cells.size(); ++i)
+      data_[current->cells[i]] = empty;
+    object_voxel_locations_.clear();
+  }
+  for (unsigned int i=0; i<snapshot.cells.size(); ++i)
+    data_[snapshot.cells[i]] = snapshot.voxels[i];
+  // the snapshot is sorted, so every insertion goes at the end
+  for (unsigned int i=0; i<snapshot.obstacle_voxels.size(); ++i)
+    object_voxel_locations_.insert(object_voxel_locations_.end(), snapshot.obstacle_voxels[i]);
 }
 
 void PropagationDistanceField::initNeighborhoods()
@@ -447,7 +495,8 @@ SignedPropagationDistanceField::~SignedPropagationDistanceField()
 
 SignedPropagationDistanceField::SignedPropagationDistanceField(double size_x, double size_y, double size_z, double resolution,
     double origin_x, double origin_y, double origin_z, double max_distance):
-      DistanceField<SignedPropDistanceFieldVoxel>(size_x, size_y, size_z, resolution, origin_x, origin_y, origin_z, SignedPropDistanceFieldVoxel(max_distance,0))
+      DistanceField<SignedPropDistanceFieldVoxel>(size_x, size_y, size_z, resolution, origin_x, origin_y, origin_z, SignedPropDistanceFieldVoxel(max_distance,0)),
+      num_propagated_voxels_(0)
 {
   max_distance_ = max_distance;
   int max_dist_int = ceil(max_distance_/resolution);
@@ -524,6 +573,7 @@ void SignedPropagationDistanceField::addPointsToField(const std::vector<tf::Vect
     while(list_it!=positive_bucket_queue_[i].end())
     {
       SignedPropDistanceFieldVoxel* vptr = *list_it;
+      num_propagated_voxels_++;
 
       x = vptr->location_.x();
       y = vptr->location_.y();
@@ -621,6 +671,7 @@ void SignedPropagationDistanceField::addPointsToField(const std::vector<tf::Vect
     while(list_it!=negative_bucket_queue_[i].end())
     {
       SignedPropDistanceFieldVoxel* vptr = *list_it;
+      num_propagated_voxels_++;
 
       x = vptr->location_.x();
       y = vptr->location_.y();
@@ -150,6 +150,149 @@ TEST(TestPropagationDistanceField, TestAddPoints)
 
 }
 
+TEST(TestPropagationDistanceField, TestResetAndReAdd)
+{
+  PropagationDistanceField df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  int numX = df.getNumCells(PropagationDistanceField::DIM_X);
+  int numY = df.getNumCells(PropagationDistanceField::DIM_Y);
+  int numZ = df.getNumCells(PropagationDistanceField::DIM_Z);
+
+  std::vector<tf::Vector3> points;
+  points.push_back(point1);
+  points.push_back(point2);
+  df.reset();
+  df.addPointsToField(points);
+  check_distance_field( df, points, numX, numY, numZ);
+
+  // points seen before the reset must be added again
+  df.reset();
+  df.addPointsToField(points);
+  check_distance_field( df, points, numX, numY, numZ);
+}
+
+// updates the field iteratively and checks it against a field rebuilt from the same points
+static void check_iterative_update(PropagationDistanceField& iterative_df, const std::vector<tf::Vector3>& points,
+                                   int numX, int numY, int numZ)
+{
+  PropagationDistanceField rebuilt_df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  iterative_df.updatePointsInField(points, true);
+  rebuilt_df.updatePointsInField(points, false);
+
+  check_distance_field( iterative_df, points, numX, numY, numZ);
+  for (int x=0; x<numX; x++) {
+    for (int y=0; y<numY; y++) {
+      for (int z=0; z<numZ; z++) {
+        ASSERT_EQ(iterative_df.getCell(x,y,z).distance_square_, rebuilt_df.getCell(x,y,z).distance_square_);
+      }
+    }
+  }
+}
+
+TEST(TestPropagationDistanceField, TestIterativeMatchesRebuild)
+{
+  PropagationDistanceField iterative_df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  int numX = iterative_df.getNumCells(PropagationDistanceField::DIM_X);
+  int numY = iterative_df.getNumCells(PropagationDistanceField::DIM_Y);
+  int numZ = iterative_df.getNumCells(PropagationDistanceField::DIM_Z);
+
+  std::vector<tf::Vector3> points_a;
+  points_a.push_back(point1);
+  points_a.push_back(tf::Vector3(0.4,0.0,0.1));
+  points_a.push_back(tf::Vector3(0.1,0.2,0.4));
+  iterative_df.reset();
+  check_iterative_update(iterative_df, points_a, numX, numY, numZ);
+
+  // move one obstacle, drop another and add a new one
+  std::vector<tf::Vector3> points_b(points_a);
+  points_b[0] = tf::Vector3(0.1,0.1,0.0);
+  points_b.pop_back();
+  points_b.push_back(point2);
+  check_iterative_update(iterative_df, points_b, numX, numY, numZ);
+
+  // the removed obstacles come back
+  check_iterative_update(iterative_df, points_a, numX, numY, numZ);
+
+  // and everything goes away
+  check_iterative_update(iterative_df, std::vector<tf::Vector3>(), numX, numY, numZ);
+  check_iterative_update(iterative_df, points_b, numX, numY, numZ);
+}
+
+TEST(TestPropagationDistanceField, TestPropagatedVoxelCount)
+{
+  PropagationDistanceField df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  EXPECT_EQ(0u, df.getNumPropagatedVoxels());
+
+  std::vector<tf::Vector3> points;
+  points.push_back(point1);
+  df.updatePointsInField(points, true);
+  size_t num_propagated = df.getNumPropagatedVoxels();
+  EXPECT_GT(num_propagated, 0u);
+
+  // nothing changed, so nothing is propagated
+  df.updatePointsInField(points, true);
+  EXPECT_EQ(num_propagated, df.getNumPropagatedVoxels());
+}
+
+TEST(TestPropagationDistanceField, TestDistanceWithoutGradient)
+{
+  PropagationDistanceField df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  std::vector<tf::Vector3> points;
+  points.push_back(point2);
+  df.addPointsToField(points);
+
+  // every cell center, including the border cells and one cell beyond the field
+  std::vector<tf::Vector3> locations;
+  for (int x=-1; x<=df.getNumCells(PropagationDistanceField::DIM_X); x++) {
+    for (int y=-1; y<=df.getNumCells(PropagationDistanceField::DIM_Y); y++) {
+      for (int z=-1; z<=df.getNumCells(PropagationDistanceField::DIM_Z); z++) {
+        locations.push_back(tf::Vector3(origin_x+x*resolution, origin_y+y*resolution, origin_z+z*resolution));
+      }
+    }
+  }
+  std::vector<double> distances;
+  df.getDistancesWithoutGradient(locations, distances);
+  ASSERT_EQ(locations.size(), distances.size());
+  for (unsigned int i=0; i<locations.size(); i++) {
+    double gx, gy, gz;
+    double dist = df.getDistanceGradient(locations[i].x(), locations[i].y(), locations[i].z(), gx, gy, gz);
+    EXPECT_EQ(dist, df.getDistanceWithoutGradient(locations[i].x(), locations[i].y(), locations[i].z()));
+    EXPECT_EQ(dist, distances[i]);
+  }
+}
+
+TEST(TestPropagationDistanceField, TestSnapshot)
+{
+  PropagationDistanceField df( width, height, depth, resolution, origin_x, origin_y, origin_z, max_dist);
+  int numX = df.getNumCells(PropagationDistanceField::DIM_X);
+  int numY = df.getNumCells(PropagationDistanceField::DIM_Y);
+  int numZ = df.getNumCells(PropagationDistanceField::DIM_Z);
+
+  std::vector<tf::Vector3> points1;
+  points1.push_back(point1);
+  std::vector<tf::Vector3> points2;
+  points2.push_back(point2);
+  points2.push_back(tf::Vector3(0.4,0.0,0.1));
+
+  PropDistanceFieldSnapshot snapshot1, snapshot2;
+  df.reset();
+  df.addPointsToField(points1);
+  df.takeSnapshot(snapshot1);
+  df.reset();
+  df.addPointsToField(points2);
+  df.takeSnapshot(snapshot2);
+  EXPECT_LT(snapshot1.cells.size(), (unsigned int)(numX*numY*numZ));
+
+  df.restoreSnapshot(snapshot1, &snapshot2);
+  check_distance_field( df, points1, numX, numY, numZ);
+  df.restoreSnapshot(snapshot2);
+  check_distance_field( df, points2, numX, numY, numZ);
+
+  // restored obstacles take part in later incremental updates
+  df.restoreSnapshot(snapshot1, &snapshot2);
+  df.updatePointsInField(points2, true);
+  check_distance_field( df, points2, numX, numY, numZ);
+}
+
 int main(int argc, char **argv){
   testing::InitGoogleTest(&argc, argv);
 